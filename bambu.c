@@ -1,10 +1,15 @@
 #include "bambu.h"
 
 #include "bambu_tunnel.h"
+#include "timestamp.h"
+#include "trace.h"
 #include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 #include <unistd.h>
 
 // URL format as copied directly from Bambu Studio source code.
@@ -18,6 +23,18 @@
 // the number of "would block" results.
 #define START_STREAM_RETRY_US (100 * 1000)  // 100ms.
 #define READ_SAMPLE_RETRY_US (50 * 1000)  // 50ms.
+#define RECV_MESSAGE_RETRY_US (100 * 1000)  // 100ms.
+
+// Starting a stream backs off from START_STREAM_RETRY_US up to this, so that a
+// printer still booting isn't hammered by every instance pointed at it.
+#define START_STREAM_RETRY_MAX_US (2 * 1000 * 1000)  // 2s.
+
+// Attempts to start a stream before giving up on a connection, i.e., after
+// waiting about 7s in total.
+#define START_STREAM_ATTEMPTS_MAX 8
+
+// Maximum size of a single control channel message.
+#define MESSAGE_MAX_SIZE (16 * 1024)
 
 // Observed frame buffer sizes averages around ~110000 bytes. Ensure callers
 // allocate plenty of space (~2x) in the absence of finding a better way to
@@ -26,10 +43,23 @@
 // Note: ctx_internal->stream_info.max_frame_size is always zero...
 #define MAX_FRAME_SIZE_BYTES (200 * 1024)
 
+// Bambu_Sample.decode_time is in 100ns units, matching how Bambu Studio's
+// GStreamer source converts it into buffer timestamps.
+#define DECODE_TIME_UNITS_PER_US 10
+
 // The internal representations of the opaque pointers.
 typedef struct {
   Bambu_Tunnel tunnel;
   Bambu_StreamInfo stream_info;
+
+  // Serializes tunnel calls between the frame and print status threads, where
+  // is_open tells whether the tunnel is usable.
+  pthread_mutex_t tunnel_mutex;
+  bool is_open;
+
+  // Wall clock time (in microseconds) corresponding to a decode_time of zero,
+  // anchored on the first sample of each connection. Zero if not yet anchored.
+  int64_t decode_time_base_us;
 } ctx_internal_t;
 
 int bambu_alloc_ctx(bambu_ctx_t* ctx) {
@@ -39,7 +69,9 @@ int bambu_alloc_ctx(bambu_ctx_t* ctx) {
     return -errno;
   }
 
+  pthread_mutex_t tunnel_mutex = PTHREAD_MUTEX_INITIALIZER;
   memset(*ctx, 0, sizeof(ctx_internal_t));
+  ((ctx_internal_t*) *ctx)->tunnel_mutex = tunnel_mutex;
   return 0;
 }
 
@@ -56,8 +88,8 @@ static void tunnel_log(void* context, int level, tchar const* msg) {
   Bambu_FreeLogMsg(msg);
 }
 
-int bambu_connect(bambu_ctx_t ctx,
-                     char* ip, char* device, char* passcode) {
+int bambu_connect(bambu_ctx_t ctx, char* ip, char* device, char* passcode,
+                  const atomic_bool* is_stopping) {
   ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
   int res;
   char url[URL_MAX_SIZE];
@@ -68,6 +100,14 @@ int bambu_connect(bambu_ctx_t ctx,
     return res;
   }
 
+  // Release the tunnel of any previous connection.
+  pthread_mutex_lock(&ctx_internal->tunnel_mutex);
+  if (ctx_internal->tunnel) {
+    Bambu_Destroy(ctx_internal->tunnel);
+    ctx_internal->tunnel = NULL;
+  }
+  pthread_mutex_unlock(&ctx_internal->tunnel_mutex);
+
   res = Bambu_Create(&ctx_internal->tunnel, url);
   if (res != Bambu_success) {
     fprintf(stderr, "Error creating Bambu tunnel: %d\n", res);
@@ -78,30 +118,43 @@ int bambu_connect(bambu_ctx_t ctx,
   Bambu_SetLogger(ctx_internal->tunnel, tunnel_log, NULL);
 #endif
 
+  ctx_internal->decode_time_base_us = 0;
+
   res = Bambu_Open(ctx_internal->tunnel);
   if (res != Bambu_success) {
     printf("Error opening Bambu tunnel: %d\n", res);
     return -1;
   }
 
-  // Attempt to start a stream indefinitely. Assumes the Bambu library will
-  // eventually return something besides "will block."
+  // Attempt to start a stream a few times. Retries back off exponentially,
+  // randomized by up to half so that instances spread out.
+  long retry_us = START_STREAM_RETRY_US;
+  int attempts = 0;
   do {
     // The second argument is undocumented. Bambu Studio source code suggests
     // "1" or "true" means "video."
     res = Bambu_StartStream(ctx_internal->tunnel, 1);
     if (res == Bambu_would_block) {
-      usleep(START_STREAM_RETRY_US);
+      if (++attempts == START_STREAM_ATTEMPTS_MAX) {
+        fprintf(stderr, "Stream not started after %d attempts\n", attempts);
+        goto close_tunnel;
+      }
+      if (atomic_load(is_stopping)) {
+        Bambu_Close(ctx_internal->tunnel);
+        return -ECANCELED;
+      }
+      usleep(retry_us - random() % (retry_us / 2));
+      retry_us = MIN(retry_us * 2, START_STREAM_RETRY_MAX_US);
     } else if (res != Bambu_success) {
       fprintf(stderr, "Error starting stream: %d\n", res);
-      return -1;
+      goto close_tunnel;
     }
   } while (res == Bambu_would_block);
 
   res = Bambu_GetStreamCount(ctx_internal->tunnel);
   if (res != 1) {
     fprintf(stderr, "Expected one video stream, got %d\n", res);
-    return -1;
+    goto close_tunnel;
   }
 
   res = Bambu_GetStreamInfo(ctx_internal->tunnel,
@@ -109,21 +162,32 @@ int bambu_connect(bambu_ctx_t ctx,
                             &ctx_internal->stream_info);
   if (res != Bambu_success) {
     fprintf(stderr, "Error getting stream info: %d\n", res);
-    return -1;
+    goto close_tunnel;
   }
 
   if (ctx_internal->stream_info.type != VIDE) {
     fprintf(stderr, "Expected stream type VIDE, got %d\n",
             ctx_internal->stream_info.type);
-    return -1;
+    goto close_tunnel;
   }
 
+  pthread_mutex_lock(&ctx_internal->tunnel_mutex);
+  ctx_internal->is_open = true;
+  pthread_mutex_unlock(&ctx_internal->tunnel_mutex);
   return 0;
+
+close_tunnel:
+  // Leave the tunnel closed so that connecting can be retried.
+  Bambu_Close(ctx_internal->tunnel);
+  return -1;
 }
 
 int bambu_disconnect(bambu_ctx_t ctx) {
   ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
-  Bambu_Close(ctx_internal->tunnel);
+  pthread_mutex_lock(&ctx_internal->tunnel_mutex);
+  ctx_internal->is_open = false;
+  if (ctx_internal->tunnel) Bambu_Close(ctx_internal->tunnel);
+  pthread_mutex_unlock(&ctx_internal->tunnel_mutex);
   return 0;
 }
 
@@ -146,15 +210,19 @@ int bambu_get_frame_height(bambu_ctx_t ctx) {
   return ctx_internal->stream_info.format.video.height;
 }
 
-int bambu_get_frame(bambu_ctx_t ctx, uint8_t** buffer, size_t* size) {
+int bambu_get_frame(bambu_ctx_t ctx, uint8_t** buffer, size_t* size,
+                    int64_t* timestamp_us) {
   ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
   Bambu_Sample sample;
+  int64_t trace_start_us = trace_begin();
   int res;
 
   // Attempt to grab a frame indefinitely. Assumes the Bambu library will
   // eventually return something besides "will block."
   do {
+    pthread_mutex_lock(&ctx_internal->tunnel_mutex);
     res = Bambu_ReadSample(ctx_internal->tunnel, &sample);
+    pthread_mutex_unlock(&ctx_internal->tunnel_mutex);
     if (res == Bambu_would_block) {
       usleep(READ_SAMPLE_RETRY_US);
     } else if (res != Bambu_success) {
@@ -169,5 +237,86 @@ int bambu_get_frame(bambu_ctx_t ctx, uint8_t** buffer, size_t* size) {
   // a copy function here instead of passing the underlying pointer.
   *buffer = (uint8_t*) sample.buffer;
   *size = sample.size;
+
+  // Map the printer's decode time onto the local wall clock, keeping the
+  // printer's frame spacing while making timestamps comparable to clients.
+  int64_t decode_time_us = sample.decode_time / DECODE_TIME_UNITS_PER_US;
+  if (ctx_internal->decode_time_base_us == 0) {
+    ctx_internal->decode_time_base_us = timestamp_now_us() - decode_time_us;
+  }
+  *timestamp_us = ctx_internal->decode_time_base_us + decode_time_us;
+  trace_end("read_sample", trace_start_us, *timestamp_us);
   return 0;
 }
+
+// Maps the printer's "gcode_state" values onto print states.
+static bambu_print_state_t parse_print_state(const char* value) {
+  static const struct {
+    const char* name;
+    bambu_print_state_t state;
+  } states[] = {
+    { "\"IDLE\"", BAMBU_PRINT_IDLE },
+    { "\"PREPARE\"", BAMBU_PRINT_PREPARING },
+    { "\"SLICING\"", BAMBU_PRINT_PREPARING },
+    { "\"RUNNING\"", BAMBU_PRINT_RUNNING },
+    { "\"PAUSE\"", BAMBU_PRINT_PAUSED },
+    { "\"FINISH\"", BAMBU_PRINT_FINISHED },
+    { "\"FAILED\"", BAMBU_PRINT_FAILED },
+  };
+  for (size_t i = 0; i < sizeof(states) / sizeof(states[0]); i++) {
+    if (strncmp(value, states[i].name, strlen(states[i].name)) == 0) {
+      return states[i].state;
+    }
+  }
+  return BAMBU_PRINT_UNKNOWN;
+}
+
+// Returns a pointer to the value of the given key in a flat JSON message, or
+// NULL if not found. Good enough for the handful of print status fields.
+static const char* find_json_value(const char* json, const char* key) {
+  const char* value = strstr(json, key);
+  if (value == NULL) {
+    return NULL;
+  }
+  value += strlen(key);
+  while (*value == ' ' || *value == ':') {
+    value++;
+  }
+  return value;
+}
+
+int bambu_get_print_status(bambu_ctx_t ctx, bambu_print_status_t* status) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+  char message[MESSAGE_MAX_SIZE];
+  int ctrl;
+  int res;
+
+  // Wait until a message with print status details arrives, ignoring any other
+  // control messages, or give up after one retry delay.
+  while (1) {
+    int size = MESSAGE_MAX_SIZE - 1;  // Leave room for a null terminator.
+    pthread_mutex_lock(&ctx_internal->tunnel_mutex);
+    res = ctx_internal->is_open
+        ? Bambu_RecvMessage(ctx_internal->tunnel, &ctrl, message, &size)
+        : Bambu_would_block;
+    pthread_mutex_unlock(&ctx_internal->tunnel_mutex);
+    if (res == Bambu_would_block) {
+      usleep(RECV_MESSAGE_RETRY_US);
+      return -EAGAIN;
+    } else if (res != Bambu_success) {
+      fprintf(stderr, "Error receiving message: %d\n", res);
+      return -1;
+    }
+    message[size] = '\0';
+
+    const char* state = find_json_value(message, "\"gcode_state\"");
+    const char* layer = find_json_value(message, "\"layer_num\"");
+    if (state == NULL && layer == NULL) {
+      continue;
+    }
+
+    status->state = state ? parse_print_state(state) : BAMBU_PRINT_UNKNOWN;
+    status->layer = layer ? atoi(layer) : -1;
+    return 0;
+  }
+}
@@ -4,6 +4,7 @@
 // network connection to a Bambu 3D printer. Exposes functions to load a single
 // camera frame into a buffer.
 
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -24,16 +25,22 @@ int bambu_free_ctx(bambu_ctx_t ctx);
 //   3. Access code generated in the Bambu network UI on the printer
 //
 // See: https://wiki.bambulab.com/en/knowledge-sharing/enable-lan-mode
-int bambu_connect(bambu_ctx_t ctx, char* ip, char* device, char* passcode);
+//
+// Gives up if the stream doesn't start after a few attempts, so that callers
+// retry with their own backoff. Returns -ECANCELED once is_stopping is set
+// between attempts.
+int bambu_connect(bambu_ctx_t ctx, char* ip, char* device, char* passcode,
+                  const atomic_bool* is_stopping);
 int bambu_disconnect(bambu_ctx_t ctx);
 
+// Returns the maximum possible frame buffer size in bytes. Unlike the
+// functions below, this does not need a connection.
+size_t bambu_get_max_frame_buffer_size(bambu_ctx_t ctx);
+
 //
 // The following functions assume a connection is established.
 //
 
-// Returns the maximum possible frame buffer size in bytes.
-size_t bambu_get_max_frame_buffer_size(bambu_ctx_t ctx);
-
 // Returns the framerate in frames-per-second (FPS).
 int bambu_get_framerate(bambu_ctx_t ctx);
 
@@ -43,4 +50,33 @@ int bambu_get_frame_height(bambu_ctx_t ctx);
 
 // Fetches a frame and passes the underlying image buffer in the given
 // arguments. The caller does NOT own this buffer and should make its own copy.
-int bambu_get_frame(bambu_ctx_t ctx, uint8_t** buffer, size_t* size);
+//
+// The frame's capture time is passed in timestamp_us as microseconds since the
+// Unix epoch (see timestamp.h).
+int bambu_get_frame(bambu_ctx_t ctx, uint8_t** buffer, size_t* size,
+                    int64_t* timestamp_us);
+
+// Print job states as reported by the printer.
+typedef enum {
+  BAMBU_PRINT_UNKNOWN,  // No status received (yet).
+  BAMBU_PRINT_IDLE,
+  BAMBU_PRINT_PREPARING,
+  BAMBU_PRINT_RUNNING,
+  BAMBU_PRINT_PAUSED,
+  BAMBU_PRINT_FINISHED,
+  BAMBU_PRINT_FAILED,
+} bambu_print_state_t;
+
+typedef struct {
+  bambu_print_state_t state;
+  int layer;  // Current layer number, or -1 if unknown.
+} bambu_print_status_t;
+
+// Waits for the next print status update on the connection's control channel
+// and passes it in the given argument. Updates may be partial, leaving the
+// state as BAMBU_PRINT_UNKNOWN or the layer as -1. Unlike the other functions,
+// this may be called from a separate thread, also while disconnected.
+//
+// Returns -EAGAIN if no update arrived within a short while (at most a second),
+// so that callers can check whether to stop before calling it again.
+int bambu_get_print_status(bambu_ctx_t ctx, bambu_print_status_t* status);
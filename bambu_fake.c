@@ -1,4 +1,6 @@
 #include "bambu.h"
+#include "config.h"
+#include "timestamp.h"
 
 #include <errno.h>
 #include <stdio.h>
@@ -9,18 +11,151 @@
 #include <jpeglib.h>
 
 // Define constants for the fake video stream.
-#define WIDTH 640       // Frame width in pixels.
-#define HEIGHT 480      // Frame height in pixels.
-#define FPS 1           // Frames per second.
-#define COLOR_COUNT 3   // Number of distinct color frames to cycle through (R, G, B).
+#define COLOR_COUNT 3   // Number of color components per pixel (R, G, B).
+#define LAYER_SECONDS 5 // Seconds between simulated print layer changes.
+#define STATUS_POLL_US (100 * 1000) // Longest wait for a print status update.
+#define LAYER_COUNT 20  // Number of layers in the simulated print job.
 
 /*
- * Generates a JPEG image of a specified size and solid color.
+ * Options configuring the fake video stream, e.g., "-o fake_width=3840", each
+ * with its default and the range its values are clamped to.
+ *
+ * A frame rate of 0 runs unthrottled, i.e., as fast as the rest of the
+ * pipeline can take frames, which is reported as FPS_UNTHROTTLED so that
+ * consumers relying on the frame rate still see a sensible value.
+ */
+#define WIDTH_OPTION "fake_width"
+#define WIDTH_DEFAULT 640
+#define WIDTH_MAX 3840
+#define HEIGHT_OPTION "fake_height"
+#define HEIGHT_DEFAULT 480
+#define HEIGHT_MAX 2160
+#define FPS_OPTION "fake_fps"
+#define FPS_DEFAULT 1
+#define FPS_MAX 120
+#define FPS_UNTHROTTLED 1000
+#define QUALITY_OPTION "fake_quality" // JPEG quality from 1 to 100.
+#define QUALITY_DEFAULT 100
+
+/*
+ * Number of distinct frames to pre-encode and cycle through. Frames are
+ * encoded once up front, so that serving them costs nothing and only the
+ * server's own work shows up when stress testing it.
+ */
+#define FRAMES_OPTION "fake_frames"
+#define FRAMES_DEFAULT 3
+#define FRAMES_MAX 256
+
+/*
+ * Content of the frames, which mostly determines their size:
+ *
+ *   - "solid" cycles through solid red, green and blue frames, which encode to
+ *     a few kilobytes at any quality.
+ *   - "gradient" draws smooth gradients that move from frame to frame.
+ *   - "noise" adds random noise on top of the gradients, like a camera sensor,
+ *     which takes realistic frame sizes, e.g., several hundred kilobytes at
+ *     1920x1080 and quality 90.
+ */
+#define PATTERN_OPTION "fake_pattern"
+#define PATTERN_DEFAULT "solid"
+#define NOISE_AMPLITUDE 8 // Maximum noise added to each color component.
+
+/*
+ * Simulated time the camera library takes to deliver a frame, i.e., keeps
+ * reporting Bambu_would_block, in milliseconds, and the maximum random
+ * deviation from it in either direction.
+ */
+#define LATENCY_OPTION "fake_latency_ms"
+#define JITTER_OPTION "fake_jitter_ms"
+#define LATENCY_MAX_MS 10000
+
+// The kinds of content the fake frames can show.
+typedef enum {
+  PATTERN_SOLID,
+  PATTERN_GRADIENT,
+  PATTERN_NOISE,
+} pattern_t;
+
+/*
+ * Internal representation of the bambu_ctx_t opaque pointer.
+ *
+ * This structure holds the state for the fake camera context, including its
+ * configuration and the pre-encoded JPEG frames that it will cycle through.
+ */
+typedef struct {
+  // The configured stream parameters.
+  int width;
+  int height;
+  int fps;
+  int quality;
+  pattern_t pattern;
+  long latency_us;
+  long jitter_us;
+  // Array of pointers to the raw JPEG data for each frame.
+  uint8_t** jpeg;
+  // Array of sizes for each corresponding JPEG data buffer.
+  size_t* jpeg_size;
+  // The number of pre-encoded frames in the arrays above.
+  int frame_count;
+  // A counter to keep track of the current frame index, used to cycle frames.
+  size_t frame_i;
+  // When the next frame is due at the configured frame rate (zero until the
+  // first frame).
+  int64_t next_frame_us;
+  // The current layer of the simulated print job, and when to report the
+  // next one (zero until the first print status call).
+  int layer;
+  int64_t next_layer_us;
+} ctx_internal_t;
+
+/*
+ * Fills a row of RGB pixels of the given frame with the configured pattern.
+ *
+ * The `frame_i` parameter selects which of the pre-encoded frames the row
+ * belongs to, so that every frame differs from the previous one, and `seed`
+ * carries the state of the random noise from row to row.
+ */
+static void fill_row(const ctx_internal_t* ctx_internal, int frame_i, int y,
+                     unsigned char* row, unsigned int* seed) {
+  static const uint8_t solid_colors[][COLOR_COUNT] = {
+    { 255, 0, 0 },
+    { 0, 255, 0 },
+    { 0, 0, 255 },
+  };
+  int width = ctx_internal->width;
+  int height = ctx_internal->height;
+
+  for (int x = 0; x < width; x++) {
+    unsigned char* pixel = &row[x * COLOR_COUNT];
+    if (ctx_internal->pattern == PATTERN_SOLID) {
+      memcpy(pixel, solid_colors[frame_i % 3], COLOR_COUNT);
+      continue;
+    }
+
+    // Gradients that shift right by a few pixels each frame.
+    int shifted_x = (x + frame_i * 8) % width;
+    int values[COLOR_COUNT] = {
+      shifted_x * 255 / width,
+      y * 255 / height,
+      (shifted_x + y) * 255 / (width + height),
+    };
+    for (int i = 0; i < COLOR_COUNT; i++) {
+      int value = values[i];
+      if (ctx_internal->pattern == PATTERN_NOISE) {
+        value += rand_r(seed) % (2 * NOISE_AMPLITUDE + 1) - NOISE_AMPLITUDE;
+      }
+      pixel[i] = value < 0 ? 0 : value > 255 ? 255 : value;
+    }
+  }
+}
+
+/*
+ * Generates a JPEG image of the configured size, quality and pattern.
  *
  * This function uses the libjpeg library to create a JPEG image in memory.
- * The image is filled with a single color specified by the `red`, `green`, and
- * `blue` parameters. The `width` and `height` parameters determine the image
- * dimensions.
+ * The image is filled by fill_row() with the content of frame `frame_i` of the
+ * configured pattern, at the dimensions and quality configured in
+ * `ctx_internal`.
  *
  * Upon successful generation, `outbuffer` will point to the newly allocated
  * buffer containing the JPEG data, and `outsize` will contain the size of this
@@ -28,8 +163,7 @@
  *
  * Returns 0 on success, or a negative errno value on failure.
  */
-int generate_jpeg(int width, int height,
-                  uint8_t red, uint8_t green, uint8_t blue,
+int generate_jpeg(const ctx_internal_t* ctx_internal, int frame_i,
                   uint8_t **outbuffer, size_t *outsize) {
   // libjpeg structures for compression and error handling.
   struct jpeg_compress_struct cinfo;
@@ -43,6 +177,8 @@ int generate_jpeg(int width, int height,
   unsigned char *buffer = NULL;
   // The size of the generated JPEG data.
   unsigned long size = 0;
+  // The state of the random noise, so that each frame gets the same noise.
+  unsigned int seed = frame_i + 1;
 
   // Step 1: Initialize the JPEG compression object.
   // Set up the standard error handler.
@@ -51,15 +187,15 @@ int generate_jpeg(int width, int height,
   jpeg_create_compress(&cinfo);
 
   // Step 2: Set the image parameters.
-  cinfo.image_width = width;
-  cinfo.image_height = height;
+  cinfo.image_width = ctx_internal->width;
+  cinfo.image_height = ctx_internal->height;
   cinfo.input_components = COLOR_COUNT; // Number of color components (R, G, B)
   cinfo.in_color_space = JCS_RGB;       // The input color space.
 
   // Set default compression parameters.
   jpeg_set_defaults(&cinfo);
   // Set the JPEG quality. 100 is highest quality, resulting in a larger file.
-  jpeg_set_quality(&cinfo, 100, TRUE);
+  jpeg_set_quality(&cinfo, ctx_internal->quality, TRUE);
 
   // Step 3: Set up the in-memory destination for the JPEG data.
   // This tells libjpeg to compress to a buffer in memory instead of a file.
@@ -71,24 +207,21 @@ int generate_jpeg(int width, int height,
 
   // Step 5: Generate and write the image data row by row.
   // Calculate the size of a single row.
-  row_stride = width * COLOR_COUNT; // width * number of components (RGB)
+  row_stride = ctx_internal->width * COLOR_COUNT; // width * number of components
   // Allocate memory for one row of image data.
   unsigned char *row = (unsigned char *)malloc(row_stride);
   if (!row) {
     fprintf(stderr, "Error allocating image row: %s\n", strerror(errno));
     jpeg_destroy_compress(&cinfo);
+    free(buffer);
     return -errno;
   }
   row_pointer[0] = row;
 
   // Main loop: process one row at a time from top to bottom.
   while (cinfo.next_scanline < cinfo.image_height) {
-    // Fill the row with the specified solid color.
-    for (int x = 0; x < width; x++) {
-      row[x * COLOR_COUNT + 0] = red;   // Red component
-      row[x * COLOR_COUNT + 1] = green; // Green component
-      row[x * COLOR_COUNT + 2] = blue;  // Blue component
-    }
+    // Fill the row with the configured pattern.
+    fill_row(ctx_internal, frame_i, cinfo.next_scanline, row, &seed);
     // Write the row to the JPEG compression stream.
     jpeg_write_scanlines(&cinfo, row_pointer, 1);
   }
@@ -105,26 +238,69 @@ int generate_jpeg(int width, int height,
 }
 
 /*
- * Internal representation of the bambu_ctx_t opaque pointer.
+ * Looks up an integer option, clamping it to the range from `min` to `max`.
  *
- * This structure holds the state for the fake camera context, including the
- * pre-generated JPEG frames that it will cycle through.
+ * Values outside of the range are reported before being clamped, so that a
+ * typo doesn't silently stress test something else than intended.
+ *
+ * Returns the option's value, or `default_value` if it is unset.
  */
-typedef struct {
-  // Array of pointers to the raw JPEG data for each color frame.
-  uint8_t* jpeg[COLOR_COUNT];
-  // Array of sizes for each corresponding JPEG data buffer.
-  size_t jpeg_size[COLOR_COUNT];
-  // A counter to keep track of the current frame index, used to cycle colors.
-  size_t frame_i;
-} ctx_internal_t;
+static long get_clamped_option(const char* key, long default_value,
+                               long min, long max) {
+  long value = config_get_int(key, default_value);
+  if (value < min || value > max) {
+    fprintf(stderr, "Clamping %s=%ld to the range from %ld to %ld\n",
+            key, value, min, max);
+    value = value < min ? min : max;
+  }
+  return value;
+}
+
+/*
+ * Reads the fake stream's options into `ctx_internal`.
+ *
+ * Returns 0 on success, or a negative errno value if the pattern is unknown.
+ */
+static int read_options(ctx_internal_t* ctx_internal) {
+  ctx_internal->width = get_clamped_option(WIDTH_OPTION, WIDTH_DEFAULT,
+                                           1, WIDTH_MAX);
+  ctx_internal->height = get_clamped_option(HEIGHT_OPTION, HEIGHT_DEFAULT,
+                                            1, HEIGHT_MAX);
+  ctx_internal->fps = get_clamped_option(FPS_OPTION, FPS_DEFAULT, 0, FPS_MAX);
+  if (ctx_internal->fps == 0) {
+    ctx_internal->fps = FPS_UNTHROTTLED;
+  }
+  ctx_internal->quality = get_clamped_option(QUALITY_OPTION, QUALITY_DEFAULT,
+                                             1, 100);
+  ctx_internal->frame_count = get_clamped_option(FRAMES_OPTION, FRAMES_DEFAULT,
+                                                 1, FRAMES_MAX);
+  ctx_internal->latency_us = get_clamped_option(LATENCY_OPTION, 0,
+                                                0, LATENCY_MAX_MS) * 1000;
+  ctx_internal->jitter_us = get_clamped_option(JITTER_OPTION, 0,
+                                               0, LATENCY_MAX_MS) * 1000;
+
+  const char* pattern = config_get_string(PATTERN_OPTION, PATTERN_DEFAULT);
+  if (strcmp(pattern, "solid") == 0) {
+    ctx_internal->pattern = PATTERN_SOLID;
+  } else if (strcmp(pattern, "gradient") == 0) {
+    ctx_internal->pattern = PATTERN_GRADIENT;
+  } else if (strcmp(pattern, "noise") == 0) {
+    ctx_internal->pattern = PATTERN_NOISE;
+  } else {
+    fprintf(stderr, "Expected %s to be solid, gradient or noise: %s\n",
+            PATTERN_OPTION, pattern);
+    return -EINVAL;
+  }
+  return 0;
+}
 
 /*
  * Allocates and initializes a new fake camera context.
  *
- * This function allocates memory for the internal context structure and then
- * pre-generates three solid-color JPEG frames (red, green, and blue). These
- * frames are stored in the context and will be served by bambu_get_frame().
+ * This function allocates memory for the internal context structure, reads
+ * the fake stream's options and then pre-encodes the configured number of
+ * JPEG frames. These frames are stored in the context and will be served by
+ * bambu_get_frame().
  *
  * The `ctx` parameter is a pointer to a bambu_ctx_t which will be updated to
  * point to the newly created context.
@@ -133,32 +309,45 @@ typedef struct {
  */
 int bambu_alloc_ctx(bambu_ctx_t* ctx) {
   // Allocate memory for the internal context structure.
-  *ctx = malloc(sizeof(ctx_internal_t));
-  if (*ctx == NULL) {
+  ctx_internal_t* ctx_internal = calloc(1, sizeof(ctx_internal_t));
+  if (ctx_internal == NULL) {
     fprintf(stderr, "Error allocating context: %s\n", strerror(errno));
     return -errno;
   }
-  // Zero out the newly allocated memory.
-  memset(*ctx, 0, sizeof(ctx_internal_t));
-
-  // Pre-generate the JPEG frames for the fake video stream.
-  ctx_internal_t* ctx_internal = (ctx_internal_t*) *ctx;
-  // Generate a red frame.
-  generate_jpeg(WIDTH, HEIGHT, 255, 0, 0,
-                &ctx_internal->jpeg[0], &ctx_internal->jpeg_size[0]);
-  // Generate a green frame.
-  generate_jpeg(WIDTH, HEIGHT, 0, 255, 0,
-                &ctx_internal->jpeg[1], &ctx_internal->jpeg_size[1]);
-  // Generate a blue frame.
-  generate_jpeg(WIDTH, HEIGHT, 0, 0, 255,
-                &ctx_internal->jpeg[2], &ctx_internal->jpeg_size[2]);
+  *ctx = (bambu_ctx_t) ctx_internal;
+
+  int res = read_options(ctx_internal);
+  if (res < 0) {
+    bambu_free_ctx(*ctx);
+    return res;
+  }
+
+  // Allocate the arrays holding the pre-encoded frames.
+  ctx_internal->jpeg = calloc(ctx_internal->frame_count, sizeof(uint8_t*));
+  ctx_internal->jpeg_size = calloc(ctx_internal->frame_count, sizeof(size_t));
+  if (ctx_internal->jpeg == NULL || ctx_internal->jpeg_size == NULL) {
+    fprintf(stderr, "Error allocating frames: %s\n", strerror(errno));
+    res = -errno;
+    bambu_free_ctx(*ctx);
+    return res;
+  }
+
+  // Pre-encode the JPEG frames for the fake video stream.
+  for (int i = 0; i < ctx_internal->frame_count; i++) {
+    res = generate_jpeg(ctx_internal, i, &ctx_internal->jpeg[i],
+                        &ctx_internal->jpeg_size[i]);
+    if (res < 0) {
+      bambu_free_ctx(*ctx);
+      return res;
+    }
+  }
   return 0;
 }
 
 /*
  * Frees all resources associated with a fake camera context.
  *
- * This function deallocates the memory used by the pre-generated JPEG frames
+ * This function deallocates the memory used by the pre-encoded JPEG frames
  * and the context structure itself. The `ctx` to be freed is passed as an
  * argument.
  *
@@ -166,13 +355,13 @@ int bambu_alloc_ctx(bambu_ctx_t* ctx) {
  */
 int bambu_free_ctx(bambu_ctx_t ctx) {
   ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
-  // Free each of the pre-generated JPEG image buffers.
-  for (int i = 0; i < COLOR_COUNT; ++i) {
-    if (ctx_internal->jpeg[i]) {
-      free(ctx_internal->jpeg[i]);
-    }
+  // Free each of the pre-encoded JPEG image buffers.
+  for (int i = 0; ctx_internal->jpeg && i < ctx_internal->frame_count; ++i) {
+    free(ctx_internal->jpeg[i]);
   }
-  // Free the context structure itself.
+  // Free the arrays and the context structure itself.
+  free(ctx_internal->jpeg);
+  free(ctx_internal->jpeg_size);
   free(ctx_internal);
   return 0;
 }
@@ -182,12 +371,13 @@ int bambu_free_ctx(bambu_ctx_t ctx) {
  *
  * This function is part of the Bambu camera API but is a no-op in this fake
  * implementation. It immediately returns success without doing anything.
- * The parameters `ctx`, `ip`, `device`, and `passcode` are ignored.
+ * The parameters `ctx`, `ip`, `device`, `passcode` and `is_stopping` are
+ * ignored.
  *
  * Always returns 0 (success).
  */
-int bambu_connect(bambu_ctx_t ctx,
-                     char* ip, char* device, char* passcode) {
+int bambu_connect(bambu_ctx_t ctx, char* ip, char* device, char* passcode,
+                  const atomic_bool* is_stopping) {
   // This is a fake implementation, so we don't need to connect to anything.
   return 0;
 }
@@ -209,7 +399,7 @@ int bambu_disconnect(bambu_ctx_t ctx) {
 /*
  * Gets the maximum possible frame buffer size.
  *
- * This function iterates through the pre-generated frames within the given `ctx`
+ * This function iterates through the pre-encoded frames within the given `ctx`
  * and returns the size of the largest one. The caller can use this to allocate
  * a sufficiently large buffer for receiving any frame from bambu_get_frame().
  *
@@ -218,8 +408,8 @@ int bambu_disconnect(bambu_ctx_t ctx) {
 size_t bambu_get_max_frame_buffer_size(bambu_ctx_t ctx) {
   ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
   size_t max_buffer_size = 0;
-  // Find the largest size among the pre-generated JPEG frames.
-  for (int i = 0; i < COLOR_COUNT; ++i) {
+  // Find the largest size among the pre-encoded JPEG frames.
+  for (int i = 0; i < ctx_internal->frame_count; ++i) {
     if (ctx_internal->jpeg_size[i] > max_buffer_size) {
       max_buffer_size = ctx_internal->jpeg_size[i];
     }
@@ -228,50 +418,112 @@ size_t bambu_get_max_frame_buffer_size(bambu_ctx_t ctx) {
 }
 
 /*
- * Gets the frame rate of the fake video stream.
- * The `ctx` parameter is ignored.
- * Returns the configured frames per second (FPS).
+ * Gets the frame rate of the fake video stream from `ctx`.
+ * Returns the configured frames per second (FPS), or FPS_UNTHROTTLED if the
+ * stream runs unthrottled.
  */
 int bambu_get_framerate(bambu_ctx_t ctx) {
-  return FPS;
+  return ((ctx_internal_t*) ctx)->fps;
 }
 
 /*
- * Gets the frame width of the fake video stream.
- * The `ctx` parameter is ignored.
+ * Gets the frame width of the fake video stream from `ctx`.
  * Returns the configured frame width in pixels.
  */
 int bambu_get_frame_width(bambu_ctx_t ctx) {
-  return WIDTH;
+  return ((ctx_internal_t*) ctx)->width;
 }
 
 /*
- * Gets the frame height of the fake video stream.
- * The `ctx` parameter is ignored.
+ * Gets the frame height of the fake video stream from `ctx`.
  * Returns the configured frame height in pixels.
  */
 int bambu_get_frame_height(bambu_ctx_t ctx) {
-  return HEIGHT;
+  return ((ctx_internal_t*) ctx)->height;
 }
 
 /*
  * Retrieves the next frame from the fake video stream.
  *
- * This function cycles through the pre-generated solid-color JPEG frames
- * (red, green, blue) stored in `ctx`. It returns a pointer to the current
+ * This function first waits until the next frame is due at the configured
+ * frame rate, unless unthrottled, and then for the configured latency, give or
+ * take the configured jitter, like the real camera library keeps reporting
+ * Bambu_would_block until a frame arrives. It then cycles through the
+ * pre-encoded JPEG frames stored in `ctx`, returning a pointer to the current
  * frame's data via the `buffer` output parameter and its size via the `size`
- * output parameter.
+ * output parameter. The current wall clock time is used as the capture time in
+ * the `timestamp_us` output parameter.
  *
  * Always returns 0 (success).
  */
-int bambu_get_frame(bambu_ctx_t ctx, uint8_t** buffer, size_t* size) {
+int bambu_get_frame(bambu_ctx_t ctx, uint8_t** buffer, size_t* size,
+                    int64_t* timestamp_us) {
   ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
 
-  // Determine which color frame to return based on the frame counter.
-  // The modulo operator ensures that we cycle through the available colors.
-  int color_index = ctx_internal->frame_i++ % COLOR_COUNT;
+  // Simulate the camera sending frames at its frame rate. A reader that falls
+  // behind gets the next frame right away, without a burst to catch up.
+  if (ctx_internal->fps != FPS_UNTHROTTLED) {
+    int64_t now_us = timestamp_now_us();
+    if (ctx_internal->next_frame_us > now_us) {
+      usleep(ctx_internal->next_frame_us - now_us);
+    } else {
+      ctx_internal->next_frame_us = now_us;
+    }
+    ctx_internal->next_frame_us += 1000 * 1000 / ctx_internal->fps;
+  }
+
+  // Simulate waiting on the camera, with a delay anywhere from the latency
+  // minus the jitter to the latency plus the jitter.
+  long delay_us = ctx_internal->latency_us;
+  if (ctx_internal->jitter_us > 0) {
+    delay_us += random() % (2 * ctx_internal->jitter_us + 1) -
+                ctx_internal->jitter_us;
+  }
+  if (delay_us > 0) {
+    usleep(delay_us);
+  }
+
+  // Determine which frame to return based on the frame counter.
+  // The modulo operator ensures that we cycle through the available frames.
+  int frame_index = ctx_internal->frame_i++ % ctx_internal->frame_count;
   // Set the output pointers to the data of the selected frame.
-  *buffer = ctx_internal->jpeg[color_index];
-  *size = ctx_internal->jpeg_size[color_index];
+  *buffer = ctx_internal->jpeg[frame_index];
+  *size = ctx_internal->jpeg_size[frame_index];
+  // A fake frame is "captured" the moment it is requested.
+  *timestamp_us = timestamp_now_us();
+  return 0;
+}
+
+/*
+ * Waits for the next print status update of a simulated print job.
+ *
+ * This function reports the next layer of a LAYER_COUNT layer print job every
+ * LAYER_SECONDS, followed by one idle period before starting over. The status
+ * is returned via the `status` output parameter.
+ *
+ * Returns 0 (success), or -EAGAIN after waiting STATUS_POLL_US without an
+ * update being due.
+ */
+int bambu_get_print_status(bambu_ctx_t ctx, bambu_print_status_t* status) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+
+  int64_t now_us = timestamp_now_us();
+  if (ctx_internal->next_layer_us == 0) {
+    ctx_internal->next_layer_us = now_us + LAYER_SECONDS * 1000 * 1000;
+  }
+  if (now_us < ctx_internal->next_layer_us) {
+    int64_t wait_us = ctx_internal->next_layer_us - now_us;
+    usleep(wait_us < STATUS_POLL_US ? wait_us : STATUS_POLL_US);
+    if (timestamp_now_us() < ctx_internal->next_layer_us) {
+      return -EAGAIN;
+    }
+  }
+  ctx_internal->next_layer_us += LAYER_SECONDS * 1000 * 1000;
+  // Advance the layer, wrapping around after an idle period.
+  ctx_internal->layer = (ctx_internal->layer + 1) % (LAYER_COUNT + 1);
+  status->state = ctx_internal->layer == 0
+      ? BAMBU_PRINT_IDLE
+      : BAMBU_PRINT_RUNNING;
+  status->layer = ctx_internal->layer;
   return 0;
 }
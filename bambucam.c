@@ -1,86 +1,523 @@
 #include "bambu.h"
+#include "config.h"
+#include "connect_limit.h"
+#include "frame_mailbox.h"
+#include "jpeg_validate.h"
+#include "metrics.h"
+#include "recorder.h"
 #include "server.h"
+#include "shm.h"
+#include "stream_cache.h"
+#include "thread_setup.h"
+#include "timestamp.h"
+#include "trace.h"
+#include <errno.h>
+#include <getopt.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
+#include <time.h>
 #include <unistd.h>
 
+// Frame rate delivered while the printer is not printing (e.g., idle, paused,
+// finished or failed), so that a mostly static scene costs fewer encodes and
+// recorded frames. The stream keeps being read at its own rate, so that frames
+// delivered for print events are current rather than buffered.
+#define IDLE_FPS_OPTION "idle_fps"
+#define IDLE_FPS_DEFAULT 0.1
+
+// Directory caching each device's stream parameters, so that startup can skip
+// the probe connection (unset disables).
+#define STREAM_CACHE_DIR_OPTION "stream_cache_dir"
+
+// Whether to keep the probe connection open as the first live session instead
+// of closing it right away, saving a handshake for the first viewer.
+#define KEEP_PROBE_OPTION "keep_probe"
+#define KEEP_PROBE_DEFAULT false
+
+// Time to wait before retrying a failed connection, which doubles after every
+// failure up to the maximum and is randomized by up to half so that a fleet of
+// instances coming up together doesn't retry in lockstep.
+#define CONNECT_RETRY_MS_OPTION "connect_retry_ms"
+#define CONNECT_RETRY_MS_DEFAULT 500
+#define CONNECT_RETRY_MAX_MS_OPTION "connect_retry_max_ms"
+#define CONNECT_RETRY_MAX_MS_DEFAULT (30 * 1000)
+
+// Whether to repair frames that end without an EOI marker by appending one,
+// rather than dropping them like other invalid frames.
+#define REPAIR_FRAMES_OPTION "repair_frames"
+#define REPAIR_FRAMES_DEFAULT true
+
+// File that SIGUSR2 dumps trace spans into when tracing (see trace.h).
+#define TRACE_FILE_OPTION "trace_file"
+#define TRACE_FILE_DEFAULT "/tmp/bambucam-trace.json"
+
+// Maximum size of a metric name, including labels.
+#define METRIC_NAME_SIZE 256
+
 typedef struct {
   // User provided arguments needed within threads.
   char* ip;
   char* device;
   char* passcode;
 
-  // Contexts accessed by the Bambu thread.
+  // Contexts accessed by the Bambu thread, which reads frames from the
+  // printer, and by the delivery thread, which hands them to everything else.
+  // The recorder and shared memory publisher are optional (NULL if disabled).
   bambu_ctx_t bambu_ctx;
   server_ctx_t server_ctx;
+  recorder_ctx_t recorder_ctx;
+  shm_ctx_t shm_ctx;
 
   // Maximum possible size (in bytes) of any frame. Used to allocate enough
   // memory for image buffers.
   size_t image_buffer_size_max;
 
+  // Latest frame read by the Bambu thread for the delivery thread, so that
+  // reading from the printer never waits on slow consumers, and how many
+  // frames it skipped were already counted in metrics. The Bambu thread counts
+  // its connections, so that the delivery thread passes on the first frame of
+  // each right away.
+  frame_mailbox_t mailbox;
+  uint64_t reported_skipped;
+  atomic_uint connection_count;
+
+  // Buffer of image_buffer_size_max bytes holding the latest repaired frame,
+  // only used by the Bambu thread.
+  uint8_t* repair_buffer;
+
   // Determines whether to open a connection to the Bambu device and start
-  // grabbing frames, e.g., when there is at least one open connection.
-  bool run_bambu;
+  // grabbing frames, e.g., when there is at least one open connection. Always
+  // set if run_always is set, e.g., while recording or publishing to shared
+  // memory for consumers the server doesn't know about.
+  //
+  // Atomic, so that the Bambu thread checks it on every frame without taking
+  // run_bambu_mutex. Changes are signaled on run_bambu_cond, which waiting
+  // threads check it under run_bambu_mutex for.
+  atomic_bool run_bambu;
+  bool run_always;
   pthread_cond_t run_bambu_cond;
   pthread_mutex_t run_bambu_mutex;
+
+  // Latest print status from the printer, which sets the delivery rate.
+  // Protected by run_bambu_mutex. The time of the latest print event (e.g., a
+  // layer change) is set by the print status thread, so that the delivery
+  // thread delivers and records the first frame captured since right away.
+  bambu_print_status_t print_status;
+  _Atomic int64_t print_event_us;
+
+  // Stream parameters everything was started with. When they came from the
+  // stream cache, the Bambu thread checks them against its first connection.
+  stream_params_t stream_params;
+  const char* stream_cache_dir;
+  bool is_stream_cached;
+
+  // Whether main left its probe connection open for the Bambu thread.
+  bool is_probe_kept;
+
+  // Set by main to stop the Bambu thread, which keeps run_bambu unset. Set by
+  // the Bambu thread if it stops because of an error. Changed while holding
+  // run_bambu_mutex, but is_stopping is also read without it.
+  atomic_bool is_stopping;
+  bool is_failed;
 } thread_ctx_t;
 
+// Sets the given deadline to the given time from now.
+static void get_deadline(struct timespec* deadline, long interval_us) {
+  clock_gettime(CLOCK_REALTIME, deadline);
+  deadline->tv_sec += interval_us / (1000 * 1000);
+  deadline->tv_nsec += (interval_us % (1000 * 1000)) * 1000;
+  if (deadline->tv_nsec >= 1000 * 1000 * 1000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000 * 1000 * 1000;
+  }
+}
+
+// Sleeps for the given time or until asked to stop. Returns whether stopping.
+static bool sleep_unless_stopping(thread_ctx_t* thread_ctx, long interval_us) {
+  struct timespec deadline;
+  get_deadline(&deadline, interval_us);
 
-static void* bambu_routine(void* ctx) {
-  thread_ctx_t* thread_ctx = (thread_ctx_t*) ctx;
+  pthread_mutex_lock(&thread_ctx->run_bambu_mutex);
+  while (!thread_ctx->is_stopping) {
+    if (pthread_cond_timedwait(&thread_ctx->run_bambu_cond,
+                               &thread_ctx->run_bambu_mutex,
+                               &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  bool is_stopping = thread_ctx->is_stopping;
+  pthread_mutex_unlock(&thread_ctx->run_bambu_mutex);
+  return is_stopping;
+}
+
+static void add_device_metric(const char* device, const char* name,
+                              double value) {
+  char metric[METRIC_NAME_SIZE];
+  snprintf(metric, METRIC_NAME_SIZE, "%s{device=\"%s\"}", name, device);
+  metrics_add(metric, value);
+}
+
+static void set_device_metric(const char* device, const char* name,
+                              double value) {
+  char metric[METRIC_NAME_SIZE];
+  snprintf(metric, METRIC_NAME_SIZE, "%s{device=\"%s\"}", name, device);
+  metrics_set(metric, value);
+}
+
+// Connects to the printer, retrying until it succeeds or the Bambu thread is
+// stopping. Each attempt holds one of the host's connection slots (see
+// connect_limit.h).
+static int connect_bambu(thread_ctx_t* thread_ctx) {
+  char* device = thread_ctx->device;
+  long retry_ms = config_get_int(CONNECT_RETRY_MS_OPTION,
+                                 CONNECT_RETRY_MS_DEFAULT);
+  long retry_max_ms = config_get_int(CONNECT_RETRY_MAX_MS_OPTION,
+                                     CONNECT_RETRY_MAX_MS_DEFAULT);
+  retry_ms = MAX(retry_ms, 1);
+  int64_t start_us = timestamp_now_us();
+  int64_t slot_wait_us = 0;
+  int attempts = 0;
+
+  while (1) {
+    int slot;
+    int64_t slot_start_us = timestamp_now_us();
+    int res = connect_limit_acquire(&slot, &thread_ctx->is_stopping);
+    if (res == -ECANCELED) {
+      return res;
+    }
+    if (res < 0) {
+      fprintf(stderr, "Error acquiring connection slot\n");
+      return res;
+    }
+    slot_wait_us += timestamp_now_us() - slot_start_us;
+
+    attempts++;
+    res = bambu_connect(thread_ctx->bambu_ctx, thread_ctx->ip, device,
+                        thread_ctx->passcode, &thread_ctx->is_stopping);
+    connect_limit_release(slot);
+    if (res == 0) {
+      break;
+    }
+    if (res == -ECANCELED) {
+      return res;
+    }
+
+    long delay_ms = retry_ms - random() % (retry_ms / 2 + 1);
+    fprintf(stderr, "Error connecting via bambu, retrying in %ldms\n",
+            delay_ms);
+    add_device_metric(device, "bambucam_connect_failures_total", 1);
+    if (sleep_unless_stopping(thread_ctx, delay_ms * 1000)) {
+      return -ECANCELED;
+    }
+    retry_ms = MIN(retry_ms * 2, MAX(retry_max_ms, retry_ms));
+  }
+
+  double connect_s = (double) (timestamp_now_us() - start_us) /
+                     TIMESTAMP_US_PER_SEC;
+  fprintf(stderr, "Connected to %s in %.1fs after %d attempt(s)\n", device,
+          connect_s, attempts);
+  add_device_metric(device, "bambucam_connects_total", 1);
+  add_device_metric(device, "bambucam_connect_seconds_total", connect_s);
+  add_device_metric(device, "bambucam_connect_slot_wait_seconds_total",
+                    (double) slot_wait_us / TIMESTAMP_US_PER_SEC);
+  set_device_metric(device, "bambucam_connect_last_seconds", connect_s);
+  set_device_metric(device, "bambucam_connect_last_attempts", attempts);
+  return 0;
+}
+
+static stream_params_t get_stream_params(bambu_ctx_t bambu_ctx) {
+  stream_params_t params = {
+    .width = bambu_get_frame_width(bambu_ctx),
+    .height = bambu_get_frame_height(bambu_ctx),
+    .fps = bambu_get_framerate(bambu_ctx),
+  };
+  return params;
+}
+
+// Checks cached stream parameters against the connected stream. On mismatch,
+// updates the cache and fails, so that a restart picks up the right ones.
+static int validate_stream_params(thread_ctx_t* thread_ctx) {
+  stream_params_t* cached = &thread_ctx->stream_params;
+  stream_params_t actual = get_stream_params(thread_ctx->bambu_ctx);
+  if (actual.width == cached->width && actual.height == cached->height &&
+      actual.fps == cached->fps) {
+    return 0;
+  }
+
+  fprintf(stderr, "Cached stream parameters %dx%d@%d are stale, got %dx%d@%d\n",
+          cached->width, cached->height, cached->fps,
+          actual.width, actual.height, actual.fps);
+  stream_cache_save(thread_ctx->stream_cache_dir, thread_ctx->device, &actual);
+  return -1;
+}
+
+// Returns the minimum time (in microseconds) between delivered frames given
+// the current print status, zero to deliver every frame.
+static long get_delivery_interval_us(thread_ctx_t* thread_ctx) {
+  switch (thread_ctx->print_status.state) {
+  case BAMBU_PRINT_UNKNOWN:  // Assume printing without any print status.
+  case BAMBU_PRINT_PREPARING:
+  case BAMBU_PRINT_RUNNING:
+    return 0;
+  default: {
+    double idle_fps = config_get_double(IDLE_FPS_OPTION, IDLE_FPS_DEFAULT);
+    return 1000 * 1000 / (idle_fps > 0 ? idle_fps : IDLE_FPS_DEFAULT);
+  }
+  }
+}
+
+
+// Checks that the given frame is a complete JPEG before it reaches any
+// consumer, where truncated frames would show up broken or fail to decode.
+// Repaired frames are passed in the given arguments instead. Returns a
+// negative value if the frame should be dropped.
+static int check_frame(thread_ctx_t* thread_ctx, uint8_t** buffer,
+                       size_t* size) {
+  size_t length;
+  switch (jpeg_validate(*buffer, *size, &length)) {
+  case JPEG_VALID:
+    *size = length;  // Without any trailing bytes.
+    return 0;
+  case JPEG_TRUNCATED:
+    if (config_get_bool(REPAIR_FRAMES_OPTION, REPAIR_FRAMES_DEFAULT) &&
+        length + JPEG_EOI_SIZE <= thread_ctx->image_buffer_size_max) {
+#ifdef DEBUG
+      fprintf(stderr, "Repairing frame truncated at %ld of %ld bytes\n",
+              length, *size);
+#endif
+      *size = jpeg_repair(*buffer, length, thread_ctx->repair_buffer);
+      *buffer = thread_ctx->repair_buffer;
+      add_device_metric(thread_ctx->device, "bambucam_repaired_frames_total",
+                        1);
+      return 0;
+    }
+    break;
+  case JPEG_INVALID:
+    break;
+  }
+  fprintf(stderr, "Dropping invalid frame of %ld bytes\n", *size);
+  add_device_metric(thread_ctx->device, "bambucam_invalid_frames_total", 1);
+  return -EINVAL;
+}
+
+// Reads frames whenever there's someone to read them for, as fast as the
+// printer sends them, and posts each valid one for the delivery thread without
+// waiting on it. Returns zero once asked to stop, or a negative
+// value on error.
+static int capture_frames(thread_ctx_t* thread_ctx) {
   bambu_ctx_t bambu_ctx = thread_ctx->bambu_ctx;
-  server_ctx_t server_ctx = thread_ctx->server_ctx;
+  bool is_connected = thread_ctx->is_probe_kept;
+  bool is_validated = !thread_ctx->is_stream_cached;
 
   while (1) {
     pthread_mutex_lock(&thread_ctx->run_bambu_mutex);
-    while (!thread_ctx->run_bambu) {
+    while (!thread_ctx->run_bambu && !thread_ctx->is_stopping) {
       pthread_cond_wait(&thread_ctx->run_bambu_cond,
                         &thread_ctx->run_bambu_mutex);
     }
+    bool is_stopping = thread_ctx->is_stopping;
     pthread_mutex_unlock(&thread_ctx->run_bambu_mutex);
+    if (is_stopping) {
+      return 0;
+    }
 
-    int res = bambu_connect(bambu_ctx, thread_ctx->ip, thread_ctx->device,
-                            thread_ctx->passcode);
-    if (res < 0) {
-      fprintf(stderr, "Error connecting via bambu\n");
-      return NULL;
+    // The kept probe connection may have gone stale while waiting for the
+    // first client, so it gets one chance to deliver a frame.
+    bool is_probe_session = is_connected;
+    int res;
+    if (!is_connected) {
+      res = connect_bambu(thread_ctx);
+      if (res == -ECANCELED) {
+        return 0;
+      }
+      if (res < 0) {
+        fprintf(stderr, "Error connecting via bambu\n");
+        return res;
+      }
+    }
+    is_connected = false;
+    atomic_fetch_add(&thread_ctx->connection_count, 1);
+
+    if (!is_validated) {
+      if (validate_stream_params(thread_ctx) < 0) {
+        return -1;
+      }
+      is_validated = true;
     }
 
-    int fps = bambu_get_framerate(bambu_ctx);
     while (1) {
-      pthread_mutex_lock(&thread_ctx->run_bambu_mutex);
-      if (!thread_ctx->run_bambu) {
-        pthread_mutex_unlock(&thread_ctx->run_bambu_mutex);
+      if (!atomic_load_explicit(&thread_ctx->run_bambu,
+                                memory_order_relaxed)) {
         break;  // Stop grabbing frames and disconnect.
       }
-      pthread_mutex_unlock(&thread_ctx->run_bambu_mutex);
 
       uint8_t* bambu_buffer = NULL;
       size_t bambu_buffer_size;
-      res = bambu_get_frame(bambu_ctx, &bambu_buffer, &bambu_buffer_size);
+      int64_t timestamp_us;
+      res = bambu_get_frame(bambu_ctx, &bambu_buffer, &bambu_buffer_size,
+                            &timestamp_us);
+      if (res < 0 && is_probe_session) {
+        fprintf(stderr, "Reconnecting after error on kept probe connection\n");
+        break;
+      }
       if (res < 0) {
         fprintf(stderr, "Error getting frame\n");
-        return NULL;
+        return res;
       }
+      is_probe_session = false;
 
       if (thread_ctx->image_buffer_size_max < bambu_buffer_size) {
         fprintf(stderr, "Destination image buffer is too small: %ld < %ld\n",
                 thread_ctx->image_buffer_size_max, bambu_buffer_size);
-        return NULL;
+        return -1;
+      }
+      if (check_frame(thread_ctx, &bambu_buffer, &bambu_buffer_size) < 0) {
+        continue;  // Read the next frame right away.
       }
 
-      server_send_image(server_ctx, bambu_buffer, bambu_buffer_size);
-      usleep(1000 * 1000 / fps);  // Wait for the next frame tick.
+      memcpy(frame_mailbox_get_buffer(thread_ctx->mailbox), bambu_buffer,
+             bambu_buffer_size);
+      frame_mailbox_post(thread_ctx->mailbox, bambu_buffer_size,
+                         timestamp_us);
     }
     bambu_disconnect(bambu_ctx);
   }
+}
+
+// Hands the latest frame to the server, shared memory and recorder, at the
+// rate for the current print status, skipping any frames read while busy with
+// the previous one. Returns once the mailbox is closed.
+static void deliver_frames(thread_ctx_t* thread_ctx) {
+  int64_t delivered_event_us = 0;
+  int64_t delivered_us = 0;
+  unsigned delivered_connection = 0;
+
+  while (1) {
+    uint8_t* buffer;
+    size_t size;
+    int64_t timestamp_us;
+    if (frame_mailbox_take(thread_ctx->mailbox, &buffer, &size,
+                           &timestamp_us) < 0) {
+      return;
+    }
+
+    uint64_t skipped = frame_mailbox_skipped(thread_ctx->mailbox);
+    if (skipped != thread_ctx->reported_skipped) {
+      add_device_metric(thread_ctx->device, "bambucam_skipped_frames_total",
+                        skipped - thread_ctx->reported_skipped);
+      thread_ctx->reported_skipped = skipped;
+    }
+
+    // Deliver and record the first frame captured since a print event, and
+    // the first frame of each connection, whatever the rate.
+    int64_t event_us = atomic_load(&thread_ctx->print_event_us);
+    bool is_print_event = event_us > delivered_event_us &&
+                          timestamp_us >= event_us;
+    unsigned connection = atomic_load(&thread_ctx->connection_count);
+    if (!is_print_event && connection == delivered_connection) {
+      pthread_mutex_lock(&thread_ctx->run_bambu_mutex);
+      long interval_us = get_delivery_interval_us(thread_ctx);
+      pthread_mutex_unlock(&thread_ctx->run_bambu_mutex);
+      if (timestamp_us - delivered_us < interval_us) {
+        continue;
+      }
+    }
+    if (is_print_event) {
+      delivered_event_us = event_us;
+    }
+    delivered_connection = connection;
+    delivered_us = timestamp_us;
+
+    int64_t trace_start_us = trace_begin();
+    server_send_image(thread_ctx->server_ctx, buffer, size, timestamp_us);
+    if (thread_ctx->shm_ctx) {
+      shm_send_image(thread_ctx->shm_ctx, buffer, size, timestamp_us);
+    }
+    if (thread_ctx->recorder_ctx) {
+      recorder_submit(thread_ctx->recorder_ctx, buffer, size, timestamp_us,
+                      is_print_event);
+    }
+    trace_end("deliver", trace_start_us, timestamp_us);
+  }
+}
+
+static void* bambu_routine(void* ctx) {
+  thread_ctx_t* thread_ctx = (thread_ctx_t*) ctx;
+  thread_setup("capture");
+
+  int res = capture_frames(thread_ctx);
+  if (res < 0) {
+    // Have main shut everything down.
+    pthread_mutex_lock(&thread_ctx->run_bambu_mutex);
+    thread_ctx->is_failed = true;
+    pthread_mutex_unlock(&thread_ctx->run_bambu_mutex);
+    kill(getpid(), SIGTERM);
+  }
+  return NULL;
+}
+
+static void* delivery_routine(void* ctx) {
+  thread_ctx_t* thread_ctx = (thread_ctx_t*) ctx;
+  thread_setup("deliver");
+  deliver_frames(thread_ctx);
+  return NULL;
+}
+
+static void* print_status_routine(void* ctx) {
+  thread_ctx_t* thread_ctx = (thread_ctx_t*) ctx;
+  thread_setup("status");
+  bambu_print_status_t status;
+
+  int res = 0;
+  while (!atomic_load(&thread_ctx->is_stopping)) {
+    res = bambu_get_print_status(thread_ctx->bambu_ctx, &status);
+    if (res == -EAGAIN) {
+      continue;
+    }
+    if (res < 0) {
+      break;
+    }
+
+    pthread_mutex_lock(&thread_ctx->run_bambu_mutex);
+    bambu_print_status_t* print_status = &thread_ctx->print_status;
+    bool is_state_change = status.state != BAMBU_PRINT_UNKNOWN &&
+                           status.state != print_status->state;
+    bool is_layer_change = status.layer >= 0 &&
+                           status.layer != print_status->layer;
+    if (is_state_change) {
+      print_status->state = status.state;
+    }
+    if (is_layer_change) {
+      print_status->layer = status.layer;
+    }
+    if (is_state_change || is_layer_change) {
+#ifdef DEBUG
+      fprintf(stderr, "Print state %d, layer %d\n", print_status->state,
+              print_status->layer);
+#endif
+      atomic_store(&thread_ctx->print_event_us, timestamp_now_us());
+    }
+    pthread_mutex_unlock(&thread_ctx->run_bambu_mutex);
+  }
+  if (res >= 0 || res == -EAGAIN) {
+    return NULL;  // Asked to stop.
+  }
 
+  fprintf(stderr, "Error getting print status, delivering at full rate\n");
+  pthread_mutex_lock(&thread_ctx->run_bambu_mutex);
+  thread_ctx->print_status.state = BAMBU_PRINT_UNKNOWN;
+  pthread_mutex_unlock(&thread_ctx->run_bambu_mutex);
   return NULL;
 }
 
+// Only takes run_bambu_mutex when run_bambu flips, so that a storm of clients
+// coming and going doesn't contend with the Bambu thread.
 static void on_client_change(void* callback_ctx, size_t client_count) {
   thread_ctx_t* thread_ctx = (thread_ctx_t*) callback_ctx;
 
@@ -88,27 +525,138 @@ static void on_client_change(void* callback_ctx, size_t client_count) {
   fprintf(stderr, "Number of clients changed to: %ld\n", client_count);
 #endif
 
-  pthread_mutex_lock(&thread_ctx->run_bambu_mutex);
-  thread_ctx->run_bambu = client_count > 0;
-  if (thread_ctx->run_bambu) {
+  bool run_bambu = client_count > 0 || thread_ctx->run_always;
+  bool was_running = atomic_exchange(&thread_ctx->run_bambu, run_bambu);
+
+  // Undo racing with stop_bambu_thread, which sets is_stopping before
+  // clearing run_bambu, so that one of the two always clears it last.
+  if (run_bambu && atomic_load(&thread_ctx->is_stopping)) {
+    atomic_store(&thread_ctx->run_bambu, false);
+    return;
+  }
+
+  // Wake up the Bambu thread to connect. Taking the mutex ensures it isn't
+  // between checking run_bambu and waiting.
+  if (run_bambu != was_running) {
+    pthread_mutex_lock(&thread_ctx->run_bambu_mutex);
     pthread_cond_signal(&thread_ctx->run_bambu_cond);
+    pthread_mutex_unlock(&thread_ctx->run_bambu_mutex);
   }
+}
+
+// Stops the Bambu thread and waits for it, then has the delivery thread stop
+// once it's done with the last frame. Returns a negative value if the Bambu
+// thread had stopped because of an error.
+static int stop_bambu_thread(thread_ctx_t* thread_ctx, pthread_t thread,
+                             pthread_t delivery_thread) {
+  pthread_mutex_lock(&thread_ctx->run_bambu_mutex);
+  thread_ctx->is_stopping = true;
+  thread_ctx->run_bambu = false;
+  pthread_cond_broadcast(&thread_ctx->run_bambu_cond);
   pthread_mutex_unlock(&thread_ctx->run_bambu_mutex);
+
+  int res = pthread_join(thread, NULL);
+  if (res != 0) {
+    fprintf(stderr, "Error joining bambu thread\n");
+    return -1;
+  }
+  frame_mailbox_close(thread_ctx->mailbox);
+  res = pthread_join(delivery_thread, NULL);
+  if (res != 0) {
+    fprintf(stderr, "Error joining delivery thread\n");
+    return -1;
+  }
+  return thread_ctx->is_failed ? -1 : 0;
+}
+
+// Writes the recorded trace spans into the trace file.
+static void dump_trace(void) {
+  const char* path = config_get_string(TRACE_FILE_OPTION, TRACE_FILE_DEFAULT);
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+    return;
+  }
+  int res = trace_write(file);
+  if (fclose(file) != 0 || res < 0) {
+    fprintf(stderr, "Error writing trace to: %s\n", path);
+    return;
+  }
+  fprintf(stderr, "Wrote trace to: %s\n", path);
+}
+
+// Waits for SIGTERM or SIGINT, reloading the configuration file (if any) on
+// every SIGHUP and dumping trace spans on every SIGUSR2 in the meantime.
+static void wait_for_stop_signal(sigset_t* signals, const char* config_path) {
+  while (1) {
+    int signal;
+    if (sigwait(signals, &signal) != 0 ||
+        (signal != SIGHUP && signal != SIGUSR2)) {
+      fprintf(stderr, "Stopping\n");
+      return;
+    }
+
+    if (signal == SIGUSR2) {
+      dump_trace();
+    } else if (config_path == NULL) {
+      fprintf(stderr, "No configuration file to reload\n");
+    } else if (config_load_file(config_path) == 0) {
+      fprintf(stderr, "Reloaded configuration from: %s\n", config_path);
+      trace_configure();
+    }
+  }
 }
 
+#define USAGE "Usage: %s [-c config-file] [-o key=value]... " \
+              "<ip> <device> <passcode> <port>\n"
+
 int main(int argc, char** argv) {
-  if (argc != 5) {
-    fprintf(stderr, "Usage: %s <ip> <device> <passcode> <port>\n", argv[0]);
+  const char* config_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:o:")) != -1) {
+    switch (opt) {
+    case 'c':
+      config_path = optarg;
+      break;
+    case 'o':
+      if (config_set(optarg) < 0) {
+        return -1;
+      }
+      break;
+    default:
+      fprintf(stderr, USAGE, argv[0]);
+      return -1;
+    }
+  }
+
+  if (argc - optind != 4) {
+    fprintf(stderr, USAGE, argv[0]);
+    return -1;
+  }
+  if (config_path && config_load_file(config_path) < 0) {
     return -1;
   }
+  trace_configure();
 
-  char* ip = argv[1];
-  char* device = argv[2];
-  char* passcode = argv[3];
-  int server_port = atoi(argv[4]);
+  char* ip = argv[optind];
+  char* device = argv[optind + 1];
+  char* passcode = argv[optind + 2];
+  int server_port = atoi(argv[optind + 3]);
+
+  // Seed connection retry jitter differently in every instance.
+  srandom(getpid() ^ timestamp_now_us());
 
   bambu_ctx_t bambu_ctx = NULL;
   server_ctx_t server_ctx = NULL;
+  recorder_ctx_t recorder_ctx = NULL;
+  shm_ctx_t shm_ctx = NULL;
+  frame_mailbox_t mailbox = NULL;
+  uint8_t* repair_buffer = NULL;
+  pthread_t bambu_thread;
+  pthread_t delivery_thread;
+  pthread_t print_status_thread;
+  bool is_bambu_thread_started = false;
+  bool is_print_status_thread_started = false;
   int res;
 
   res = bambu_alloc_ctx(&bambu_ctx);
@@ -123,46 +671,150 @@ int main(int argc, char** argv) {
     goto close_and_exit;
   }
 
-  // Connect once to store frame information in bambu_ctx, then close.
-  res = bambu_connect(bambu_ctx, ip, device, passcode);
-  if (res < 0) {
-    fprintf(stderr, "Error connecting via bambu\n");
-    goto close_and_exit;
-  }
-  res = bambu_disconnect(bambu_ctx);
-  if (res < 0) {
-    fprintf(stderr, "Error disconnecting from bambu\n");
-    goto close_and_exit;
-  }
-
-  size_t buffer_size = bambu_get_max_frame_buffer_size(bambu_ctx);
-  pthread_t bambu_thread;
   thread_ctx_t thread_ctx = {
     .ip = ip,
     .device = device,
     .passcode = passcode,
     .bambu_ctx = bambu_ctx,
     .server_ctx = server_ctx,
-    .image_buffer_size_max = buffer_size,
-    .run_bambu = false,
     .run_bambu_cond = PTHREAD_COND_INITIALIZER,
     .run_bambu_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .print_status = { .state = BAMBU_PRINT_UNKNOWN, .layer = -1 },
   };
 
+  // Use cached stream parameters if given a directory, e.g.,
+  // "-o stream_cache_dir=/var/cache/bambucam". Otherwise, connect once to read
+  // them, then close unless keeping the connection for the first session.
+  stream_params_t stream_params;
+  const char* stream_cache_dir =
+      config_get_string(STREAM_CACHE_DIR_OPTION, NULL);
+  bool is_stream_cached = stream_cache_dir &&
+      stream_cache_load(stream_cache_dir, device, &stream_params) == 0;
+  bool is_probe_kept = false;
+  if (!is_stream_cached) {
+    res = connect_bambu(&thread_ctx);
+    if (res < 0) {
+      fprintf(stderr, "Error connecting via bambu\n");
+      goto close_and_exit;
+    }
+    stream_params = get_stream_params(bambu_ctx);
+    if (stream_cache_dir) {
+      stream_cache_save(stream_cache_dir, device, &stream_params);
+    }
+
+    is_probe_kept = config_get_bool(KEEP_PROBE_OPTION, KEEP_PROBE_DEFAULT);
+    if (!is_probe_kept) {
+      res = bambu_disconnect(bambu_ctx);
+      if (res < 0) {
+        fprintf(stderr, "Error disconnecting from bambu\n");
+        goto close_and_exit;
+      }
+    }
+  }
+
+  size_t buffer_size = bambu_get_max_frame_buffer_size(bambu_ctx);
+
+  // Handle signals synchronously in wait_for_stop_signal from here on, where
+  // blocking them first makes every thread started below inherit the mask.
+  // Until now, the default actions cleanly end the process.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGHUP);
+  sigaddset(&signals, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  // Record frames to disk if given a directory, e.g., "-o record_dir=/path".
+  const char* record_dir = config_get_string("record_dir", NULL);
+  if (record_dir) {
+    res = recorder_alloc_ctx(&recorder_ctx);
+    if (res < 0) {
+      fprintf(stderr, "Error allocating recorder\n");
+      goto close_and_exit;
+    }
+    res = recorder_start(recorder_ctx, record_dir, buffer_size);
+    if (res < 0) {
+      fprintf(stderr, "Error starting recorder\n");
+      goto close_and_exit;
+    }
+  }
+
+  int fps = stream_params.fps;
+  int width = stream_params.width;
+  int height = stream_params.height;
+
+  // Publish frames to shared memory if given a name, e.g., "-o shm_name=/cam".
+  const char* shm_name = config_get_string("shm_name", NULL);
+  if (shm_name) {
+    res = shm_alloc_ctx(&shm_ctx);
+    if (res < 0) {
+      fprintf(stderr, "Error allocating shared memory publisher\n");
+      goto close_and_exit;
+    }
+    res = shm_start(shm_ctx, shm_name, buffer_size, width, height);
+    if (res < 0) {
+      fprintf(stderr, "Error starting shared memory publisher\n");
+      goto close_and_exit;
+    }
+  }
+
+  res = frame_mailbox_alloc(&mailbox, buffer_size);
+  if (res < 0) {
+    fprintf(stderr, "Error allocating frame mailbox\n");
+    goto close_and_exit;
+  }
+  repair_buffer = malloc(buffer_size);
+  if (repair_buffer == NULL) {
+    fprintf(stderr, "Error allocating repair buffer: %s\n", strerror(errno));
+    res = -ENOMEM;
+    goto close_and_exit;
+  }
+
+  thread_ctx.mailbox = mailbox;
+  thread_ctx.repair_buffer = repair_buffer;
+  thread_ctx.recorder_ctx = recorder_ctx;
+  thread_ctx.shm_ctx = shm_ctx;
+  thread_ctx.image_buffer_size_max = buffer_size;
+  // The replay buffer, if enabled, e.g., "-o replay_buffer_mb=64", also keeps
+  // the camera running, so that replays cover periods nobody watched.
+  bool run_always = recorder_ctx != NULL || shm_ctx != NULL ||
+                    config_get_int("replay_buffer_mb", 0) > 0;
+  thread_ctx.run_bambu = run_always;
+  thread_ctx.run_always = run_always;
+  thread_ctx.stream_params = stream_params;
+  thread_ctx.stream_cache_dir = stream_cache_dir;
+  thread_ctx.is_stream_cached = is_stream_cached;
+  thread_ctx.is_probe_kept = is_probe_kept;
+
   server_callbacks_t server_callbacks = {
     .callback_ctx = &thread_ctx,
     .on_client_change = on_client_change,
   };
 
+  res = pthread_create(&delivery_thread, NULL, &delivery_routine,
+                       &thread_ctx);
+  if (res != 0) {
+    fprintf(stderr, "Error creating delivery thread\n");
+    goto close_and_exit;
+  }
   res = pthread_create(&bambu_thread, NULL, &bambu_routine, &thread_ctx);
   if (res != 0) {
     fprintf(stderr, "Error creating bambu thread\n");
+    frame_mailbox_close(mailbox);
+    pthread_join(delivery_thread, NULL);
     goto close_and_exit;
   }
+  is_bambu_thread_started = true;
+
+  res = pthread_create(&print_status_thread, NULL, &print_status_routine,
+                       &thread_ctx);
+  if (res != 0) {
+    fprintf(stderr, "Error creating print status thread\n");
+    goto close_and_exit;
+  }
+  is_print_status_thread_started = true;
 
-  int fps = bambu_get_framerate(bambu_ctx);
-  int width = bambu_get_frame_width(bambu_ctx);
-  int height = bambu_get_frame_height(bambu_ctx);
   res = server_start(server_ctx, server_port, &server_callbacks, width, height,
                      fps, buffer_size);
   if (res < 0) {
@@ -170,13 +822,33 @@ int main(int argc, char** argv) {
     goto close_and_exit;
   }
 
-  res = pthread_join(bambu_thread, NULL);
-  if (res != 0) {
-    fprintf(stderr, "Error joining bambu thread\n");
-    goto close_and_exit;
-  }
+  wait_for_stop_signal(&signals, config_path);
 
 close_and_exit:
+  // Stop producing frames before stopping everything that consumes them.
+  if (is_bambu_thread_started &&
+      stop_bambu_thread(&thread_ctx, bambu_thread, delivery_thread) < 0) {
+    res = -1;
+  }
+  // The print status thread sees is_stopping, set by stop_bambu_thread, by
+  // its next poll, and must be done with the Bambu context before it's freed.
+  if (is_print_status_thread_started &&
+      pthread_join(print_status_thread, NULL) != 0) {
+    fprintf(stderr, "Error joining print status thread\n");
+    res = -1;
+  }
+  if (mailbox) {
+    frame_mailbox_free(mailbox);
+  }
+  free(repair_buffer);
+  if (shm_ctx) {
+    shm_stop(shm_ctx);
+    shm_free_ctx(shm_ctx);
+  }
+  if (recorder_ctx) {
+    recorder_stop(recorder_ctx);
+    recorder_free_ctx(recorder_ctx);
+  }
   if (server_ctx) {
     server_stop(server_ctx);
     server_free_ctx(server_ctx);
@@ -0,0 +1,248 @@
+// Benchmarks the per-frame cost of the selected server implementation against
+// the number of connected clients, in-process and without any sockets (see
+// bench.h).
+//
+// Usage: bambucam-bench [-o key=value]... [-n frames] [-p path] [-r kbps]
+//
+// Options configure the fake camera and the server like they do bambucam,
+// e.g., "-o fake_width=1920". The path is what every client requests, e.g.,
+// "/?kbps=500" to include requantizing frames. With a read rate, clients
+// receive through sockets at that many kilobits per second at the camera's
+// frame rate, to measure how long new frames wait behind data already queued
+// for slow clients, e.g., with "-o tcp_notsent_lowat=0" to compare.
+
+#include "bambu.h"
+#include "config.h"
+#include "server.h"
+#include "bench.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define FRAMES_DEFAULT 200
+#define PATH_DEFAULT "/"
+
+// Frames sent before measuring, e.g., to fill buffer pools.
+#define WARMUP_FRAMES 10
+
+// Fake camera defaults, unless set with "-o", taking realistic frame sizes.
+static const char* default_options[] = {
+  "fake_width=1280",
+  "fake_height=720",
+  "fake_fps=30",  // Also sets the clients' read rate per frame.
+  "fake_pattern=noise",
+  "fake_quality=90",
+};
+
+// Client counts to measure, up to the server's maximum.
+static const size_t client_counts[] = { 1, 10, 50, 100 };
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+// Counts heap allocations of the whole process, including those of libraries,
+// by wrapping glibc's allocator, unless a sanitizer already replaced it.
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+
+static atomic_ulong num_allocs;
+
+void* malloc(size_t size) {
+  atomic_fetch_add_explicit(&num_allocs, 1, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  atomic_fetch_add_explicit(&num_allocs, 1, memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  atomic_fetch_add_explicit(&num_allocs, 1, memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  atomic_fetch_add_explicit(&num_allocs, 1, memory_order_relaxed);
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+  atomic_fetch_add_explicit(&num_allocs, 1, memory_order_relaxed);
+  void* result = __libc_memalign(alignment, size);
+  if (result == NULL) {
+    return ENOMEM;
+  }
+  *ptr = result;
+  return 0;
+}
+
+static unsigned long get_num_allocs(void) {
+  return atomic_load_explicit(&num_allocs, memory_order_relaxed);
+}
+#else
+static unsigned long get_num_allocs(void) {
+  return 0;  // Not counted.
+}
+#endif
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+static void on_client_change(void* callback_ctx, size_t client_count) {
+}
+
+// Sends num_frames frames to num_clients clients and prints the time spent per
+// frame in server_send_image (the capture thread's share) and in serving the
+// clients (the server threads' share), and how much data was queued for each
+// client, which clients reading kbps kilobits per second take lag_ms to catch
+// up on. Returns a negative value on error.
+static int run(bambu_ctx_t bambu_ctx, server_ctx_t server_ctx,
+               size_t num_clients, const char* path, int num_frames,
+               int kbps) {
+  size_t bytes_per_s = (size_t) kbps * 1000 / 8;
+  int res = bench_connect(server_ctx, num_clients, path,
+                          bytes_per_s / bambu_get_framerate(bambu_ctx));
+  if (res < 0) {
+    return res;
+  }
+
+  int64_t send_ns = 0;
+  int64_t receive_ns = 0;
+  int64_t num_bytes = 0;
+  int64_t queued = 0;
+  unsigned long allocs = 0;
+  for (int i = -WARMUP_FRAMES; i < num_frames && res >= 0; i++) {
+    uint8_t* frame;
+    size_t size;
+    int64_t timestamp_us;
+    res = bambu_get_frame(bambu_ctx, &frame, &size, &timestamp_us);
+    if (res < 0) {
+      break;
+    }
+
+    unsigned long start_allocs = get_num_allocs();
+    int64_t start_ns = now_ns();
+    res = server_send_image(server_ctx, frame, size, timestamp_us);
+    int64_t sent_ns = now_ns();
+    ssize_t received = res < 0 ? res : bench_receive(frame, size);
+    int64_t received_ns = now_ns();
+    res = received < 0 ? received : 0;
+    if (i >= 0) {
+      send_ns += sent_ns - start_ns;
+      receive_ns += received_ns - sent_ns;
+      num_bytes += received;
+      queued += bench_queued();
+      allocs += get_num_allocs() - start_allocs;
+    }
+  }
+  bench_disconnect();
+  if (res < 0) {
+    fprintf(stderr, "Error benchmarking %ld clients\n", num_clients);
+    return res;
+  }
+
+  double queued_per_frame = (double) queued / num_frames;
+  printf("%7ld %12.1f %12.1f %12.2f %12.1f %12.1f %12.1f %12.1f\n",
+         num_clients, send_ns / 1000.0 / num_frames,
+         receive_ns / 1000.0 / num_frames,
+         receive_ns / 1000.0 / num_frames / num_clients,
+         (double) num_bytes / num_frames / 1024,
+         (double) allocs / num_frames, queued_per_frame / 1024,
+         bytes_per_s > 0 ? queued_per_frame * 1000 / bytes_per_s : 0);
+  return 0;
+}
+
+#define USAGE "Usage: %s [-o key=value]... [-n frames] [-p path] [-r kbps]\n"
+
+int main(int argc, char** argv) {
+  int num_frames = FRAMES_DEFAULT;
+  const char* path = PATH_DEFAULT;
+  int kbps = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:n:p:r:")) != -1) {
+    switch (opt) {
+    case 'o':
+      if (config_set(optarg) < 0) {
+        return -1;
+      }
+      break;
+    case 'n':
+      num_frames = atoi(optarg);
+      break;
+    case 'p':
+      path = optarg;
+      break;
+    case 'r':
+      kbps = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, USAGE, argv[0]);
+      return -1;
+    }
+  }
+  if (optind != argc || num_frames <= 0 || kbps < 0) {
+    fprintf(stderr, USAGE, argv[0]);
+    return -1;
+  }
+  for (size_t i = 0; i < sizeof(default_options) / sizeof(char*); i++) {
+    char key[64];
+    sscanf(default_options[i], "%63[^=]", key);
+    if (config_get_string(key, NULL) == NULL) {
+      config_set(default_options[i]);
+    }
+  }
+  trace_configure();
+
+  bambu_ctx_t bambu_ctx = NULL;
+  server_ctx_t server_ctx = NULL;
+  server_callbacks_t server_callbacks = {
+    .on_client_change = on_client_change,
+  };
+  int res = bambu_alloc_ctx(&bambu_ctx);
+  if (res == 0) {
+    res = server_alloc_ctx(&server_ctx);
+  }
+  if (res == 0) {
+    res = bench_prepare(server_ctx);
+  }
+  if (res == 0) {
+    res = server_start(server_ctx, 0, &server_callbacks,
+                       bambu_get_frame_width(bambu_ctx),
+                       bambu_get_frame_height(bambu_ctx),
+                       bambu_get_framerate(bambu_ctx),
+                       bambu_get_max_frame_buffer_size(bambu_ctx));
+  }
+
+  if (res == 0) {
+    printf("%dx%d frames of up to %ld KiB, %d frames per client count:\n\n",
+           bambu_get_frame_width(bambu_ctx), bambu_get_frame_height(bambu_ctx),
+           bambu_get_max_frame_buffer_size(bambu_ctx) / 1024, num_frames);
+    printf("%7s %12s %12s %12s %12s %12s %12s %12s\n", "clients", "send us",
+           "serve us", "us/client", "KiB out", "allocs", "queue KiB",
+           "lag ms");
+  }
+  for (size_t i = 0; res == 0 &&
+       i < sizeof(client_counts) / sizeof(size_t) &&
+       client_counts[i] <= bench_max_clients(); i++) {
+    res = run(bambu_ctx, server_ctx, client_counts[i], path, num_frames,
+              kbps);
+  }
+
+  if (server_ctx) {
+    server_stop(server_ctx);
+    server_free_ctx(server_ctx);
+  }
+  if (bambu_ctx) {
+    bambu_free_ctx(bambu_ctx);
+  }
+  return res;
+}
@@ -0,0 +1,39 @@
+// Benchmark harness
+//
+// Drives a server implementation in-process without any sockets: frames from
+// the fake camera (see bambu_fake.c) go through server_send_image, and the
+// server's bench_*.c file plays its clients by calling straight into it, e.g.,
+// into microhttpd's response callbacks. Every client reads back exactly what
+// it would receive over the network, so that the per-frame cost of the server
+// can be measured without any network in the way.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Returns the most clients the server can have at once.
+size_t bench_max_clients(void);
+
+// Sets up the server before server_start, e.g., replacing its output. Returns
+// a negative value on error.
+int bench_prepare(server_ctx_t ctx);
+
+// Connects num_clients clients to the started server, each requesting the
+// given path (e.g., "/?kbps=500"). If read_size isn't zero, clients instead
+// receive through loopback TCP sockets and read at most read_size bytes per
+// frame, like clients on a slow network, so that socket options take effect.
+// Returns a negative value on error.
+int bench_connect(server_ctx_t ctx, size_t num_clients, const char* path,
+                  size_t read_size);
+
+// Has every client receive the frame just sent with server_send_image,
+// checking that it arrived intact where the frame is sent as is. Returns the
+// number of bytes all clients received, or a negative value on error.
+ssize_t bench_receive(const uint8_t* frame, size_t size);
+
+// Returns how many bytes sent to clients are still on their way after the
+// last bench_receive call, e.g., in socket buffers, on average per client.
+size_t bench_queued(void);
+
+// Disconnects every client.
+void bench_disconnect(void);
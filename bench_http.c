@@ -0,0 +1,568 @@
+// Benchmark clients of the HTTP server (see bench.h), backed by an in-process
+// stand-in for the subset of microhttpd that server_microhttpd.c uses. Linked
+// in place of libmicrohttpd, it hands requests straight to the server's
+// handler and plays each connection's polling loop by calling its response
+// callback until the connection suspends, just like microhttpd's thread
+// would before writing to the socket.
+
+#define _GNU_SOURCE  // For memmem.
+
+#include "server.h"
+#include "bench.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <microhttpd.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/sockios.h>  // For SIOCOUTQ.
+#endif
+
+// Matches MAX_NUM_CONNECTIONS in server_microhttpd.c.
+#define MAX_NUM_CLIENTS 100
+
+// Bytes clients read at a time when receiving through sockets, interleaved
+// with the server sending, like both would run at the same time.
+#define READ_CHUNK_SIZE (16 * 1024)
+
+// Bytes from the start of a frame used to find it among the received data.
+#define FRAME_PREFIX_SIZE 64
+
+struct MHD_Daemon {
+  MHD_AccessHandlerCallback handler;
+  void* handler_ctx;
+  MHD_NotifyConnectionCallback notify_connection;
+  void* notify_connection_ctx;
+  bool is_started;
+};
+
+struct MHD_Response {
+  MHD_ContentReaderCallback callback;
+  void* callback_ctx;
+  MHD_ContentReaderFreeCallback free_callback;
+  size_t block_size;
+  void* buffer;
+  bool is_buffer_owned;
+  int num_refs;
+};
+
+struct MHD_Connection {
+  void* socket_context;
+  const char* query;
+  struct MHD_Response* response;
+  unsigned int status;
+  uint64_t pos;
+  bool is_suspended;
+
+  // Data received since the last bench_receive call, or with sockets, data
+  // waiting to be sent from received_pos on, like microhttpd's write buffer.
+  uint8_t* received;
+  size_t received_pos;
+  size_t received_size;
+  size_t received_max;
+
+  // The server's end of the connection, which is only connected to the
+  // client's end with sockets, and bytes queued for the client in socket
+  // buffers after the last bench_receive call.
+  int server_socket;
+  int client_socket;
+  size_t queued;
+};
+
+static struct MHD_Daemon fake_daemon;
+static struct MHD_Connection* clients[MAX_NUM_CLIENTS];
+static size_t num_clients;
+
+// Whether clients requested frames as they are, which bench_receive checks.
+static bool is_plain_stream;
+
+// Bytes each client reads per frame when receiving through sockets, or zero
+// to receive in memory. The listening socket clients connect to, if any.
+static size_t read_size;
+static int listen_socket = -1;
+
+struct MHD_Daemon* MHD_start_daemon(unsigned int flags, uint16_t port,
+                                    MHD_AcceptPolicyCallback accept_policy,
+                                    void* accept_policy_ctx,
+                                    MHD_AccessHandlerCallback handler,
+                                    void* handler_ctx, ...) {
+  if (flags & MHD_USE_TLS) {
+    fprintf(stderr, "TLS isn't supported in benchmarks\n");
+    return NULL;
+  }
+  fake_daemon.handler = handler;
+  fake_daemon.handler_ctx = handler_ctx;
+
+  va_list args;
+  va_start(args, handler_ctx);
+  enum MHD_OPTION option;
+  while ((option = va_arg(args, enum MHD_OPTION)) != MHD_OPTION_END) {
+    switch (option) {
+    case MHD_OPTION_CONNECTION_LIMIT:
+      va_arg(args, unsigned int);
+      break;
+    case MHD_OPTION_NOTIFY_CONNECTION:
+      fake_daemon.notify_connection =
+          va_arg(args, MHD_NotifyConnectionCallback);
+      fake_daemon.notify_connection_ctx = va_arg(args, void*);
+      break;
+    case MHD_OPTION_ARRAY:
+      va_arg(args, struct MHD_OptionItem*);  // Only ever holds TLS options.
+      break;
+    default:
+      fprintf(stderr, "Unsupported microhttpd option %d\n", option);
+      va_end(args);
+      return NULL;
+    }
+  }
+  va_end(args);
+  fake_daemon.is_started = true;
+  return &fake_daemon;
+}
+
+void MHD_stop_daemon(struct MHD_Daemon* mhd_daemon) {
+  mhd_daemon->is_started = false;
+}
+
+MHD_socket MHD_quiesce_daemon(struct MHD_Daemon* mhd_daemon) {
+  return -1;  // No listening socket.
+}
+
+enum MHD_Result MHD_is_feature_supported(enum MHD_FEATURE feature) {
+  return MHD_NO;
+}
+
+static struct MHD_Response* alloc_response(void) {
+  struct MHD_Response* response = calloc(1, sizeof(struct MHD_Response));
+  if (response) {
+    response->num_refs = 1;
+  }
+  return response;
+}
+
+struct MHD_Response* MHD_create_response_from_buffer(
+    size_t size, void* buffer, enum MHD_ResponseMemoryMode mode) {
+  struct MHD_Response* response = alloc_response();
+  if (response) {
+    response->buffer = buffer;
+    response->is_buffer_owned = mode == MHD_RESPMEM_MUST_FREE;
+  }
+  return response;
+}
+
+struct MHD_Response* MHD_create_response_from_callback(
+    uint64_t size, size_t block_size, MHD_ContentReaderCallback callback,
+    void* callback_ctx, MHD_ContentReaderFreeCallback free_callback) {
+  struct MHD_Response* response = alloc_response();
+  if (response) {
+    response->callback = callback;
+    response->callback_ctx = callback_ctx;
+    response->free_callback = free_callback;
+    response->block_size = block_size;
+  }
+  return response;
+}
+
+struct MHD_Response* MHD_create_response_for_upgrade(
+    MHD_UpgradeHandler handler, void* handler_ctx) {
+  fprintf(stderr, "WebSockets aren't supported in benchmarks\n");
+  return NULL;
+}
+
+enum MHD_Result MHD_upgrade_action(struct MHD_UpgradeResponseHandle* handle,
+                                   enum MHD_UpgradeAction action, ...) {
+  return MHD_NO;
+}
+
+void MHD_destroy_response(struct MHD_Response* response) {
+  if (response == NULL || --response->num_refs > 0) {
+    return;
+  }
+  if (response->free_callback) {
+    response->free_callback(response->callback_ctx);
+  }
+  if (response->is_buffer_owned) {
+    free(response->buffer);
+  }
+  free(response);
+}
+
+enum MHD_Result MHD_queue_response(struct MHD_Connection* connection,
+                                   unsigned int status,
+                                   struct MHD_Response* response) {
+  if (connection->response) {
+    return MHD_NO;
+  }
+  response->num_refs++;
+  connection->response = response;
+  connection->status = status;
+  return MHD_YES;
+}
+
+enum MHD_Result MHD_add_response_header(struct MHD_Response* response,
+                                        const char* header,
+                                        const char* content) {
+  return MHD_YES;
+}
+
+enum MHD_Result MHD_set_response_options(struct MHD_Response* response,
+                                         enum MHD_ResponseFlags flags, ...) {
+  return MHD_YES;
+}
+
+// Only supports query arguments, e.g., "kbps=500" in "/?kbps=500".
+const char* MHD_lookup_connection_value(struct MHD_Connection* connection,
+                                        enum MHD_ValueKind kind,
+                                        const char* key) {
+  if (kind != MHD_GET_ARGUMENT_KIND || connection->query == NULL) {
+    return NULL;
+  }
+  size_t key_size = strlen(key);
+  for (const char* argument = connection->query; *argument;) {
+    size_t argument_size = strcspn(argument, "&");
+    if (strncmp(argument, key, key_size) == 0) {
+      if (argument[key_size] == '=') {
+        return argument + key_size + 1;  // Ends at the next '&', if any.
+      }
+      if (argument[key_size] == '&' || argument[key_size] == '\0') {
+        return "";
+      }
+    }
+    argument += argument_size + (argument[argument_size] == '&');
+  }
+  return NULL;
+}
+
+void MHD_suspend_connection(struct MHD_Connection* connection) {
+  connection->is_suspended = true;
+}
+
+void MHD_resume_connection(struct MHD_Connection* connection) {
+  connection->is_suspended = false;
+}
+
+const union MHD_ConnectionInfo* MHD_get_connection_info(
+    struct MHD_Connection* connection, enum MHD_ConnectionInfoType type, ...) {
+  static __thread union MHD_ConnectionInfo info;
+  switch (type) {
+  case MHD_CONNECTION_INFO_CONNECTION_SUSPENDED:
+    info.suspended = connection->is_suspended ? MHD_YES : MHD_NO;
+    return &info;
+  case MHD_CONNECTION_INFO_CONNECTION_FD:
+    info.connect_fd = connection->server_socket;
+    return &info;
+  default:
+    return NULL;
+  }
+}
+
+size_t bench_max_clients(void) {
+  return MAX_NUM_CLIENTS;
+}
+
+int bench_prepare(server_ctx_t ctx) {
+  return 0;
+}
+
+// Reads the next block of the given client's response after what it already
+// received. Returns the number of bytes read, or a negative value if the
+// response ended.
+static ssize_t read_response(struct MHD_Connection* connection) {
+  struct MHD_Response* response = connection->response;
+  size_t max = response->block_size;
+  if (connection->received_size + max > connection->received_max) {
+    size_t received_max = MAX(connection->received_max * 2,
+                              connection->received_size + max);
+    uint8_t* received = realloc(connection->received, received_max);
+    if (received == NULL) {
+      return -ENOMEM;
+    }
+    connection->received = received;
+    connection->received_max = received_max;
+  }
+
+  ssize_t res = response->callback(
+      response->callback_ctx, connection->pos,
+      (char*) connection->received + connection->received_size, max);
+  if (res < 0) {
+    fprintf(stderr, "Response ended unexpectedly\n");
+    return -EPIPE;
+  }
+  connection->pos += res;
+  connection->received_size += res;
+  return res;
+}
+
+// Returns whether the socket has room for more data, which with
+// TCP_NOTSENT_LOWAT only counts data the kernel is about to send.
+static bool is_writable(int socket) {
+  struct pollfd pollfd = { .fd = socket, .events = POLLOUT };
+  return poll(&pollfd, 1, 0) == 1 && (pollfd.revents & POLLOUT);
+}
+
+// Sends as much of the given client's response as the server's socket takes,
+// reading more of it whenever everything read was sent, like microhttpd's
+// thread would. Returns a negative value on error.
+static int send_response(struct MHD_Connection* connection) {
+  while (is_writable(connection->server_socket)) {
+    if (connection->received_pos == connection->received_size) {
+      connection->received_pos = 0;
+      connection->received_size = 0;
+      if (connection->is_suspended) {
+        break;
+      }
+      ssize_t res = read_response(connection);
+      if (res <= 0) {
+        if (res < 0) {
+          return res;
+        }
+        continue;
+      }
+    }
+    ssize_t res = send(connection->server_socket,
+                       connection->received + connection->received_pos,
+                       connection->received_size - connection->received_pos,
+                       MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (res < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      fprintf(stderr, "Error sending to client: %s\n", strerror(errno));
+      return -errno;
+    }
+    connection->received_pos += res;
+  }
+  return 0;
+}
+
+// Returns how many bytes sent to the given client wait in the server's write
+// buffer and in both socket buffers.
+static size_t get_queued(struct MHD_Connection* connection) {
+  size_t queued = connection->received_size - connection->received_pos;
+  int size;
+#ifdef SIOCOUTQ
+  if (ioctl(connection->server_socket, SIOCOUTQ, &size) == 0) {
+    queued += size;
+  }
+#endif
+  if (ioctl(connection->client_socket, FIONREAD, &size) == 0) {
+    queued += size;
+  }
+  return queued;
+}
+
+// Has the given client read up to read_size bytes through its socket, while
+// the server keeps sending. Returns the number of bytes read, or a negative
+// value on error.
+static ssize_t receive_through_socket(struct MHD_Connection* connection) {
+  static uint8_t chunk[READ_CHUNK_SIZE];
+  ssize_t total = 0;
+  while ((size_t) total < read_size) {
+    int res = send_response(connection);
+    if (res < 0) {
+      return res;
+    }
+    ssize_t received = recv(connection->client_socket, chunk,
+                            MIN(sizeof(chunk), read_size - total),
+                            MSG_DONTWAIT);
+    if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      fprintf(stderr, "Error receiving from server: %s\n", strerror(errno));
+      return -errno;
+    }
+    if (received <= 0) {
+      break;  // Everything sent was received.
+    }
+    total += received;
+  }
+  int res = send_response(connection);
+  if (res < 0) {
+    return res;
+  }
+  connection->queued = get_queued(connection);
+  return total;
+}
+
+// Reads from the given client's response until it suspends, like
+// microhttpd's thread would. Returns the number of bytes read, or a negative
+// value if the response ended.
+static ssize_t receive(struct MHD_Connection* connection) {
+  if (read_size > 0) {
+    return receive_through_socket(connection);
+  }
+
+  ssize_t total = 0;
+  connection->received_size = 0;
+  while (!connection->is_suspended) {
+    ssize_t res = read_response(connection);
+    if (res < 0) {
+      return res;
+    }
+    total += res;
+  }
+  return total;
+}
+
+// Opens both ends of the given client's connection, connected through the
+// loopback interface with sockets, or else just a socket taking options for
+// the server. Returns a negative value on error.
+static int open_sockets(struct MHD_Connection* connection) {
+  connection->server_socket = -1;
+  connection->client_socket = -1;
+  if (read_size == 0) {
+    connection->server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    return connection->server_socket < 0 ? -errno : 0;
+  }
+
+  struct sockaddr_in address = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  socklen_t address_size = sizeof(address);
+  if (listen_socket < 0) {
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket < 0 ||
+        bind(listen_socket, (struct sockaddr*) &address, address_size) < 0 ||
+        listen(listen_socket, MAX_NUM_CLIENTS) < 0) {
+      return -errno;
+    }
+  }
+  if (getsockname(listen_socket, (struct sockaddr*) &address,
+                  &address_size) < 0) {
+    return -errno;
+  }
+  connection->client_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (connection->client_socket < 0 ||
+      connect(connection->client_socket, (struct sockaddr*) &address,
+              address_size) < 0) {
+    return -errno;
+  }
+  connection->server_socket = accept(listen_socket, NULL, NULL);
+  return connection->server_socket < 0 ? -errno : 0;
+}
+
+static void close_sockets(struct MHD_Connection* connection) {
+  if (connection->server_socket >= 0) {
+    close(connection->server_socket);
+  }
+  if (connection->client_socket >= 0) {
+    close(connection->client_socket);
+  }
+}
+
+static void close_client(struct MHD_Connection* connection) {
+  MHD_destroy_response(connection->response);
+  fake_daemon.notify_connection(fake_daemon.notify_connection_ctx, connection,
+                                &connection->socket_context,
+                                MHD_CONNECTION_NOTIFY_CLOSED);
+  close_sockets(connection);
+  free(connection->received);
+  free(connection);
+}
+
+int bench_connect(server_ctx_t ctx, size_t count, const char* path,
+                  size_t client_read_size) {
+  char url[256];
+  snprintf(url, sizeof(url), "%s", path);
+  char* query = strchr(url, '?');
+  if (query) {
+    *query++ = '\0';
+  }
+  is_plain_stream = strcmp(url, "/") == 0 && query == NULL;
+  read_size = client_read_size;
+
+  for (num_clients = 0; num_clients < count; num_clients++) {
+    struct MHD_Connection* connection =
+        calloc(1, sizeof(struct MHD_Connection));
+    if (connection == NULL) {
+      fprintf(stderr, "Error allocating client: %s\n", strerror(errno));
+      return -errno;
+    }
+    int res = open_sockets(connection);
+    if (res < 0) {
+      fprintf(stderr, "Error connecting client: %s\n", strerror(-res));
+      close_sockets(connection);
+      free(connection);
+      return res;
+    }
+    connection->query = query ? strdup(query) : NULL;
+    fake_daemon.notify_connection(fake_daemon.notify_connection_ctx,
+                                  connection, &connection->socket_context,
+                                  MHD_CONNECTION_NOTIFY_STARTED);
+    clients[num_clients] = connection;
+
+    void* request_ctx = NULL;
+    size_t upload_size = 0;
+    enum MHD_Result handler_res = fake_daemon.handler(
+        fake_daemon.handler_ctx, connection, url, "GET", MHD_HTTP_VERSION_1_1,
+        NULL, &upload_size, &request_ctx);
+    if (handler_res != MHD_YES || connection->status != MHD_HTTP_OK ||
+        connection->response->callback == NULL) {
+      fprintf(stderr, "Unexpected response to GET %s\n", path);
+      num_clients++;
+      return -EINVAL;
+    }
+
+    // New clients start with the current frame, if any.
+    if (receive(connection) < 0) {
+      num_clients++;
+      return -EPIPE;
+    }
+  }
+  return 0;
+}
+
+// Returns whether the given client received the frame, finding where it
+// starts after the part headers by its first few bytes, which is much faster
+// than searching for the whole frame.
+static bool contains_frame(struct MHD_Connection* connection,
+                           const uint8_t* frame, size_t size) {
+  size_t prefix_size = MIN(size, FRAME_PREFIX_SIZE);
+  const uint8_t* start = memmem(connection->received,
+                                connection->received_size, frame, prefix_size);
+  return start && start + size <= connection->received +
+                                  connection->received_size &&
+         memcmp(start, frame, size) == 0;
+}
+
+ssize_t bench_receive(const uint8_t* frame, size_t size) {
+  ssize_t total = 0;
+  for (size_t i = 0; i < num_clients; i++) {
+    ssize_t res = receive(clients[i]);
+    if (res < 0) {
+      return res;
+    }
+    if (is_plain_stream && read_size == 0 &&
+        !contains_frame(clients[i], frame, size)) {
+      fprintf(stderr, "Client %ld received a corrupt frame\n", i);
+      return -EIO;
+    }
+    total += res;
+  }
+  return total;
+}
+
+size_t bench_queued(void) {
+  size_t queued = 0;
+  for (size_t i = 0; i < num_clients; i++) {
+    queued += clients[i]->queued;
+  }
+  return num_clients > 0 ? queued / num_clients : 0;
+}
+
+void bench_disconnect(void) {
+  for (size_t i = 0; i < num_clients; i++) {
+    free((char*) clients[i]->query);
+    close_client(clients[i]);
+  }
+  num_clients = 0;
+}
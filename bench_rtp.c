@@ -0,0 +1,99 @@
+// Benchmark client of the RTP server (see bench.h), which has the server write
+// its stream to memory instead of a UDP socket and counts what it writes. The
+// server only ever streams to a single client.
+
+#include "server.h"
+#include "bench.h"
+#include "server_ffmpeg_rtp.h"
+
+#include <errno.h>
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+// Matches what FFmpeg's UDP protocol uses for RTP over Ethernet.
+#define PACKET_SIZE 1472
+
+// How long to wait for the server thread to encode a frame.
+#define RECEIVE_TIMEOUT_S 2
+
+// FFmpeg made the written data const in version 7.0.
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+typedef uint8_t write_data_t;
+#else
+typedef const uint8_t write_data_t;
+#endif
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t written_cond = PTHREAD_COND_INITIALIZER;
+static int64_t num_bytes_written;
+static int64_t num_bytes_received;
+
+static int write_packet(void* opaque, write_data_t* buffer, int size) {
+  pthread_mutex_lock(&mutex);
+  num_bytes_written += size;
+  pthread_cond_signal(&written_cond);
+  pthread_mutex_unlock(&mutex);
+  return size;
+}
+
+size_t bench_max_clients(void) {
+  return 1;
+}
+
+int bench_prepare(server_ctx_t ctx) {
+  uint8_t* buffer = av_malloc(PACKET_SIZE);
+  if (buffer == NULL) {
+    fprintf(stderr, "Error allocating output buffer\n");
+    return -ENOMEM;
+  }
+  AVIOContext* output_ctx = avio_alloc_context(buffer, PACKET_SIZE, 1, NULL,
+                                               NULL, write_packet, NULL);
+  if (output_ctx == NULL) {
+    fprintf(stderr, "Error allocating output context\n");
+    av_free(buffer);
+    return -ENOMEM;
+  }
+  output_ctx->max_packet_size = PACKET_SIZE;
+  server_rtp_set_output(ctx, output_ctx);
+  return 0;
+}
+
+int bench_connect(server_ctx_t ctx, size_t num_clients, const char* path,
+                  size_t read_size) {
+  pthread_mutex_lock(&mutex);
+  num_bytes_received = num_bytes_written;
+  pthread_mutex_unlock(&mutex);
+  return 0;
+}
+
+// Waits for the server thread to start writing the frame's packets, so that
+// packets written after returning count towards the next frame. Encoders may
+// hold on to frames before writing anything, e.g., for the first few frames,
+// so timing out isn't an error.
+ssize_t bench_receive(const uint8_t* frame, size_t size) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += RECEIVE_TIMEOUT_S;
+
+  pthread_mutex_lock(&mutex);
+  while (num_bytes_written == num_bytes_received) {
+    if (pthread_cond_timedwait(&written_cond, &mutex, &deadline) ==
+        ETIMEDOUT) {
+      break;
+    }
+  }
+  ssize_t received = num_bytes_written - num_bytes_received;
+  num_bytes_received = num_bytes_written;
+  pthread_mutex_unlock(&mutex);
+  return received;
+}
+
+size_t bench_queued(void) {
+  return 0;  // Written straight to memory.
+}
+
+void bench_disconnect(void) {
+}
@@ -0,0 +1,202 @@
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Maximum number of distinct options.
+#define MAX_NUM_ENTRIES 128
+
+// Maximum length of a line in a configuration file.
+#define LINE_MAX_SIZE 1024
+
+typedef struct {
+  char* key;
+  char* value;  // NULL if unset by a reload.
+  bool is_from_file;
+} entry_t;
+
+// Entries are only ever added, and replaced values are never freed because
+// other threads may still be using them.
+static entry_t entries[MAX_NUM_ENTRIES];
+static size_t num_entries;
+static unsigned generation;
+static pthread_mutex_t entries_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static entry_t* find_entry(const char* key) {
+  for (size_t i = 0; i < num_entries; i++) {
+    if (strcmp(entries[i].key, key) == 0) {
+      return &entries[i];
+    }
+  }
+  return NULL;
+}
+
+// Stores an option, where options from the command line take precedence over
+// those from the configuration file. Expects entries_mutex to be held.
+static int set_option(const char* option, bool is_from_file) {
+  const char* separator = strchr(option, '=');
+  if (separator == NULL || separator == option) {
+    fprintf(stderr, "Expected option formatted as key=value: %s\n", option);
+    return -EINVAL;
+  }
+
+  char* key = strndup(option, separator - option);
+  char* value = strdup(separator + 1);
+  if (key == NULL || value == NULL) {
+    fprintf(stderr, "Error allocating option: %s\n", strerror(errno));
+    free(key);
+    free(value);
+    return -ENOMEM;
+  }
+
+  entry_t* entry = find_entry(key);
+  if (entry != NULL) {
+    free(key);
+    if (is_from_file && !entry->is_from_file) {
+      free(value);
+      return 0;
+    }
+    entry->value = value;
+    entry->is_from_file = is_from_file;
+    return 0;
+  }
+
+  if (num_entries == MAX_NUM_ENTRIES) {
+    fprintf(stderr, "Too many options, ignoring: %s\n", option);
+    free(key);
+    free(value);
+    return -ENOSPC;
+  }
+  entries[num_entries].key = key;
+  entries[num_entries].value = value;
+  entries[num_entries].is_from_file = is_from_file;
+  num_entries++;
+  return 0;
+}
+
+int config_set(const char* option) {
+  pthread_mutex_lock(&entries_mutex);
+  int res = set_option(option, false);
+  pthread_mutex_unlock(&entries_mutex);
+  return res;
+}
+
+int config_load_file(const char* path) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+    return -errno;
+  }
+
+  pthread_mutex_lock(&entries_mutex);
+  // Unset the previous file's options, in case they were removed.
+  for (size_t i = 0; i < num_entries; i++) {
+    if (entries[i].is_from_file) {
+      entries[i].value = NULL;
+    }
+  }
+
+  char line[LINE_MAX_SIZE];
+  int res = 0;
+  while (fgets(line, LINE_MAX_SIZE, file) != NULL) {
+    // Trim whitespace, and skip blank lines and comments.
+    char* start = line + strspn(line, " \t");
+    char* end = start + strlen(start);
+    while (end > start && strchr(" \t\r\n", end[-1]) != NULL) {
+      *--end = '\0';
+    }
+    if (*start == '\0' || *start == '#') {
+      continue;
+    }
+
+    // Allow whitespace around the separator, e.g., "key = value".
+    char option[LINE_MAX_SIZE];
+    char* separator = strchr(start, '=');
+    if (separator != NULL) {
+      char* key_end = separator;
+      while (key_end > start && strchr(" \t", key_end[-1]) != NULL) {
+        key_end--;
+      }
+      char* value = separator + 1 + strspn(separator + 1, " \t");
+      snprintf(option, LINE_MAX_SIZE, "%.*s=%s", (int) (key_end - start),
+               start, value);
+      start = option;
+    }
+    if (set_option(start, true) < 0) {
+      res = -EINVAL;
+    }
+  }
+  generation++;
+  pthread_mutex_unlock(&entries_mutex);
+
+  fclose(file);
+  return res;
+}
+
+unsigned config_get_generation(void) {
+  pthread_mutex_lock(&entries_mutex);
+  unsigned result = generation;
+  pthread_mutex_unlock(&entries_mutex);
+  return result;
+}
+
+const char* config_get_string(const char* key, const char* default_value) {
+  pthread_mutex_lock(&entries_mutex);
+  entry_t* entry = find_entry(key);
+  const char* value = entry && entry->value ? entry->value : default_value;
+  pthread_mutex_unlock(&entries_mutex);
+  return value;
+}
+
+long config_get_int(const char* key, long default_value) {
+  const char* value = config_get_string(key, NULL);
+  if (value == NULL) {
+    return default_value;
+  }
+
+  char* end;
+  errno = 0;
+  long result = strtol(value, &end, 0);
+  if (errno != 0 || end == value || *end != '\0') {
+    fprintf(stderr, "Expected integer option %s, got: %s\n", key, value);
+    return default_value;
+  }
+  return result;
+}
+
+double config_get_double(const char* key, double default_value) {
+  const char* value = config_get_string(key, NULL);
+  if (value == NULL) {
+    return default_value;
+  }
+
+  char* end;
+  errno = 0;
+  double result = strtod(value, &end);
+  if (errno != 0 || end == value || *end != '\0') {
+    fprintf(stderr, "Expected numeric option %s, got: %s\n", key, value);
+    return default_value;
+  }
+  return result;
+}
+
+bool config_get_bool(const char* key, bool default_value) {
+  const char* value = config_get_string(key, NULL);
+  if (value == NULL) {
+    return default_value;
+  }
+
+  if (strcmp(value, "1") == 0 || strcmp(value, "true") == 0 ||
+      strcmp(value, "yes") == 0) {
+    return true;
+  }
+  if (strcmp(value, "0") == 0 || strcmp(value, "false") == 0 ||
+      strcmp(value, "no") == 0) {
+    return false;
+  }
+  fprintf(stderr, "Expected boolean option %s, got: %s\n", key, value);
+  return default_value;
+}
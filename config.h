@@ -0,0 +1,31 @@
+// Runtime configuration
+//
+// A small key-value store of options given on the command line, e.g.,
+// "-o replay_buffer_mb=128", or in a configuration file with one option per
+// line. Modules look up their own options by key and fall back to their
+// defaults when the key is unset. Safe to use from any thread.
+
+#include <stdbool.h>
+
+// Parses and stores a single "key=value" option, replacing any previous value
+// of the same key. Returns a negative value if the option is malformed.
+int config_set(const char* option);
+
+// Loads options from the given file, replacing those of any previously loaded
+// file, e.g., to reload on SIGHUP. Options set by config_set take precedence.
+// Blank lines and lines starting with '#' are ignored.
+int config_load_file(const char* path);
+
+// Returns a number that changes whenever a file is (re)loaded, so that modules
+// holding on to option values know to look them up again.
+unsigned config_get_generation(void);
+
+// Returns the value of the given key, or default_value if unset. The returned
+// string is owned by the configuration and must not be freed.
+const char* config_get_string(const char* key, const char* default_value);
+
+// Typed variants of config_get_string. Malformed values are reported and
+// treated as unset.
+long config_get_int(const char* key, long default_value);
+double config_get_double(const char* key, double default_value);
+bool config_get_bool(const char* key, bool default_value);
@@ -0,0 +1,95 @@
+#include "connect_limit.h"
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Maximum number of processes connecting at once (zero disables the limit).
+#define LIMIT_OPTION "connect_limit"
+#define LIMIT_DEFAULT 0
+
+// Directory of slot files shared by the processes.
+#define LOCK_DIR_OPTION "connect_lock_dir"
+#define LOCK_DIR_DEFAULT "/tmp/bambucam-connect"
+
+// Time to wait between passes over all slots, randomized by up to as much
+// again so that waiting processes don't retry in lockstep.
+#define SLOT_RETRY_US (100 * 1000)  // 100ms.
+
+// Tries to lock the given slot file, returning its descriptor, -EWOULDBLOCK
+// if another process holds it, or another negative value on error.
+static int try_lock_slot(const char* directory, long slot_i) {
+  char path[PATH_MAX];
+  int res = snprintf(path, PATH_MAX, "%s/slot-%ld", directory, slot_i);
+  if (res < 0 || res >= PATH_MAX) {
+    fprintf(stderr, "Connection slot path is too long\n");
+    return -ENAMETOOLONG;
+  }
+
+  int fd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+    return -errno;
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    res = -errno;
+    close(fd);
+    if (res != -EWOULDBLOCK) {
+      fprintf(stderr, "Error locking %s: %s\n", path, strerror(-res));
+    }
+    return res;
+  }
+  return fd;
+}
+
+int connect_limit_acquire(int* slot, const atomic_bool* is_stopping) {
+  *slot = -1;
+  long limit = config_get_int(LIMIT_OPTION, LIMIT_DEFAULT);
+  if (limit <= 0) {
+    return 0;
+  }
+
+  const char* directory = config_get_string(LOCK_DIR_OPTION, LOCK_DIR_DEFAULT);
+  // Shared by the processes of all users, which the umask would prevent.
+  if (mkdir(directory, 01777) == 0) {
+    if (chmod(directory, 01777) < 0) {
+      fprintf(stderr, "Error sharing %s: %s\n", directory, strerror(errno));
+      return -errno;
+    }
+  } else if (errno != EEXIST) {
+    fprintf(stderr, "Error creating %s: %s\n", directory, strerror(errno));
+    return -errno;
+  }
+
+  // Start at a random slot to spread processes over the slots.
+  long first_i = random() % limit;
+  while (1) {
+    for (long i = 0; i < limit; i++) {
+      int res = try_lock_slot(directory, (first_i + i) % limit);
+      if (res >= 0) {
+        *slot = res;
+        return 0;
+      }
+      if (res != -EWOULDBLOCK) {
+        return res;
+      }
+    }
+    if (atomic_load(is_stopping)) {
+      return -ECANCELED;
+    }
+    usleep(SLOT_RETRY_US + random() % SLOT_RETRY_US);
+  }
+}
+
+void connect_limit_release(int slot) {
+  if (slot >= 0) {
+    close(slot);  // Also releases the lock.
+  }
+}
@@ -0,0 +1,15 @@
+// Connection limit
+//
+// Caps how many bambucam processes on the same host connect to their printers
+// at once, e.g., when a whole fleet starts after a power cut, so that the
+// printers and network aren't flooded with handshakes. Slots are locked files,
+// so a crashed process never holds on to one.
+
+#include <stdatomic.h>
+
+// Waits for a free slot and passes a handle to it in slot, to be released with
+// connect_limit_release once connected. Passes -1 without waiting if no limit
+// is configured. Returns -ECANCELED if is_stopping is set while all slots are
+// busy, or another negative value if the slot files can't be used.
+int connect_limit_acquire(int* slot, const atomic_bool* is_stopping);
+void connect_limit_release(int slot);
@@ -0,0 +1,156 @@
+#include "frame_mailbox.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// One buffer for each of the producer, the slot and the consumer.
+#define NUM_BUFFERS 3
+
+// Set in the slot's buffer index while it holds a frame not yet taken.
+#define FRESH_FLAG 0x4
+
+// A posted frame.
+typedef struct {
+  uint8_t* buffer;
+  size_t size;
+  int64_t timestamp_us;
+} frame_t;
+
+// The internal representation of the opaque pointer.
+typedef struct frame_mailbox {
+  frame_t frames[NUM_BUFFERS];
+
+  // Index of the frame the producer writes into, only accessed by the
+  // producer, and of the frame the consumer last took, only accessed by the
+  // consumer. The slot holds the index of the third frame, which the producer
+  // and the consumer swap theirs for, along with FRESH_FLAG.
+  unsigned producer_index;
+  unsigned consumer_index;
+  atomic_uint slot;
+
+  // Counted by the producer, read by anyone.
+  atomic_uint_least64_t skipped;
+
+  // Set by the consumer while waiting on cond for a frame, which the producer
+  // checks after posting to wake it up. Both sides access the slot and this
+  // flag in opposite order with sequentially consistent atomics, so that
+  // either the consumer sees the new frame or the producer sees it waiting.
+  atomic_bool is_waiting;
+  atomic_bool is_closed;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} ctx_internal_t;
+
+int frame_mailbox_alloc(frame_mailbox_t* mailbox, size_t buffer_size) {
+  ctx_internal_t* ctx_internal = calloc(1, sizeof(ctx_internal_t));
+  if (ctx_internal == NULL) {
+    fprintf(stderr, "Error allocating frame mailbox: %s\n", strerror(errno));
+    return -errno;
+  }
+
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+  ctx_internal->mutex = mutex;
+  ctx_internal->cond = cond;
+  for (unsigned i = 0; i < NUM_BUFFERS; i++) {
+    ctx_internal->frames[i].buffer = malloc(buffer_size);
+    if (ctx_internal->frames[i].buffer == NULL) {
+      fprintf(stderr, "Error allocating frame mailbox: %s\n",
+              strerror(errno));
+      frame_mailbox_free(ctx_internal);
+      return -ENOMEM;
+    }
+  }
+  ctx_internal->producer_index = 0;
+  atomic_init(&ctx_internal->slot, 1);
+  ctx_internal->consumer_index = 2;
+
+  *mailbox = ctx_internal;
+  return 0;
+}
+
+int frame_mailbox_free(frame_mailbox_t mailbox) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) mailbox;
+  for (unsigned i = 0; i < NUM_BUFFERS; i++) {
+    free(ctx_internal->frames[i].buffer);
+  }
+  free(ctx_internal);
+  return 0;
+}
+
+uint8_t* frame_mailbox_get_buffer(frame_mailbox_t mailbox) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) mailbox;
+  return ctx_internal->frames[ctx_internal->producer_index].buffer;
+}
+
+void frame_mailbox_post(frame_mailbox_t mailbox, size_t size,
+                        int64_t timestamp_us) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) mailbox;
+  frame_t* frame = &ctx_internal->frames[ctx_internal->producer_index];
+  frame->size = size;
+  frame->timestamp_us = timestamp_us;
+
+  unsigned previous = atomic_exchange(&ctx_internal->slot,
+                                      ctx_internal->producer_index |
+                                      FRESH_FLAG);
+  if (previous & FRESH_FLAG) {
+    atomic_fetch_add_explicit(&ctx_internal->skipped, 1,
+                              memory_order_relaxed);
+  }
+  ctx_internal->producer_index = previous & ~FRESH_FLAG;
+
+  if (atomic_load(&ctx_internal->is_waiting)) {
+    pthread_mutex_lock(&ctx_internal->mutex);
+    pthread_cond_signal(&ctx_internal->cond);
+    pthread_mutex_unlock(&ctx_internal->mutex);
+  }
+}
+
+int frame_mailbox_take(frame_mailbox_t mailbox, uint8_t** buffer,
+                       size_t* size, int64_t* timestamp_us) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) mailbox;
+
+  if (!(atomic_load(&ctx_internal->slot) & FRESH_FLAG)) {
+    pthread_mutex_lock(&ctx_internal->mutex);
+    atomic_store(&ctx_internal->is_waiting, true);
+    while (!(atomic_load(&ctx_internal->slot) & FRESH_FLAG) &&
+           !ctx_internal->is_closed) {
+      pthread_cond_wait(&ctx_internal->cond, &ctx_internal->mutex);
+    }
+    atomic_store(&ctx_internal->is_waiting, false);
+    pthread_mutex_unlock(&ctx_internal->mutex);
+  }
+  if (ctx_internal->is_closed) {
+    return -ECANCELED;
+  }
+
+  // Only the producer sets FRESH_FLAG, so the slot still holds a fresh frame,
+  // if not an even fresher one.
+  unsigned fresh = atomic_exchange(&ctx_internal->slot,
+                                   ctx_internal->consumer_index);
+  ctx_internal->consumer_index = fresh & ~FRESH_FLAG;
+
+  frame_t* frame = &ctx_internal->frames[ctx_internal->consumer_index];
+  *buffer = frame->buffer;
+  *size = frame->size;
+  *timestamp_us = frame->timestamp_us;
+  return 0;
+}
+
+void frame_mailbox_close(frame_mailbox_t mailbox) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) mailbox;
+  pthread_mutex_lock(&ctx_internal->mutex);
+  ctx_internal->is_closed = true;
+  pthread_cond_broadcast(&ctx_internal->cond);
+  pthread_mutex_unlock(&ctx_internal->mutex);
+}
+
+uint64_t frame_mailbox_skipped(frame_mailbox_t mailbox) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) mailbox;
+  return atomic_load_explicit(&ctx_internal->skipped, memory_order_relaxed);
+}
@@ -0,0 +1,48 @@
+// Frame mailbox
+//
+// A single slot holding the latest frame between a producer that must never
+// wait, e.g., the thread reading frames from the printer, and a consumer that
+// may fall behind, e.g., the thread fanning frames out to clients. Posting a
+// frame replaces any frame the consumer hasn't taken yet, which is counted as
+// skipped, so the consumer always gets the latest one.
+//
+// Backed by three preallocated buffers that the producer and the consumer
+// swap through the slot with a single atomic exchange each, so that posting
+// and taking are wait-free and neither copies nor allocates. The producer
+// only takes a lock to wake up the consumer when it's waiting for a frame,
+// i.e., never while it's busy with the previous one.
+//
+// Supports a single producer thread and a single consumer thread.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Opaque pointer to the mailbox state. The caller owns this object.
+typedef struct frame_mailbox* frame_mailbox_t;
+
+// Allocates a mailbox of frames of at most buffer_size bytes. The caller is
+// expected to call frame_mailbox_free when done with it.
+int frame_mailbox_alloc(frame_mailbox_t* mailbox, size_t buffer_size);
+int frame_mailbox_free(frame_mailbox_t mailbox);
+
+// Returns the producer's buffer of buffer_size bytes to write the next frame
+// into, which changes with every frame_mailbox_post call.
+uint8_t* frame_mailbox_get_buffer(frame_mailbox_t mailbox);
+
+// Posts the frame written into the producer's buffer as the latest frame.
+void frame_mailbox_post(frame_mailbox_t mailbox, size_t size,
+                        int64_t timestamp_us);
+
+// Waits for a frame posted since the last call, unless there already is one,
+// and passes it in the given arguments. The buffer stays valid until the next
+// call.
+//
+// Returns -ECANCELED once the mailbox is closed.
+int frame_mailbox_take(frame_mailbox_t mailbox, uint8_t** buffer,
+                       size_t* size, int64_t* timestamp_us);
+
+// Wakes up and fails any current and future frame_mailbox_take calls.
+void frame_mailbox_close(frame_mailbox_t mailbox);
+
+// Returns the number of frames skipped so far.
+uint64_t frame_mailbox_skipped(frame_mailbox_t mailbox);
@@ -0,0 +1,177 @@
+#include "frame_queue.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A queued frame.
+typedef struct {
+  uint8_t* buffer;
+  size_t size;
+  int64_t timestamp_us;
+} slot_t;
+
+// The internal representation of the opaque pointer.
+typedef struct frame_queue {
+  frame_queue_policy_t policy;
+  size_t buffer_size;
+
+  // Circular queue where slots[i % capacity] for i in [head, tail) hold
+  // frames, oldest first.
+  slot_t* slots;
+  size_t capacity;
+  uint64_t head;
+  uint64_t tail;
+  uint64_t dropped;
+  bool is_closed;
+
+  // Buffer the producer copies the next frame into before swapping it into a
+  // slot. Only accessed by the producer.
+  uint8_t* spare_buffer;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} ctx_internal_t;
+
+int frame_queue_parse_policy(const char* name, frame_queue_policy_t* policy) {
+  if (strcmp(name, "drop-oldest") == 0) {
+    *policy = FRAME_QUEUE_DROP_OLDEST;
+  } else if (strcmp(name, "drop-newest") == 0) {
+    *policy = FRAME_QUEUE_DROP_NEWEST;
+  } else {
+    fprintf(stderr, "Unknown frame drop policy: %s\n", name);
+    return -EINVAL;
+  }
+  return 0;
+}
+
+int frame_queue_alloc(frame_queue_t* queue, size_t capacity,
+                      size_t buffer_size, frame_queue_policy_t policy) {
+  ctx_internal_t* ctx_internal = calloc(1, sizeof(ctx_internal_t));
+  if (ctx_internal == NULL) {
+    fprintf(stderr, "Error allocating frame queue: %s\n", strerror(errno));
+    return -errno;
+  }
+
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+  ctx_internal->mutex = mutex;
+  ctx_internal->cond = cond;
+  ctx_internal->policy = policy;
+  ctx_internal->buffer_size = buffer_size;
+  ctx_internal->capacity = capacity > 0 ? capacity : 1;
+  ctx_internal->slots = calloc(ctx_internal->capacity, sizeof(slot_t));
+  ctx_internal->spare_buffer = malloc(buffer_size);
+  if (ctx_internal->slots == NULL || ctx_internal->spare_buffer == NULL) {
+    fprintf(stderr, "Error allocating frame queue: %s\n", strerror(errno));
+    frame_queue_free(ctx_internal);
+    return -ENOMEM;
+  }
+  for (size_t i = 0; i < ctx_internal->capacity; i++) {
+    ctx_internal->slots[i].buffer = malloc(buffer_size);
+    if (ctx_internal->slots[i].buffer == NULL) {
+      fprintf(stderr, "Error allocating frame queue: %s\n", strerror(errno));
+      frame_queue_free(ctx_internal);
+      return -ENOMEM;
+    }
+  }
+
+  *queue = ctx_internal;
+  return 0;
+}
+
+int frame_queue_free(frame_queue_t queue) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) queue;
+  if (ctx_internal->slots) {
+    for (size_t i = 0; i < ctx_internal->capacity; i++) {
+      free(ctx_internal->slots[i].buffer);
+    }
+  }
+  free(ctx_internal->slots);
+  free(ctx_internal->spare_buffer);
+  free(ctx_internal);
+  return 0;
+}
+
+int frame_queue_push(frame_queue_t queue, const uint8_t* buffer, size_t size,
+                     int64_t timestamp_us) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) queue;
+  if (size > ctx_internal->buffer_size) {
+    fprintf(stderr, "Queued frame too large: %ld > %ld\n", size,
+            ctx_internal->buffer_size);
+    return -EINVAL;
+  }
+
+  // Copy without holding the lock, so that the consumer never waits on it.
+  memcpy(ctx_internal->spare_buffer, buffer, size);
+
+  pthread_mutex_lock(&ctx_internal->mutex);
+  if (ctx_internal->is_closed) {
+    pthread_mutex_unlock(&ctx_internal->mutex);
+    return -ECANCELED;
+  }
+  if (ctx_internal->tail - ctx_internal->head == ctx_internal->capacity) {
+    ctx_internal->dropped++;
+    if (ctx_internal->policy == FRAME_QUEUE_DROP_NEWEST) {
+      pthread_mutex_unlock(&ctx_internal->mutex);
+      return 0;
+    }
+    ctx_internal->head++;
+  }
+
+  slot_t* slot = &ctx_internal->slots[ctx_internal->tail %
+                                      ctx_internal->capacity];
+  uint8_t* slot_buffer = slot->buffer;
+  slot->buffer = ctx_internal->spare_buffer;
+  slot->size = size;
+  slot->timestamp_us = timestamp_us;
+  ctx_internal->spare_buffer = slot_buffer;
+  ctx_internal->tail++;
+  pthread_cond_signal(&ctx_internal->cond);
+  pthread_mutex_unlock(&ctx_internal->mutex);
+  return 0;
+}
+
+int frame_queue_pop(frame_queue_t queue, uint8_t** buffer, size_t* size,
+                    int64_t* timestamp_us) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) queue;
+
+  pthread_mutex_lock(&ctx_internal->mutex);
+  while (ctx_internal->head == ctx_internal->tail &&
+         !ctx_internal->is_closed) {
+    pthread_cond_wait(&ctx_internal->cond, &ctx_internal->mutex);
+  }
+  if (ctx_internal->is_closed) {
+    pthread_mutex_unlock(&ctx_internal->mutex);
+    return -ECANCELED;
+  }
+
+  slot_t* slot = &ctx_internal->slots[ctx_internal->head %
+                                      ctx_internal->capacity];
+  uint8_t* slot_buffer = slot->buffer;
+  slot->buffer = *buffer;
+  *buffer = slot_buffer;
+  *size = slot->size;
+  *timestamp_us = slot->timestamp_us;
+  ctx_internal->head++;
+  pthread_mutex_unlock(&ctx_internal->mutex);
+  return 0;
+}
+
+void frame_queue_close(frame_queue_t queue) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) queue;
+  pthread_mutex_lock(&ctx_internal->mutex);
+  ctx_internal->is_closed = true;
+  pthread_cond_broadcast(&ctx_internal->cond);
+  pthread_mutex_unlock(&ctx_internal->mutex);
+}
+
+uint64_t frame_queue_dropped(frame_queue_t queue) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) queue;
+  pthread_mutex_lock(&ctx_internal->mutex);
+  uint64_t dropped = ctx_internal->dropped;
+  pthread_mutex_unlock(&ctx_internal->mutex);
+  return dropped;
+}
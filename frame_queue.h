@@ -0,0 +1,53 @@
+// Frame queue
+//
+// A bounded queue of compressed frames between the capture thread and a slow
+// consumer, e.g., an encoder. Pushing never waits on the consumer: when the
+// queue is full, a frame is dropped according to the queue's policy and
+// counted. Frames are copied into preallocated buffers, and buffers are
+// swapped rather than copied when popping, so no memory is allocated and no
+// lock is held while copying.
+//
+// Supports a single producer thread and a single consumer thread.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Opaque pointer to the queue state. The caller owns this object.
+typedef struct frame_queue* frame_queue_t;
+
+// Which frame to drop when pushing onto a full queue.
+typedef enum {
+  FRAME_QUEUE_DROP_OLDEST,  // Keep the latest frames, e.g., for live video.
+  FRAME_QUEUE_DROP_NEWEST,  // Keep the queued frames, e.g., for recordings.
+} frame_queue_policy_t;
+
+// Parses a policy name ("drop-oldest" or "drop-newest"). Returns a negative
+// value if unknown.
+int frame_queue_parse_policy(const char* name, frame_queue_policy_t* policy);
+
+// Allocates a queue of up to capacity frames of at most buffer_size bytes each.
+// The caller is expected to call frame_queue_free when done with it.
+int frame_queue_alloc(frame_queue_t* queue, size_t capacity,
+                      size_t buffer_size, frame_queue_policy_t policy);
+int frame_queue_free(frame_queue_t queue);
+
+// Copies the given frame into the queue, dropping a frame if it's full.
+// Returns a negative value if the frame is too large or the queue is closed.
+int frame_queue_push(frame_queue_t queue, const uint8_t* buffer, size_t size,
+                     int64_t timestamp_us);
+
+// Waits for the oldest frame and passes it in the given arguments, where
+// buffer must point to a buffer of the queue's buffer_size allocated with
+// malloc. The queue takes ownership of that buffer in exchange for the
+// frame's, which the caller then owns.
+//
+// Returns -ECANCELED once the queue is closed.
+int frame_queue_pop(frame_queue_t queue, uint8_t** buffer, size_t* size,
+                    int64_t* timestamp_us);
+
+// Wakes up and fails any current and future frame_queue_pop calls.
+void frame_queue_close(frame_queue_t queue);
+
+// Returns the number of frames dropped so far.
+uint64_t frame_queue_dropped(frame_queue_t queue);
@@ -0,0 +1,185 @@
+#include "frame_ring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+// Smallest expected frame size, used to size the index so that it never runs
+// out of entries before the arena runs out of bytes for realistic frames.
+#define MIN_FRAME_SIZE_BYTES (4 * 1024)
+
+// Location and details of a single frame stored in the arena.
+typedef struct {
+  size_t offset;
+  size_t size;
+  int64_t timestamp_us;
+} index_entry_t;
+
+// The internal representation of the opaque pointer.
+typedef struct frame_ring {
+  // Frame data, stored contiguously per frame in push order and wrapping
+  // around to the start of the arena when a frame doesn't fit at the end.
+  uint8_t* arena;
+  size_t arena_size;
+
+  // Circular index of the frames in the arena, where frame seq lives in
+  // index[seq % index_size] for all seq in [head_seq, tail_seq).
+  index_entry_t* index;
+  size_t index_size;
+  uint64_t head_seq;
+  uint64_t tail_seq;
+
+  // Arena offset just past the newest frame.
+  size_t tail_offset;
+
+  pthread_mutex_t mutex;
+} ctx_internal_t;
+
+int frame_ring_alloc(frame_ring_t* ring, size_t budget_bytes) {
+  ctx_internal_t* ctx_internal = malloc(sizeof(ctx_internal_t));
+  if (ctx_internal == NULL) {
+    fprintf(stderr, "Error allocating frame ring: %s\n", strerror(errno));
+    return -errno;
+  }
+
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  memset(ctx_internal, 0, sizeof(ctx_internal_t));
+  ctx_internal->mutex = mutex;
+  ctx_internal->arena_size = budget_bytes;
+  ctx_internal->index_size = MAX(budget_bytes / MIN_FRAME_SIZE_BYTES, 1);
+  ctx_internal->arena = malloc(ctx_internal->arena_size);
+  ctx_internal->index = calloc(ctx_internal->index_size,
+                               sizeof(index_entry_t));
+  if (ctx_internal->arena == NULL || ctx_internal->index == NULL) {
+    fprintf(stderr, "Error allocating frame ring arena: %s\n", strerror(errno));
+    frame_ring_free(ctx_internal);
+    return -ENOMEM;
+  }
+
+  *ring = ctx_internal;
+  return 0;
+}
+
+int frame_ring_free(frame_ring_t ring) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ring;
+  free(ctx_internal->arena);
+  free(ctx_internal->index);
+  free(ctx_internal);
+  return 0;
+}
+
+static index_entry_t* get_entry(ctx_internal_t* ctx_internal, uint64_t seq) {
+  return &ctx_internal->index[seq % ctx_internal->index_size];
+}
+
+static bool overlaps(size_t a_offset, size_t a_size,
+                     size_t b_offset, size_t b_size) {
+  return a_offset < b_offset + b_size && b_offset < a_offset + a_size;
+}
+
+int frame_ring_push(frame_ring_t ring, const uint8_t* buffer, size_t size,
+                    int64_t timestamp_us) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ring;
+  if (size > ctx_internal->arena_size) {
+    fprintf(stderr, "Frame too large for ring: %ld > %ld\n", size,
+            ctx_internal->arena_size);
+    return -EINVAL;
+  }
+
+  pthread_mutex_lock(&ctx_internal->mutex);
+
+  // Evict the oldest frames until the new frame has a free spot right after
+  // the newest frame, or at the start of the arena if it doesn't fit there.
+  size_t offset;
+  while (1) {
+    if (ctx_internal->head_seq == ctx_internal->tail_seq) {
+      offset = 0;  // Empty, so start over at the beginning.
+      break;
+    }
+
+    offset = ctx_internal->tail_offset;
+    if (offset + size > ctx_internal->arena_size) {
+      offset = 0;
+    }
+
+    index_entry_t* oldest = get_entry(ctx_internal, ctx_internal->head_seq);
+    bool index_full = ctx_internal->tail_seq - ctx_internal->head_seq ==
+                      ctx_internal->index_size;
+    if (!index_full &&
+        !overlaps(offset, size, oldest->offset, oldest->size)) {
+      break;
+    }
+    ctx_internal->head_seq++;
+  }
+
+  memcpy(ctx_internal->arena + offset, buffer, size);
+  index_entry_t* entry = get_entry(ctx_internal, ctx_internal->tail_seq);
+  entry->offset = offset;
+  entry->size = size;
+  entry->timestamp_us = timestamp_us;
+  ctx_internal->tail_seq++;
+  ctx_internal->tail_offset = offset + size;
+
+  pthread_mutex_unlock(&ctx_internal->mutex);
+  return 0;
+}
+
+uint64_t frame_ring_find(frame_ring_t ring, int64_t timestamp_us) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ring;
+  pthread_mutex_lock(&ctx_internal->mutex);
+
+  // Binary search, since frames are pushed in capture order.
+  uint64_t low = ctx_internal->head_seq;
+  uint64_t high = ctx_internal->tail_seq;
+  while (low < high) {
+    uint64_t middle = low + (high - low) / 2;
+    if (get_entry(ctx_internal, middle)->timestamp_us < timestamp_us) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  pthread_mutex_unlock(&ctx_internal->mutex);
+  return low;
+}
+
+uint64_t frame_ring_next(frame_ring_t ring) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ring;
+  pthread_mutex_lock(&ctx_internal->mutex);
+  uint64_t seq = ctx_internal->tail_seq;
+  pthread_mutex_unlock(&ctx_internal->mutex);
+  return seq;
+}
+
+ssize_t frame_ring_read(frame_ring_t ring, uint64_t seq, size_t offset,
+                        uint8_t* buffer, size_t max,
+                        size_t* size, int64_t* timestamp_us) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ring;
+  pthread_mutex_lock(&ctx_internal->mutex);
+
+  if (seq < ctx_internal->head_seq) {
+    pthread_mutex_unlock(&ctx_internal->mutex);
+    return -ENOENT;
+  }
+  if (seq >= ctx_internal->tail_seq) {
+    pthread_mutex_unlock(&ctx_internal->mutex);
+    return -EAGAIN;
+  }
+
+  index_entry_t* entry = get_entry(ctx_internal, seq);
+  *size = entry->size;
+  *timestamp_us = entry->timestamp_us;
+
+  size_t copy_size = offset < entry->size ? MIN(entry->size - offset, max) : 0;
+  if (copy_size > 0) {
+    memcpy(buffer, ctx_internal->arena + entry->offset + offset, copy_size);
+  }
+
+  pthread_mutex_unlock(&ctx_internal->mutex);
+  return copy_size;
+}
@@ -0,0 +1,44 @@
+// Frame ring buffer
+//
+// Keeps the most recent compressed frames in a single preallocated arena so
+// they can be replayed later. Frames are evicted oldest-first whenever a new
+// frame needs room, so memory use is bounded by the arena size in bytes rather
+// than by a number of frames. No memory is allocated per frame.
+//
+// Frames are identified by a sequence number that increases with every pushed
+// frame. All functions are safe to call from multiple threads.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Opaque pointer to the ring state. The caller owns this object.
+typedef struct frame_ring* frame_ring_t;
+
+// Allocates a ring that holds up to budget_bytes of frame data. The caller is
+// expected to call frame_ring_free when done with it.
+int frame_ring_alloc(frame_ring_t* ring, size_t budget_bytes);
+int frame_ring_free(frame_ring_t ring);
+
+// Copies the given frame into the ring, evicting the oldest frames as needed.
+// Returns a negative value if the frame can never fit.
+int frame_ring_push(frame_ring_t ring, const uint8_t* buffer, size_t size,
+                    int64_t timestamp_us);
+
+// Returns the sequence number of the oldest frame captured at or after
+// timestamp_us, or the sequence number the next pushed frame will have if
+// there is no such frame yet.
+uint64_t frame_ring_find(frame_ring_t ring, int64_t timestamp_us);
+
+// Returns the sequence number the next pushed frame will have.
+uint64_t frame_ring_next(frame_ring_t ring);
+
+// Copies up to max bytes of the given frame, starting at offset, into buffer
+// and passes the frame's total size and capture time in the given arguments.
+// Passing a zero max only fetches the frame details.
+//
+// Returns the number of bytes copied, -ENOENT if the frame was already
+// evicted, or -EAGAIN if the frame was not pushed yet.
+ssize_t frame_ring_read(frame_ring_t ring, uint64_t seq, size_t offset,
+                        uint8_t* buffer, size_t max,
+                        size_t* size, int64_t* timestamp_us);
@@ -0,0 +1,208 @@
+#include "jpeg_transform.h"
+
+#include <errno.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include <jerror.h>
+#include <jpeglib.h>
+
+// Largest quantization table value allowed in baseline JPEGs.
+#define QUANT_MAX_BASELINE 255
+
+// Error manager that returns control to the transform instead of exiting.
+typedef struct {
+  struct jpeg_error_mgr manager;
+  jmp_buf jump;
+} transform_error_t;
+
+// Region to crop, in pixels.
+typedef struct {
+  int x;
+  int y;
+  int width;
+  int height;
+} region_t;
+
+// Transforms the source's coefficients in place and sets up the destination
+// to match, given the transform's arguments. Returns a negative value if the
+// source can't be transformed.
+typedef int (*transform_t)(j_decompress_ptr source, j_compress_ptr destination,
+                           jvirt_barray_ptr* coefficients, const void* args);
+
+// Destination that writes into a fixed buffer and fails once it's full.
+typedef struct {
+  struct jpeg_destination_mgr manager;
+  uint8_t* buffer;
+  size_t size;
+} destination_t;
+
+static void on_error(j_common_ptr info) {
+  transform_error_t* error = (transform_error_t*) info->err;
+  (*info->err->output_message)(info);
+  longjmp(error->jump, 1);
+}
+
+static void init_destination(j_compress_ptr info) {
+  destination_t* destination = (destination_t*) info->dest;
+  destination->manager.next_output_byte = destination->buffer;
+  destination->manager.free_in_buffer = destination->size;
+}
+
+static boolean empty_output_buffer(j_compress_ptr info) {
+  ERREXIT(info, JERR_BUFFER_SIZE);
+  return FALSE;
+}
+
+static void term_destination(j_compress_ptr info) {
+}
+
+// Scales the destination's quantization tables by the int pointed to by args
+// and requantizes the source's coefficients from the source's tables to them.
+static int requantize(j_decompress_ptr source, j_compress_ptr destination,
+                      jvirt_barray_ptr* coefficients, const void* args) {
+  int scale = *(const int*) args;
+  for (int i = 0; i < NUM_QUANT_TBLS; i++) {
+    JQUANT_TBL* table = destination->quant_tbl_ptrs[i];
+    for (int k = 0; table && k < DCTSIZE2; k++) {
+      int value = table->quantval[k];
+      table->quantval[k] = MAX(value, MIN(value * scale, QUANT_MAX_BASELINE));
+    }
+  }
+
+  for (int i = 0; i < source->num_components; i++) {
+    jpeg_component_info* component = &source->comp_info[i];
+    const JQUANT_TBL* old_table = component->quant_table;
+    const JQUANT_TBL* new_table =
+        destination->quant_tbl_ptrs[component->quant_tbl_no];
+    for (JDIMENSION row = 0; row < component->height_in_blocks; row++) {
+      JBLOCKARRAY blocks = (*source->mem->access_virt_barray)(
+          (j_common_ptr) source, coefficients[i], row, 1, TRUE);
+      for (JDIMENSION column = 0; column < component->width_in_blocks;
+           column++) {
+        JCOEF* block = blocks[0][column];
+        for (int k = 0; k < DCTSIZE2; k++) {
+          long old_quant = old_table->quantval[k];
+          long new_quant = new_table->quantval[k];
+          long value = block[k] * old_quant;
+          // Round to the nearest step, away from zero on ties.
+          block[k] = (value + (value < 0 ? -new_quant : new_quant) / 2) /
+                     new_quant;
+        }
+      }
+    }
+  }
+
+  // Coarser coefficients have different statistics, so fit Huffman tables to
+  // them rather than keeping the original ones.
+  destination->optimize_coding = TRUE;
+  return 0;
+}
+
+// Crops the source to the region_t pointed to by args by moving the region's
+// blocks to the start of the coefficient arrays. Blocks only ever move towards
+// the start, so that moving them in order never overwrites one still needed.
+static int crop(j_decompress_ptr source, j_compress_ptr destination,
+                jvirt_barray_ptr* coefficients, const void* args) {
+  const region_t* region = (const region_t*) args;
+  int mcu_width = source->max_h_samp_factor * DCTSIZE;
+  int mcu_height = source->max_v_samp_factor * DCTSIZE;
+  int x = MAX(region->x, 0) / mcu_width;  // In MCUs.
+  int y = MAX(region->y, 0) / mcu_height;
+  if (region->x >= (int) source->image_width ||
+      region->y >= (int) source->image_height || region->width <= 0 ||
+      region->height <= 0 || region->x + region->width <= 0 ||
+      region->y + region->height <= 0) {
+    fprintf(stderr, "Crop region is outside of the %dx%d image\n",
+            source->image_width, source->image_height);
+    return -EINVAL;
+  }
+  destination->image_width = MIN(region->x + region->width,
+                                 (int) source->image_width) - x * mcu_width;
+  destination->image_height = MIN(region->y + region->height,
+                                  (int) source->image_height) - y * mcu_height;
+
+  for (int i = 0; i < source->num_components; i++) {
+    jpeg_component_info* component = &source->comp_info[i];
+    int block_x = x * component->h_samp_factor;
+    int block_y = y * component->v_samp_factor;
+    int block_width = (destination->image_width * component->h_samp_factor +
+                       mcu_width - 1) / mcu_width;
+    int block_height = (destination->image_height * component->v_samp_factor +
+                        mcu_height - 1) / mcu_height;
+    for (int row = 0; row < block_height; row++) {
+      JBLOCKARRAY from = (*source->mem->access_virt_barray)(
+          (j_common_ptr) source, coefficients[i], block_y + row, 1, FALSE);
+      JBLOCKARRAY to = (*source->mem->access_virt_barray)(
+          (j_common_ptr) source, coefficients[i], row, 1, TRUE);
+      memmove(to[0], from[0] + block_x, block_width * sizeof(JBLOCK));
+    }
+  }
+  return 0;
+}
+
+// Reads the coefficients of the input, transforms them and writes the result
+// into output. Returns the size of the result or a negative value on error.
+static ssize_t transform_jpeg(const uint8_t* input, size_t input_size,
+                              transform_t transform, const void* args,
+                              uint8_t* output, size_t output_size) {
+  struct jpeg_decompress_struct source = { 0 };
+  struct jpeg_compress_struct destination = { 0 };
+  transform_error_t error;
+  destination_t output_destination = {
+    .manager = {
+      .init_destination = init_destination,
+      .empty_output_buffer = empty_output_buffer,
+      .term_destination = term_destination,
+    },
+    .buffer = output,
+    .size = output_size,
+  };
+
+  source.err = jpeg_std_error(&error.manager);
+  destination.err = &error.manager;
+  error.manager.error_exit = on_error;
+  if (setjmp(error.jump)) {
+    jpeg_destroy_compress(&destination);
+    jpeg_destroy_decompress(&source);
+    return -EINVAL;
+  }
+  jpeg_create_decompress(&source);
+  jpeg_create_compress(&destination);
+
+  jpeg_mem_src(&source, input, input_size);
+  jpeg_read_header(&source, TRUE);
+  jvirt_barray_ptr* coefficients = jpeg_read_coefficients(&source);
+  jpeg_copy_critical_parameters(&source, &destination);
+  if (transform(&source, &destination, coefficients, args) < 0) {
+    jpeg_destroy_compress(&destination);
+    jpeg_destroy_decompress(&source);
+    return -EINVAL;
+  }
+
+  destination.dest = &output_destination.manager;
+  jpeg_write_coefficients(&destination, coefficients);
+  jpeg_finish_compress(&destination);
+  size_t size = output_size - output_destination.manager.free_in_buffer;
+
+  jpeg_finish_decompress(&source);
+  jpeg_destroy_compress(&destination);
+  jpeg_destroy_decompress(&source);
+  return size;
+}
+
+ssize_t jpeg_requantize(const uint8_t* input, size_t input_size, int scale,
+                        uint8_t* output, size_t output_size) {
+  return transform_jpeg(input, input_size, requantize, &scale, output,
+                        output_size);
+}
+
+ssize_t jpeg_crop(const uint8_t* input, size_t input_size,
+                  int x, int y, int width, int height,
+                  uint8_t* output, size_t output_size) {
+  region_t region = { .x = x, .y = y, .width = width, .height = height };
+  return transform_jpeg(input, input_size, crop, &region, output,
+                        output_size);
+}
@@ -0,0 +1,32 @@
+// Lossless-path JPEG transforms
+//
+// Transforms JPEG frames in the DCT coefficient domain using libjpeg, i.e.,
+// only entropy decoding and re-encoding the quantized coefficients instead of
+// fully decoding and re-encoding the image. That is much cheaper and doesn't
+// lose more quality than the transform itself implies.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Lowers the quality of the given JPEG by scaling its quantization tables by
+// scale (e.g., 2 doubles every step, up to the baseline maximum) and
+// requantizing its coefficients to match. Writes the result into output.
+//
+// Returns the size of the result, or a negative value if the input is not a
+// valid JPEG or the result doesn't fit into output_size bytes.
+ssize_t jpeg_requantize(const uint8_t* input, size_t input_size, int scale,
+                        uint8_t* output, size_t output_size);
+
+// Crops the given JPEG to the given region without any loss, like
+// "jpegtran -crop". The region's top left corner is moved up and left onto the
+// nearest MCU boundary (e.g., multiples of 16 pixels), growing the region to
+// still cover it, and the region is clipped to the image. Writes the result
+// into output.
+//
+// Returns the size of the result, or a negative value if the input is not a
+// valid JPEG, the region is outside of the image or the result doesn't fit
+// into output_size bytes.
+ssize_t jpeg_crop(const uint8_t* input, size_t input_size,
+                  int x, int y, int width, int height,
+                  uint8_t* output, size_t output_size);
@@ -0,0 +1,105 @@
+#include "jpeg_validate.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+// Marker codes, i.e., the byte following 0xFF, with TEM and RST0 through RST7
+// standing alone while every other marker starts a segment with a length.
+#define MARKER_PREFIX 0xFF
+#define MARKER_TEM 0x01
+#define MARKER_RST0 0xD0
+#define MARKER_RST7 0xD7
+#define MARKER_SOI 0xD8
+#define MARKER_EOI 0xD9
+#define MARKER_SOS 0xDA
+
+// Returns the position of the marker ending the entropy-coded data starting at
+// pos, i.e., the first 0xFF not followed by a stuffed zero or a restart
+// marker, or size if the data runs until the end of the buffer.
+static size_t find_scan_end(const uint8_t* buffer, size_t size, size_t pos) {
+  while (pos < size) {
+    const uint8_t* prefix = memchr(buffer + pos, MARKER_PREFIX, size - pos);
+    if (prefix == NULL) {
+      return size;
+    }
+    pos = prefix - buffer;
+    if (pos + 1 >= size) {
+      return pos;  // Truncated right after the prefix.
+    }
+    uint8_t code = buffer[pos + 1];
+    if (code != 0 && (code < MARKER_RST0 || code > MARKER_RST7)) {
+      return pos;
+    }
+    pos += 2;
+  }
+  return size;
+}
+
+jpeg_validity_t jpeg_validate(const uint8_t* buffer, size_t size,
+                              size_t* length) {
+  if (size < 2 || buffer[0] != MARKER_PREFIX || buffer[1] != MARKER_SOI) {
+    return JPEG_INVALID;
+  }
+
+  // Frames truncated after the image data started are kept up to the last
+  // complete part, i.e., the start of the marker that was cut off.
+  bool has_scan = false;
+  size_t pos = 2;
+  while (1) {
+    size_t marker_pos = pos;
+    if (pos >= size || buffer[pos] != MARKER_PREFIX) {
+      break;
+    }
+    while (pos < size && buffer[pos] == MARKER_PREFIX) {
+      pos++;  // Skip fill bytes.
+    }
+    if (pos >= size) {
+      pos = marker_pos;
+      break;
+    }
+
+    uint8_t code = buffer[pos++];
+    if (code == MARKER_EOI) {
+      *length = pos;
+      return JPEG_VALID;
+    }
+    if (code == 0) {
+      return JPEG_INVALID;
+    }
+    if (code == MARKER_TEM || (code >= MARKER_RST0 && code <= MARKER_RST7)) {
+      continue;
+    }
+
+    if (pos + 2 > size) {
+      pos = marker_pos;
+      break;
+    }
+    size_t segment_size = (buffer[pos] << 8) | buffer[pos + 1];
+    if (segment_size < 2) {
+      return JPEG_INVALID;
+    }
+    if (pos + segment_size > size) {
+      pos = marker_pos;
+      break;
+    }
+    pos += segment_size;
+
+    if (code == MARKER_SOS) {
+      has_scan = true;
+      pos = find_scan_end(buffer, size, pos);
+    }
+  }
+
+  if (!has_scan) {
+    return JPEG_INVALID;
+  }
+  *length = pos;
+  return JPEG_TRUNCATED;
+}
+
+size_t jpeg_repair(const uint8_t* buffer, size_t length, uint8_t* output) {
+  memcpy(output, buffer, length);
+  output[length] = MARKER_PREFIX;
+  output[length + 1] = MARKER_EOI;
+  return length + JPEG_EOI_SIZE;
+}
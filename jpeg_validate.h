@@ -0,0 +1,32 @@
+// JPEG validation
+//
+// Checks that frames are complete JPEGs before they're handed to consumers,
+// since the camera occasionally delivers truncated frames. Only walks the
+// marker segments instead of decoding anything, skipping through the
+// entropy-coded data with memchr, which libc vectorizes, so that checking a
+// frame costs about as much as reading it once.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Size of the EOI (end of image) marker that jpeg_repair appends.
+#define JPEG_EOI_SIZE 2
+
+typedef enum {
+  JPEG_VALID,
+  JPEG_TRUNCATED,  // Intact headers, but the image data ends without an EOI.
+  JPEG_INVALID,    // Not a JPEG, or broken before any image data.
+} jpeg_validity_t;
+
+// Checks the marker structure of the given frame. For valid frames, passes
+// the size up to and including the EOI marker in length, i.e., without any
+// trailing bytes. For truncated frames, passes the size of the complete part
+// of the frame to keep in length.
+jpeg_validity_t jpeg_validate(const uint8_t* buffer, size_t size,
+                              size_t* length);
+
+// Copies the first length bytes of a truncated frame into output, followed by
+// an EOI marker, so that decoders show what arrived of the image instead of
+// failing. Output must hold length + JPEG_EOI_SIZE bytes. Returns the size of
+// the repaired frame.
+size_t jpeg_repair(const uint8_t* buffer, size_t length, uint8_t* output);
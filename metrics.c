@@ -0,0 +1,91 @@
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+// Maximum number of distinct metrics and of collectors.
+#define MAX_NUM_ENTRIES 128
+#define MAX_NUM_COLLECTORS 8
+
+typedef struct {
+  char* name;
+  double value;
+} entry_t;
+
+static entry_t entries[MAX_NUM_ENTRIES];
+static size_t num_entries;
+static void (*collectors[MAX_NUM_COLLECTORS])(void);
+static size_t num_collectors;
+static pthread_mutex_t entries_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the entry of the given name, creating it if needed, or NULL if out of
+// space. Expects entries_mutex to be held.
+static entry_t* get_entry(const char* name) {
+  for (size_t i = 0; i < num_entries; i++) {
+    if (strcmp(entries[i].name, name) == 0) {
+      return &entries[i];
+    }
+  }
+
+  if (num_entries == MAX_NUM_ENTRIES) {
+    return NULL;
+  }
+  char* entry_name = strdup(name);
+  if (entry_name == NULL) {
+    return NULL;
+  }
+  entries[num_entries].name = entry_name;
+  entries[num_entries].value = 0;
+  return &entries[num_entries++];
+}
+
+void metrics_add(const char* name, double value) {
+  pthread_mutex_lock(&entries_mutex);
+  entry_t* entry = get_entry(name);
+  if (entry) {
+    entry->value += value;
+  }
+  pthread_mutex_unlock(&entries_mutex);
+}
+
+void metrics_set(const char* name, double value) {
+  pthread_mutex_lock(&entries_mutex);
+  entry_t* entry = get_entry(name);
+  if (entry) {
+    entry->value = value;
+  }
+  pthread_mutex_unlock(&entries_mutex);
+}
+
+void metrics_add_collector(void (*collect)(void)) {
+  pthread_mutex_lock(&entries_mutex);
+  if (num_collectors < MAX_NUM_COLLECTORS) {
+    collectors[num_collectors++] = collect;
+  }
+  pthread_mutex_unlock(&entries_mutex);
+}
+
+size_t metrics_format(char* buffer, size_t size) {
+  // Collectors set metrics themselves, so call them without holding the lock.
+  pthread_mutex_lock(&entries_mutex);
+  size_t count = num_collectors;
+  pthread_mutex_unlock(&entries_mutex);
+  for (size_t i = 0; i < count; i++) {
+    collectors[i]();
+  }
+
+  size_t pos = 0;
+  pthread_mutex_lock(&entries_mutex);
+  for (size_t i = 0; i < num_entries; i++) {
+    int res = snprintf(buffer + MIN(pos, size), size - MIN(pos, size),
+                       "%s %.17g\n", entries[i].name, entries[i].value);
+    if (res > 0) {
+      pos += res;
+    }
+  }
+  pthread_mutex_unlock(&entries_mutex);
+  return pos;
+}
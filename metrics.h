@@ -0,0 +1,22 @@
+// Metrics
+//
+// A small registry of named values exported in the Prometheus text format,
+// e.g., by the HTTP server at GET /metrics. Names may include labels, e.g.,
+// "bambucam_connects_total{device=\"0123456789ABCDE\"}". Safe to use from any
+// thread.
+
+#include <stddef.h>
+
+// Adds to the named counter, creating it at zero on first use.
+void metrics_add(const char* name, double value);
+
+// Sets the named gauge, creating it on first use.
+void metrics_set(const char* name, double value);
+
+// Registers a function called before metrics are formatted, e.g., to update
+// metrics sampled from elsewhere.
+void metrics_add_collector(void (*collect)(void));
+
+// Writes every metric into the given buffer, one "name value" line each.
+// Returns the size of the full output like snprintf, which may exceed size.
+size_t metrics_format(char* buffer, size_t size);
@@ -0,0 +1,360 @@
+#include "recorder.h"
+
+#include "config.h"
+#include "metrics.h"
+#include "thread_setup.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Record every Nth frame (zero disables).
+#define EVERY_OPTION "record_every"
+#define EVERY_DEFAULT 10
+
+// Also record frames whose size differs from the last recorded frame by at
+// least this percentage (zero disables). JPEG size follows image content
+// closely, so this is a cheap way to catch scene changes without decoding.
+#define CHANGE_PERCENT_OPTION "record_change_percent"
+#define CHANGE_PERCENT_DEFAULT 0
+
+// Start a new segment once the current one grows past this size.
+#define SEGMENT_MB_OPTION "record_segment_mb"
+#define SEGMENT_MB_DEFAULT 256
+
+// Number of frames that can wait for the recording thread.
+#define QUEUE_SIZE 16
+
+// A queued frame.
+typedef struct {
+  uint8_t* buffer;
+  size_t size;
+  int64_t timestamp_us;
+} slot_t;
+
+// The internal representation of the opaque pointer.
+typedef struct {
+  char* directory;
+  long every;
+  long change_percent;
+  size_t segment_size_max;
+
+  // Selection state, only accessed by the submitting thread. The selection
+  // options are looked up again when the configuration generation changes.
+  size_t frame_i;
+  size_t last_recorded_size;
+  unsigned config_generation;
+
+  // Single producer, single consumer queue where slots[i % QUEUE_SIZE] for i
+  // in [head, tail) are owned by the recording thread. The submitting thread
+  // fills slots[tail % QUEUE_SIZE] before publishing it by bumping tail.
+  slot_t slots[QUEUE_SIZE];
+  size_t buffer_size;
+  size_t head;
+  size_t tail;
+  size_t dropped;
+
+  // Current segment files and the size of the data file.
+  int data_fd;
+  int index_fd;
+  size_t segment_size;
+
+  pthread_t recorder_thread;
+  bool run_recorder;
+  pthread_cond_t queue_cond;
+  pthread_mutex_t queue_mutex;
+} ctx_internal_t;
+
+int recorder_alloc_ctx(recorder_ctx_t* ctx) {
+  ctx_internal_t* ctx_internal = malloc(sizeof(ctx_internal_t));
+  if (ctx_internal == NULL) {
+    fprintf(stderr, "Error allocating context: %s\n", strerror(errno));
+    return -errno;
+  }
+
+  pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+  pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+  memset(ctx_internal, 0, sizeof(ctx_internal_t));
+  ctx_internal->data_fd = -1;
+  ctx_internal->index_fd = -1;
+  ctx_internal->queue_cond = queue_cond;
+  ctx_internal->queue_mutex = queue_mutex;
+  *ctx = (recorder_ctx_t) ctx_internal;
+  return 0;
+}
+
+int recorder_free_ctx(recorder_ctx_t ctx) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+  for (int i = 0; i < QUEUE_SIZE; i++) {
+    free(ctx_internal->slots[i].buffer);
+  }
+  free(ctx_internal->directory);
+  free(ctx_internal);
+  return 0;
+}
+
+static void close_segment(ctx_internal_t* ctx_internal) {
+  if (ctx_internal->data_fd >= 0) {
+    close(ctx_internal->data_fd);
+    ctx_internal->data_fd = -1;
+  }
+  if (ctx_internal->index_fd >= 0) {
+    close(ctx_internal->index_fd);
+    ctx_internal->index_fd = -1;
+  }
+}
+
+// Opens a new pair of segment files named after the first frame's timestamp.
+static int open_segment(ctx_internal_t* ctx_internal, int64_t timestamp_us) {
+  char path[PATH_MAX];
+  int flags = O_WRONLY | O_CREAT | O_APPEND;
+
+  close_segment(ctx_internal);
+
+  snprintf(path, sizeof(path), "%s/" RECORDER_SEGMENT_PREFIX "%020ld"
+           RECORDER_DATA_SUFFIX, ctx_internal->directory, timestamp_us);
+  ctx_internal->data_fd = open(path, flags, 0644);
+  if (ctx_internal->data_fd < 0) {
+    fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+    return -errno;
+  }
+
+  snprintf(path, sizeof(path), "%s/" RECORDER_SEGMENT_PREFIX "%020ld"
+           RECORDER_INDEX_SUFFIX, ctx_internal->directory, timestamp_us);
+  ctx_internal->index_fd = open(path, flags, 0644);
+  if (ctx_internal->index_fd < 0) {
+    fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+    close_segment(ctx_internal);
+    return -errno;
+  }
+
+  ctx_internal->segment_size = 0;
+  return 0;
+}
+
+// Appends the queued frames in [head, tail) with one writev per file, syncing
+// the frame data before the index entries that point at it.
+static int write_frames(ctx_internal_t* ctx_internal, size_t head,
+                        size_t tail) {
+  struct iovec iov[QUEUE_SIZE];
+  recorder_index_entry_t entries[QUEUE_SIZE];
+  int count = 0;
+  ssize_t expected = 0;
+
+  if (ctx_internal->data_fd < 0 ||
+      ctx_internal->segment_size >= ctx_internal->segment_size_max) {
+    int res = open_segment(ctx_internal,
+                           ctx_internal->slots[head % QUEUE_SIZE].timestamp_us);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  for (size_t i = head; i < tail; i++, count++) {
+    slot_t* slot = &ctx_internal->slots[i % QUEUE_SIZE];
+    iov[count].iov_base = slot->buffer;
+    iov[count].iov_len = slot->size;
+    entries[count].timestamp_us = slot->timestamp_us;
+    entries[count].offset = ctx_internal->segment_size + expected;
+    entries[count].size = slot->size;
+    expected += slot->size;
+  }
+
+  ssize_t res = writev(ctx_internal->data_fd, iov, count);
+  if (res != expected) {
+    fprintf(stderr, "Error writing recorded frames: %s\n",
+            res < 0 ? strerror(errno) : "short write");
+    close_segment(ctx_internal);  // Start over in a fresh segment.
+    return -EIO;
+  }
+  ctx_internal->segment_size += expected;
+  if (fdatasync(ctx_internal->data_fd) < 0) {
+    fprintf(stderr, "Error syncing recorded frames: %s\n", strerror(errno));
+    return -errno;
+  }
+
+  expected = count * sizeof(recorder_index_entry_t);
+  res = write(ctx_internal->index_fd, entries, expected);
+  if (res != expected) {
+    fprintf(stderr, "Error writing recording index: %s\n",
+            res < 0 ? strerror(errno) : "short write");
+    close_segment(ctx_internal);
+    return -EIO;
+  }
+  if (fdatasync(ctx_internal->index_fd) < 0) {
+    fprintf(stderr, "Error syncing recording index: %s\n", strerror(errno));
+    return -errno;
+  }
+  return 0;
+}
+
+static void* recorder_routine(void* ctx) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+  thread_setup("recorder");
+
+  pthread_mutex_lock(&ctx_internal->queue_mutex);
+  while (1) {
+    while (ctx_internal->run_recorder &&
+           ctx_internal->head == ctx_internal->tail) {
+      pthread_cond_wait(&ctx_internal->queue_cond,
+                        &ctx_internal->queue_mutex);
+    }
+    size_t head = ctx_internal->head;
+    size_t tail = ctx_internal->tail;
+    if (head == tail) {
+      break;  // Stopped with nothing left to write.
+    }
+    pthread_mutex_unlock(&ctx_internal->queue_mutex);
+
+    // Write everything queued so far in one batch, without holding the lock.
+    // A failed batch is lost, since the frames behind it need the slots.
+    if (write_frames(ctx_internal, head, tail) < 0) {
+      metrics_add("bambucam_recorder_write_errors_total", 1);
+      metrics_add("bambucam_recorder_frames_lost_total", tail - head);
+    }
+
+    pthread_mutex_lock(&ctx_internal->queue_mutex);
+    ctx_internal->head = tail;
+  }
+  pthread_mutex_unlock(&ctx_internal->queue_mutex);
+
+  close_segment(ctx_internal);
+  return NULL;
+}
+
+// Looks up the options selecting which frames to record, which may change when
+// the configuration is reloaded.
+static void load_selection_options(ctx_internal_t* ctx_internal) {
+  ctx_internal->config_generation = config_get_generation();
+  ctx_internal->every = config_get_int(EVERY_OPTION, EVERY_DEFAULT);
+  ctx_internal->change_percent = config_get_int(CHANGE_PERCENT_OPTION,
+                                                CHANGE_PERCENT_DEFAULT);
+}
+
+int recorder_start(recorder_ctx_t ctx, const char* directory,
+                   size_t buffer_size) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+
+  if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Error creating %s: %s\n", directory, strerror(errno));
+    return -errno;
+  }
+
+  ctx_internal->directory = strdup(directory);
+  if (ctx_internal->directory == NULL) {
+    fprintf(stderr, "Error allocating directory: %s\n", strerror(errno));
+    return -errno;
+  }
+
+  load_selection_options(ctx_internal);
+  ctx_internal->segment_size_max =
+      config_get_int(SEGMENT_MB_OPTION, SEGMENT_MB_DEFAULT) * 1024 * 1024;
+
+  ctx_internal->buffer_size = buffer_size;
+  for (int i = 0; i < QUEUE_SIZE; i++) {
+    ctx_internal->slots[i].buffer = malloc(buffer_size);
+    if (ctx_internal->slots[i].buffer == NULL) {
+      fprintf(stderr, "Error allocating recorder queue: %s\n", strerror(errno));
+      return -errno;
+    }
+  }
+
+  ctx_internal->run_recorder = true;
+  int res = pthread_create(&ctx_internal->recorder_thread, NULL,
+                           &recorder_routine, ctx_internal);
+  if (res != 0) {
+    fprintf(stderr, "Error creating recorder thread\n");
+    ctx_internal->run_recorder = false;
+    return -1;
+  }
+
+  fprintf(stderr, "Recording frames into: %s\n", directory);
+  return 0;
+}
+
+int recorder_stop(recorder_ctx_t ctx) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+  if (!ctx_internal->run_recorder) {
+    return 0;  // Never started.
+  }
+
+  pthread_mutex_lock(&ctx_internal->queue_mutex);
+  ctx_internal->run_recorder = false;
+  pthread_cond_signal(&ctx_internal->queue_cond);
+  pthread_mutex_unlock(&ctx_internal->queue_mutex);
+
+  int res = pthread_join(ctx_internal->recorder_thread, NULL);
+  if (res != 0) {
+    fprintf(stderr, "Error joining recorder thread\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Returns whether the given frame should be recorded based on the configured
+// selection rules.
+static bool is_selected(ctx_internal_t* ctx_internal, size_t size) {
+  if (ctx_internal->config_generation != config_get_generation()) {
+    load_selection_options(ctx_internal);
+  }
+
+  size_t frame_i = ctx_internal->frame_i++;
+  if (ctx_internal->every > 0 && frame_i % ctx_internal->every == 0) {
+    return true;
+  }
+
+  if (ctx_internal->change_percent > 0) {
+    size_t last_size = ctx_internal->last_recorded_size;
+    size_t difference = size > last_size ? size - last_size : last_size - size;
+    return difference * 100 >= last_size * ctx_internal->change_percent;
+  }
+  return false;
+}
+
+int recorder_submit(recorder_ctx_t ctx, const uint8_t* buffer, size_t size,
+                    int64_t timestamp_us, bool force) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+
+  if (!is_selected(ctx_internal, size) && !force) {
+    return 0;
+  }
+  if (size > ctx_internal->buffer_size) {
+    fprintf(stderr, "Recorded frame too large: %ld > %ld\n", size,
+            ctx_internal->buffer_size);
+    return -1;
+  }
+
+  pthread_mutex_lock(&ctx_internal->queue_mutex);
+  size_t tail = ctx_internal->tail;
+  bool is_full = tail - ctx_internal->head == QUEUE_SIZE;
+  if (is_full) {
+    ctx_internal->dropped++;
+  }
+  pthread_mutex_unlock(&ctx_internal->queue_mutex);
+  if (is_full) {
+    metrics_add("bambucam_recorder_frames_dropped_total", 1);
+#ifdef DEBUG
+    fprintf(stderr, "Recorder queue full, dropped %ld frames\n",
+            ctx_internal->dropped);
+#endif
+    return -EAGAIN;
+  }
+
+  slot_t* slot = &ctx_internal->slots[tail % QUEUE_SIZE];
+  memcpy(slot->buffer, buffer, size);
+  slot->size = size;
+  slot->timestamp_us = timestamp_us;
+  ctx_internal->last_recorded_size = size;
+
+  pthread_mutex_lock(&ctx_internal->queue_mutex);
+  ctx_internal->tail = tail + 1;
+  pthread_cond_signal(&ctx_internal->queue_cond);
+  pthread_mutex_unlock(&ctx_internal->queue_mutex);
+  return 0;
+}
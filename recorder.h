@@ -0,0 +1,51 @@
+// Timelapse recorder
+//
+// Persists a subset of the camera frames to disk for timelapses. Frames are
+// selected from the capture thread (every Nth frame, frames that differ enough
+// from the last recorded one, or explicitly forced ones) and copied into a
+// bounded queue. A background thread appends them to segment files, so the
+// capture thread never waits on disk. Frames are dropped if the queue is full.
+//
+// Each segment is a pair of append-only files in the recording directory:
+//
+//   segment-<start time>.mjpeg  Concatenated JPEG frames.
+//   segment-<start time>.idx    Array of recorder_index_entry_t, one per frame.
+//
+// Index entries are only written once their frame data is synced to disk, so
+// every entry of an index (which may be mmap-ed) points at complete data.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RECORDER_SEGMENT_PREFIX "segment-"
+#define RECORDER_DATA_SUFFIX ".mjpeg"
+#define RECORDER_INDEX_SUFFIX ".idx"
+
+// A frame's location in its segment's data file.
+typedef struct {
+  int64_t timestamp_us;  // Capture time in microseconds since the Unix epoch.
+  uint64_t offset;       // Position of the frame in the data file.
+  uint64_t size;         // Size of the frame in bytes.
+} recorder_index_entry_t;
+
+// Opaque pointer to the recorder state. The caller owns this object.
+typedef struct recorder_ctx* recorder_ctx_t;
+
+// Allocates the objects required to record frames. The caller is expected to
+// call recorder_free_ctx when done with it.
+int recorder_alloc_ctx(recorder_ctx_t* ctx);
+int recorder_free_ctx(recorder_ctx_t ctx);
+
+// Starts recording into the given directory on a separate thread. The caller
+// should provide the maximum possible size of a single frame in buffer_size.
+int recorder_start(recorder_ctx_t ctx, const char* directory,
+                   size_t buffer_size);
+
+// Writes any queued frames and stops the recording thread.
+int recorder_stop(recorder_ctx_t ctx);
+
+// Offers a frame to the recorder, which keeps it if selected (or if force is
+// set) and there is room in the queue. Never blocks on disk.
+int recorder_submit(recorder_ctx_t ctx, const uint8_t* buffer, size_t size,
+                    int64_t timestamp_us, bool force);
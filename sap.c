@@ -0,0 +1,260 @@
+#include "sap.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Group and port of announcements of global scope, which SAP listeners such as
+// VLC join by default.
+#define SAP_ADDRESS "224.2.127.254"
+#define SAP_PORT 9875
+
+// Seconds between announcements.
+#define SAP_INTERVAL_S 5
+
+// SAP header (RFC 2974 section 3): version 1 with an IPv4 origin, no
+// authentication data, and the T bit set when deleting the session.
+#define SAP_HEADER_SIZE 8
+#define SAP_VERSION_1 0x20
+#define SAP_FLAG_DELETE 0x04
+#define SAP_PAYLOAD_TYPE "application/sdp"
+
+// RTP payload type of MPEG-TS (RFC 3551).
+#define RTP_PAYLOAD_TYPE_MP2T 33
+
+#define PACKET_MAX_SIZE 1024
+
+// The internal representation of the opaque pointer.
+typedef struct {
+  int socket;
+  struct sockaddr_in destination;
+
+  // The announcement, sent as is every SAP_INTERVAL_S seconds.
+  uint8_t packet[PACKET_MAX_SIZE];
+  size_t packet_size;
+
+  pthread_t thread;
+  bool is_thread_started;
+  bool is_stopping;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} ctx_internal_t;
+
+int sap_alloc_ctx(sap_ctx_t* ctx) {
+  ctx_internal_t* ctx_internal = malloc(sizeof(ctx_internal_t));
+  if (ctx_internal == NULL) {
+    fprintf(stderr, "Error allocating context: %s\n", strerror(errno));
+    return -errno;
+  }
+
+  memset(ctx_internal, 0, sizeof(ctx_internal_t));
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+  ctx_internal->mutex = mutex;
+  ctx_internal->cond = cond;
+  ctx_internal->socket = -1;
+  *ctx = (sap_ctx_t) ctx_internal;
+  return 0;
+}
+
+int sap_free_ctx(sap_ctx_t ctx) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+  if (ctx_internal->socket >= 0) {
+    close(ctx_internal->socket);
+  }
+  free(ctx_internal);
+  return 0;
+}
+
+// Finds the address packets to the given group are sent from, which is the
+// interface address if set, or else the one the kernel routes them from.
+static int get_source_address(const struct sockaddr_in* group,
+                              const char* interface_address,
+                              struct in_addr* source) {
+  if (interface_address != NULL) {
+    if (inet_pton(AF_INET, interface_address, source) != 1) {
+      fprintf(stderr, "Expected an IPv4 interface address: %s\n",
+              interface_address);
+      return -EINVAL;
+    }
+    return 0;
+  }
+
+  // Connecting a UDP socket sends nothing, but picks the route.
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+    return -errno;
+  }
+  struct sockaddr_in local;
+  socklen_t local_size = sizeof(local);
+  int res = 0;
+  if (connect(fd, (const struct sockaddr*) group, sizeof(*group)) < 0 ||
+      getsockname(fd, (struct sockaddr*) &local, &local_size) < 0) {
+    fprintf(stderr, "Error finding route to multicast group: %s\n",
+            strerror(errno));
+    res = -errno;
+  } else {
+    *source = local.sin_addr;
+  }
+  close(fd);
+  return res;
+}
+
+// Formats the announcement of the session into the context's packet.
+static int format_packet(ctx_internal_t* ctx_internal, const char* name,
+                         const char* group, int port, int ttl,
+                         struct in_addr source) {
+  char source_string[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &source, source_string, sizeof(source_string));
+
+  // The session ID only has to be unique for the origin, and the message ID
+  // hash has to change whenever the description does (RFC 2974 section 5).
+  uint64_t session_id = (uint64_t) time(NULL);
+  uint16_t hash = (uint16_t) (session_id ^ port);
+
+  uint8_t* packet = ctx_internal->packet;
+  packet[0] = SAP_VERSION_1;
+  packet[1] = 0;  // No authentication data.
+  packet[2] = hash >> 8;
+  packet[3] = hash & 0xFF;
+  memcpy(packet + 4, &source.s_addr, 4);  // Already in network order.
+  size_t size = SAP_HEADER_SIZE;
+  memcpy(packet + size, SAP_PAYLOAD_TYPE, sizeof(SAP_PAYLOAD_TYPE));
+  size += sizeof(SAP_PAYLOAD_TYPE);
+
+  int res = snprintf((char*) packet + size, PACKET_MAX_SIZE - size,
+                     "v=0\r\n"
+                     "o=- %llu 1 IN IP4 %s\r\n"
+                     "s=%s\r\n"
+                     "c=IN IP4 %s/%d\r\n"
+                     "t=0 0\r\n"
+                     "m=video %d RTP/AVP %d\r\n"
+                     "a=rtpmap:%d MP2T/90000\r\n",
+                     (unsigned long long) session_id, source_string, name,
+                     group, ttl, port, RTP_PAYLOAD_TYPE_MP2T,
+                     RTP_PAYLOAD_TYPE_MP2T);
+  if (res < 0 || (size_t) res >= PACKET_MAX_SIZE - size) {
+    fprintf(stderr, "Session description too long\n");
+    return -EINVAL;
+  }
+  ctx_internal->packet_size = size + res;
+  return 0;
+}
+
+static void send_packet(ctx_internal_t* ctx_internal) {
+  if (sendto(ctx_internal->socket, ctx_internal->packet,
+             ctx_internal->packet_size, 0,
+             (const struct sockaddr*) &ctx_internal->destination,
+             sizeof(ctx_internal->destination)) < 0) {
+    fprintf(stderr, "Error sending SAP announcement: %s\n", strerror(errno));
+  }
+}
+
+static void* sap_routine(void* arg) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) arg;
+
+  pthread_mutex_lock(&ctx_internal->mutex);
+  while (!ctx_internal->is_stopping) {
+    send_packet(ctx_internal);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SAP_INTERVAL_S;
+    while (!ctx_internal->is_stopping &&
+           pthread_cond_timedwait(&ctx_internal->cond, &ctx_internal->mutex,
+                                  &deadline) != ETIMEDOUT) {
+    }
+  }
+  pthread_mutex_unlock(&ctx_internal->mutex);
+  return NULL;
+}
+
+int sap_start(sap_ctx_t ctx, const char* name, const char* group, int port,
+              int ttl, const char* interface_address) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+
+  struct sockaddr_in group_address = {
+    .sin_family = AF_INET,
+    .sin_port = htons(port),
+  };
+  if (inet_pton(AF_INET, group, &group_address.sin_addr) != 1 ||
+      !IN_MULTICAST(ntohl(group_address.sin_addr.s_addr))) {
+    fprintf(stderr, "Expected an IPv4 multicast group: %s\n", group);
+    return -EINVAL;
+  }
+  if (ttl < 1 || ttl > 255) {
+    fprintf(stderr, "Expected a multicast TTL from 1 to 255: %d\n", ttl);
+    return -EINVAL;
+  }
+
+  struct in_addr source;
+  int res = get_source_address(&group_address, interface_address, &source);
+  if (res < 0) {
+    return res;
+  }
+  res = format_packet(ctx_internal, name, group, port, ttl, source);
+  if (res < 0) {
+    return res;
+  }
+
+  // Announcements go out with the session's TTL, so that they reach exactly
+  // the receivers the session does (RFC 2974 section 3).
+  ctx_internal->socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (ctx_internal->socket < 0) {
+    fprintf(stderr, "Error creating SAP socket: %s\n", strerror(errno));
+    return -errno;
+  }
+  unsigned char multicast_ttl = ttl;
+  if (setsockopt(ctx_internal->socket, IPPROTO_IP, IP_MULTICAST_TTL,
+                 &multicast_ttl, sizeof(multicast_ttl)) < 0 ||
+      setsockopt(ctx_internal->socket, IPPROTO_IP, IP_MULTICAST_IF,
+                 &source, sizeof(source)) < 0) {
+    fprintf(stderr, "Error setting up SAP socket: %s\n", strerror(errno));
+    return -errno;
+  }
+  ctx_internal->destination.sin_family = AF_INET;
+  ctx_internal->destination.sin_port = htons(SAP_PORT);
+  inet_pton(AF_INET, SAP_ADDRESS, &ctx_internal->destination.sin_addr);
+
+  res = pthread_create(&ctx_internal->thread, NULL, &sap_routine,
+                       ctx_internal);
+  if (res != 0) {
+    fprintf(stderr, "Error creating SAP thread\n");
+    return -1;
+  }
+  ctx_internal->is_thread_started = true;
+  return 0;
+}
+
+int sap_stop(sap_ctx_t ctx) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+  if (!ctx_internal->is_thread_started) {
+    return 0;  // Never started.
+  }
+
+  pthread_mutex_lock(&ctx_internal->mutex);
+  ctx_internal->is_stopping = true;
+  pthread_cond_signal(&ctx_internal->cond);
+  pthread_mutex_unlock(&ctx_internal->mutex);
+  int res = pthread_join(ctx_internal->thread, NULL);
+  ctx_internal->is_thread_started = false;
+  if (res != 0) {
+    fprintf(stderr, "Error joining SAP thread\n");
+    return -1;
+  }
+
+  // Receivers drop the session right away instead of timing it out.
+  ctx_internal->packet[0] |= SAP_FLAG_DELETE;
+  send_packet(ctx_internal);
+  return 0;
+}
@@ -0,0 +1,28 @@
+// SAP announcer
+//
+// Announces a multicast RTP session carrying an MPEG-TS stream with the
+// Session Announcement Protocol (RFC 2974), so that receivers such as VLC list
+// it under their SAP/network streams without being handed an SDP file or URL.
+// The session description is sent to the well-known SAP group every few
+// seconds with the session's TTL, and withdrawn with a deletion packet when
+// announcing stops.
+//
+// Only IPv4 sessions are supported.
+
+// Opaque pointer to the announcer state. The caller owns this object.
+typedef struct sap_ctx* sap_ctx_t;
+
+// Allocates the objects required to announce a session. The caller is expected
+// to call sap_free_ctx when done with it.
+int sap_alloc_ctx(sap_ctx_t* ctx);
+int sap_free_ctx(sap_ctx_t ctx);
+
+// Starts announcing the session with the given name sent to group:port (e.g.,
+// "239.255.0.1" and 5004) with the given TTL, from the interface with the
+// given address, or the one routing to the group if NULL. Returns a negative
+// value on error.
+int sap_start(sap_ctx_t ctx, const char* name, const char* group, int port,
+              int ttl, const char* interface_address);
+
+// Stops announcing and sends the deletion packet.
+int sap_stop(sap_ctx_t ctx);
@@ -20,8 +20,10 @@ typedef struct {
   // argument in all callbacks.
   void* callback_ctx;
 
-  // Called whenever a client connects or disconnects from the server. The
-  // number of active connections is passed as an argument.
+  // Called when a client connects or disconnects from the server. The number
+  // of active connections is passed as an argument. Servers may skip calls
+  // that don't change whether there are any clients at all, e.g., going from
+  // two clients to three, so that busy servers don't call it all the time.
   void (*on_client_change)(void* callback_ctx, size_t client_count);
 } server_callbacks_t;
 
@@ -38,5 +40,7 @@ int server_start(server_ctx_t ctx,
                  int width, int height, int fps, size_t buffer_size);
 int server_stop(server_ctx_t ctx);
 
-// Sends the provided image to all active clients.
-int server_send_image(server_ctx_t ctx, uint8_t* buffer, size_t size);
+// Sends the provided image to all active clients. The timestamp_us argument is
+// the frame's capture time in microseconds since the Unix epoch.
+int server_send_image(server_ctx_t ctx, uint8_t* buffer, size_t size,
+                      int64_t timestamp_us);
@@ -1,8 +1,17 @@
 // RTP server implementation using FFmpeg to transcode JPEG frames into an MPEG
 // video and stream it using the Pro-MPEG Code of Practice #3 Release 2 FEC
-// protocol.
+// protocol, FFmpeg's "prompeg", which sends row and column parity packets on
+// the two ports above the stream's.
 
 #include "server.h"
+#include "server_ffmpeg_rtp.h"
+#include "config.h"
+#include "frame_queue.h"
+#include "metrics.h"
+#include "sap.h"
+#include "thread_setup.h"
+#include "timestamp.h"
+#include "trace.h"
 
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
@@ -16,13 +25,63 @@
 #define URL_MAX_SIZE 2048
 #define URL_OUTPUT_FORMAT "rtp://localhost:%d"
 
+// Multicast output, sending every packet once to a group any number of
+// receivers join, instead of to localhost. The interface is given by its IPv4
+// address, and the session is announced over SAP unless disabled (see sap.h).
+#define MULTICAST_GROUP_OPTION "rtp_multicast_group"
+#define MULTICAST_TTL_OPTION "rtp_multicast_ttl"
+#define MULTICAST_TTL_DEFAULT 1
+#define MULTICAST_INTERFACE_OPTION "rtp_multicast_interface"
+#define URL_MULTICAST_FORMAT "rtp://%s:%d?ttl=%ld"
+#define URL_INTERFACE_FORMAT "&localaddr=%s"
+#define SAP_OPTION "rtp_sap"
+#define SAP_DEFAULT true
+#define SESSION_NAME_OPTION "rtp_session_name"
+#define SESSION_NAME_DEFAULT "Bambu Cam"
+
+// Pro-MPEG FEC over a matrix of L columns by D rows of RTP packets, within the
+// limits of FFmpeg's prompeg protocol, costing (L + D) / (L * D) in bandwidth.
+// A row packet protects each L consecutive packets, and L column packets each
+// protect D packets L apart, recovering bursts of up to L lost packets.
+#define FEC_OPTION "rtp_fec"
+#define FEC_DEFAULT true
+#define FEC_COLUMNS_OPTION "rtp_fec_columns"
+#define FEC_COLUMNS_DEFAULT 8
+#define FEC_ROWS_OPTION "rtp_fec_rows"
+#define FEC_ROWS_DEFAULT 4
+#define FEC_SIZE_MIN 4
+#define FEC_SIZE_MAX 20
+#define FEC_MATRIX_MAX 100
+#define FEC_FORMAT "prompeg=l=%ld:d=%ld"
+#define FEC_TTL_FORMAT ":ttl=%ld"
+#define FEC_MAX_SIZE 64
+
+// Sizes used to count the RTP packets carrying the MPEG-TS stream, which fill
+// every packet with as many TS packets as fit (as the prompeg protocol needs).
+#define RTP_HEADER_SIZE 12
+#define TS_PACKET_SIZE 188
+
+// Time base of the frame timestamps passed to server_send_image.
+#define TIMESTAMP_TIME_BASE ((AVRational) { 1, 1000000 })
+
+// Number of frames that can wait for the encoder, and which to drop when the
+// encoder falls behind (see frame_queue.h).
+#define QUEUE_SIZE_OPTION "rtp_queue_size"
+#define QUEUE_SIZE_DEFAULT 2
+#define DROP_POLICY_OPTION "rtp_drop_policy"
+#define DROP_POLICY_DEFAULT "drop-oldest"
+
+// Alignment of the planes and rows of decoded frames, which covers the SIMD
+// alignment every FFmpeg build expects.
+#define FRAME_POOL_ALIGN 64
+
 // The internal FFmpeg objects that make up the RTP server context.
 typedef struct {
   server_callbacks_t* callbacks;
 
-  // Input objects used to parse image data, decode it, and prepare it for
-  // encoding into an RTP video stream.
-  AVCodecParserContext* parser_ctx;
+  // Input objects used to decode image data and prepare it for encoding into
+  // an RTP video stream. Frames arrive as whole JPEGs, already validated by
+  // the capture thread, so they go to the decoder without a parser.
   AVCodecContext* decoder_ctx;
   const AVCodec* decoder_codec;
 
@@ -34,21 +93,49 @@ typedef struct {
   AVFormatContext* output_format_ctx;
   AVStream* output_stream;
 
-  // Intermediary objects used in decoding and encoding.
+  // Announces the multicast session, if any.
+  sap_ctx_t sap;
+
+  // FEC matrix size, or zero without FEC, and the size of a full RTP packet
+  // along with how many were estimated sent in metrics so far.
+  long fec_columns;
+  long fec_rows;
+  int64_t packet_size;
+  int64_t reported_packets;
+
+  // Intermediary objects used in decoding and encoding, where image_buffer
+  // holds the frame being encoded, swapped out of the queue.
   AVPacket* packet;
   AVFrame* frame;
   uint8_t* image_buffer;
   size_t image_buffer_size;
-  size_t frame_size;
-  pthread_mutex_t image_buffer_mutex;
 
-  // Thread state and mutex locks, where the thread will suspend until the
-  // external thread populated the above image buffer and signals the thread in
-  // server_send_image.
+  // Buffers of decoded frames and of the packets sent to the decoder, recycled
+  // from frame to frame instead of being allocated for each. Sized from the
+  // stream dimensions and the frame buffer size at server_start, where
+  // anything larger falls back to FFmpeg's own allocation. Encoded packets
+  // keep FFmpeg's allocation, since the MPEG-2 encoder lacks
+  // AV_CODEC_CAP_DR1 and so never calls get_encode_buffer.
+  AVBufferPool* frame_pool;
+  size_t frame_pool_size;
+  AVBufferPool* packet_pool;
+  size_t packet_pool_size;
+
+  // Frames waiting for the server thread, pushed by server_send_image. Closed
+  // by server_stop to stop the server thread. Set by server_start under
+  // queue_mutex, since frames may already arrive before then, e.g., while
+  // recording.
+  frame_queue_t queue;
+  pthread_mutex_t queue_mutex;
+  uint64_t reported_dropped;
+
+  // Capture time of the first encoded frame and the last presentation
+  // timestamp, used to derive monotonic PTS values from frame timestamps.
+  int64_t first_timestamp_us;
+  int64_t last_pts;
+
   pthread_t server_thread;
-  bool run_server;
-  pthread_cond_t run_server_cond;
-  pthread_mutex_t run_server_mutex;
+  bool is_server_thread_started;
 } ctx_internal_t;
 
 int server_alloc_ctx(server_ctx_t* ctx) {
@@ -58,27 +145,30 @@ int server_alloc_ctx(server_ctx_t* ctx) {
     return -errno;
   }
 
-  pthread_mutex_t image_buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
-  pthread_mutex_t run_server_mutex = PTHREAD_MUTEX_INITIALIZER;
   memset(ctx_internal, 0, sizeof(ctx_internal_t));
-  ctx_internal->image_buffer_mutex = image_buffer_mutex;
-  ctx_internal->run_server_mutex = run_server_mutex;
+  pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+  ctx_internal->queue_mutex = queue_mutex;
   *ctx = (server_ctx_t) ctx_internal;
   return 0;
 }
 
+void server_rtp_set_output(server_ctx_t ctx, AVIOContext* output_ctx) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+  ctx_internal->output_ctx = output_ctx;
+}
+
 int server_free_ctx(server_ctx_t ctx) {
   ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
 
+  if (ctx_internal->sap) {
+    sap_free_ctx(ctx_internal->sap);
+  }
   if (ctx_internal->output_ctx) {
     avio_closep(&ctx_internal->output_ctx);
   }
   if (ctx_internal->output_format_ctx) {
     avformat_free_context(ctx_internal->output_format_ctx);
   }
-  if (ctx_internal->parser_ctx) {
-    av_parser_close(ctx_internal->parser_ctx);
-  }
   if (ctx_internal->encoder_ctx) {
     avcodec_free_context(&ctx_internal->encoder_ctx);
   }
@@ -94,34 +184,83 @@ int server_free_ctx(server_ctx_t ctx) {
   if (ctx_internal->image_buffer) {
     free(ctx_internal->image_buffer);
   }
+  if (ctx_internal->queue) {
+    frame_queue_free(ctx_internal->queue);
+  }
+  av_buffer_pool_uninit(&ctx_internal->frame_pool);
+  av_buffer_pool_uninit(&ctx_internal->packet_pool);
 
   free(ctx_internal);
   return 0;
 }
 
-// Decodes the image located in the context's image_buffer field. Uses the
-// packet field as an intermediary object and fills the frame field with the
-// result (a decoded image frame).
-static int create_video_frame(ctx_internal_t* ctx_internal, uint8_t* buffer,
-                              size_t size) {
-  int res;
-  do {
-    res = av_parser_parse2(ctx_internal->parser_ctx,
-                           ctx_internal->decoder_ctx,
-                           &ctx_internal->packet->data,
-                           &ctx_internal->packet->size,
-                           buffer, size,
-                           AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+// Allocates the planes of a frame the decoder is about to decode into from the
+// frame pool (see AVCodecContext.get_buffer2).
+static int get_frame_buffer(AVCodecContext* codec_ctx, AVFrame* frame,
+                            int flags) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) codec_ctx->opaque;
+  int width = frame->width;
+  int height = frame->height;
+  int linesize_align[AV_NUM_DATA_POINTERS];
+  avcodec_align_dimensions2(codec_ctx, &width, &height, linesize_align);
+  int size = av_image_get_buffer_size(frame->format, width, height,
+                                      FRAME_POOL_ALIGN);
+  if (!(codec_ctx->codec->capabilities & AV_CODEC_CAP_DR1) || size < 0 ||
+      (size_t) size > ctx_internal->frame_pool_size) {
+    return avcodec_default_get_buffer2(codec_ctx, frame, flags);
+  }
+
+  frame->buf[0] = av_buffer_pool_get(ctx_internal->frame_pool);
+  if (frame->buf[0] == NULL) {
+    return AVERROR(ENOMEM);
+  }
+  int res = av_image_fill_arrays(frame->data, frame->linesize,
+                                 frame->buf[0]->data, frame->format,
+                                 width, height, FRAME_POOL_ALIGN);
+  if (res < 0) {
+    av_buffer_unref(&frame->buf[0]);
+    return res;
+  }
+  frame->extended_data = frame->data;
+  return 0;
+}
+
+// Points the given packet at a copy of the given image in a buffer from the
+// packet pool, padded as the decoder expects, so that the decoder takes a
+// reference to it rather than allocating a copy of its own.
+static int fill_packet(ctx_internal_t* ctx_internal, AVPacket* packet,
+                       const uint8_t* buffer, size_t size) {
+  if (size + AV_INPUT_BUFFER_PADDING_SIZE > ctx_internal->packet_pool_size) {
+    int res = av_new_packet(packet, size);
     if (res < 0) {
-      fprintf(stderr, "Error creating image packet: %s\n", av_err2str(res));
       return res;
     }
-    buffer += res;
-    size -= res;
-  } while (ctx_internal->packet->size == 0);  // Loop until the packet is ready.
+  } else {
+    packet->buf = av_buffer_pool_get(ctx_internal->packet_pool);
+    if (packet->buf == NULL) {
+      return AVERROR(ENOMEM);
+    }
+    packet->data = packet->buf->data;
+    packet->size = size;
+    memset(packet->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+  }
+  memcpy(packet->data, buffer, size);
+  return 0;
+}
+
+// Decodes the given image, a whole JPEG, into the frame field, using the
+// packet field as an intermediary object.
+static int create_video_frame(ctx_internal_t* ctx_internal, uint8_t* buffer,
+                              size_t size) {
+  int res = fill_packet(ctx_internal, ctx_internal->packet, buffer, size);
+  if (res < 0) {
+    fprintf(stderr, "Error allocating image packet: %s\n", av_err2str(res));
+    return res;
+  }
 
   res = avcodec_send_packet(ctx_internal->decoder_ctx,
                             ctx_internal->packet);
+  av_packet_unref(ctx_internal->packet);
   if (res < 0) {
     fprintf(stderr, "Error sending image packet: %s\n", av_err2str(res));
     return res;
@@ -133,11 +272,38 @@ static int create_video_frame(ctx_internal_t* ctx_internal, uint8_t* buffer,
     fprintf(stderr, "Error receiving decoded image frame: %s\n", av_err2str(res));
     return res;
   }
-
-  av_packet_unref(ctx_internal->packet);
   return 0;
 }
 
+// Estimates the RTP packets sent since the last call, and the FEC packets sent
+// along with them, from the bytes written to the output. The RTP muxer doesn't
+// report the packets it sends, so this assumes every packet is full, which
+// undercounts packets cut short at the end of a frame, and that the FEC
+// matrix fills up in order, which FFmpeg's prompeg protocol doesn't expose.
+static void update_packet_metrics(ctx_internal_t* ctx_internal) {
+  if (ctx_internal->packet_size <= 0) {
+    return;
+  }
+  int64_t packets = avio_tell(ctx_internal->output_ctx) /
+                    ctx_internal->packet_size;
+  int64_t reported = ctx_internal->reported_packets;
+  if (packets <= reported) {
+    return;
+  }
+  metrics_add("bambucam_rtp_packets_estimated_total", packets - reported);
+  ctx_internal->reported_packets = packets;
+
+  long columns = ctx_internal->fec_columns;
+  long matrix = columns * ctx_internal->fec_rows;
+  if (matrix == 0) {
+    return;
+  }
+  metrics_add("bambucam_rtp_fec_packets_estimated_total{kind=\"row\"}",
+              packets / columns - reported / columns);
+  metrics_add("bambucam_rtp_fec_packets_estimated_total{kind=\"column\"}",
+              (packets / matrix - reported / matrix) * columns);
+}
+
 // Encodes and sends the video frame located in the context's frame field. Uses
 // the packet field as an intermediary object.
 //
@@ -177,13 +343,35 @@ static int send_video_frame(ctx_internal_t* ctx_internal, int is_flush) {
       return res;
     }
     av_packet_unref(ctx_internal->packet);
+    update_packet_metrics(ctx_internal);
   } while (1);  // Loop until there's no more encoded packets to send.
 }
 
+// Derives the presentation timestamp (in the encoder time base) of the frame
+// captured at the given time, relative to the first encoded frame. Frames that
+// round onto an already used PTS are nudged forward to keep PTS increasing.
+static int64_t get_frame_pts(ctx_internal_t* ctx_internal, int frame_i,
+                             int64_t timestamp_us) {
+  if (frame_i == 0) {
+    ctx_internal->first_timestamp_us = timestamp_us;
+    ctx_internal->last_pts = 0;
+    return 0;
+  }
+
+  int64_t pts = av_rescale_q(timestamp_us - ctx_internal->first_timestamp_us,
+                             TIMESTAMP_TIME_BASE,
+                             ctx_internal->encoder_ctx->time_base);
+  if (pts <= ctx_internal->last_pts) {
+    pts = ctx_internal->last_pts + 1;
+  }
+  ctx_internal->last_pts = pts;
+  return pts;
+}
 
 static void* server_routine(void* ctx) {
   ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
   server_callbacks_t* callbacks = ctx_internal->callbacks;
+  thread_setup("encoder");
 
   int res = avformat_write_header(ctx_internal->output_format_ctx, NULL);
   if (res < 0) {
@@ -191,39 +379,47 @@ static void* server_routine(void* ctx) {
     return NULL;
   }
 
-  // Loop forever or until error.
+  // Loop until stopped or error, counting encoded frames.
   for (int frame_i = 0; res >= 0; frame_i++) {
-    pthread_mutex_lock(&ctx_internal->run_server_mutex);
-    while (!ctx_internal->run_server) {
-      pthread_cond_wait(&ctx_internal->run_server_cond,
-                        &ctx_internal->run_server_mutex);
+    size_t frame_size;
+    int64_t timestamp_us;
+    if (frame_queue_pop(ctx_internal->queue, &ctx_internal->image_buffer,
+                        &frame_size, &timestamp_us) < 0) {
+      break;  // Stopped.
     }
-    pthread_mutex_unlock(&ctx_internal->run_server_mutex);
 
-    pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
+    int64_t trace_start_us = trace_begin();
     res = create_video_frame(ctx_internal, ctx_internal->image_buffer,
-                             ctx_internal->frame_size);
-    pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+                             frame_size);
     if (res < 0) {
-      fprintf(stderr, "Error decoding image frame %d\n", frame_i);
-      return NULL;
+      // Skip frames the decoder rejects instead of ending the stream, e.g.,
+      // corrupt image data behind an intact marker structure.
+      fprintf(stderr, "Skipping undecodable image frame %d\n", frame_i);
+      metrics_add("bambucam_rtp_undecodable_frames_total", 1);
+      frame_i--;
+      res = 0;
+      continue;
     }
+    trace_end("decode", trace_start_us, timestamp_us);
 
-    ctx_internal->frame->pts = frame_i;
+    ctx_internal->frame->pts = get_frame_pts(ctx_internal, frame_i,
+                                             timestamp_us);
+#ifdef DEBUG
+    fprintf(stderr, "Encoding frame %d (pts %ld, %ld us since capture)\n",
+            frame_i, ctx_internal->frame->pts,
+            timestamp_now_us() - timestamp_us);
+#endif
+    trace_start_us = trace_begin();
     res = send_video_frame(ctx_internal, 0 /* is_flush */);
     if (res < 0) {
       fprintf(stderr, "Error sending video frame %d\n", frame_i);
       return NULL;
     }
-
-    // Wait for the external thread to signal when to run again.
-    pthread_mutex_lock(&ctx_internal->run_server_mutex);
-    ctx_internal->run_server = false;
-    pthread_mutex_unlock(&ctx_internal->run_server_mutex);
+    trace_end("encode", trace_start_us, timestamp_us);
   }
 
-  // If the loop ends without error (unexpected), clean up the stream with a
-  // null frame and trailer section.
+  // Once stopped, drain the encoder with a null frame and end the stream with
+  // a trailer section, so that clients see a clean end of stream.
 
   res = send_video_frame(ctx_internal, 1 /* is_flush */);
   if (res < 0) {
@@ -240,16 +436,92 @@ static void* server_routine(void* ctx) {
   return NULL;
 }
 
+// Formats the URL of the RTP output on the given port, which is multicast if a
+// group is configured.
+static int format_output_url(char* url, int port) {
+  const char* group = config_get_string(MULTICAST_GROUP_OPTION, NULL);
+  if (group == NULL) {
+    return snprintf(url, URL_MAX_SIZE, URL_OUTPUT_FORMAT, port);
+  }
+
+  int res = snprintf(url, URL_MAX_SIZE, URL_MULTICAST_FORMAT, group, port,
+                     config_get_int(MULTICAST_TTL_OPTION,
+                                    MULTICAST_TTL_DEFAULT));
+  const char* interface_address =
+      config_get_string(MULTICAST_INTERFACE_OPTION, NULL);
+  if (res < 0 || res >= URL_MAX_SIZE || interface_address == NULL) {
+    return res;
+  }
+  int interface_res = snprintf(url + res, URL_MAX_SIZE - res,
+                               URL_INTERFACE_FORMAT, interface_address);
+  return interface_res < 0 ? interface_res : res + interface_res;
+}
+
+// Reads the FEC matrix size into the context and formats the options of
+// FFmpeg's FEC protocol, or leaves fec empty if FEC is disabled. Returns a
+// negative value if the matrix size is out of range.
+static int format_fec(ctx_internal_t* ctx_internal, char* fec) {
+  fec[0] = '\0';
+  if (!config_get_bool(FEC_OPTION, FEC_DEFAULT)) {
+    return 0;
+  }
+
+  long columns = config_get_int(FEC_COLUMNS_OPTION, FEC_COLUMNS_DEFAULT);
+  long rows = config_get_int(FEC_ROWS_OPTION, FEC_ROWS_DEFAULT);
+  if (columns < FEC_SIZE_MIN || columns > FEC_SIZE_MAX ||
+      rows < FEC_SIZE_MIN || rows > FEC_SIZE_MAX ||
+      columns * rows > FEC_MATRIX_MAX) {
+    fprintf(stderr, "Expected FEC columns and rows from %d to %d, and at "
+            "most %d packets in all: %ld x %ld\n", FEC_SIZE_MIN, FEC_SIZE_MAX,
+            FEC_MATRIX_MAX, columns, rows);
+    return -EINVAL;
+  }
+  ctx_internal->fec_columns = columns;
+  ctx_internal->fec_rows = rows;
+
+  // FEC packets to a multicast group need the same TTL as the stream's.
+  int res = snprintf(fec, FEC_MAX_SIZE, FEC_FORMAT, columns, rows);
+  if (res >= 0 && res < FEC_MAX_SIZE &&
+      config_get_string(MULTICAST_GROUP_OPTION, NULL) != NULL) {
+    res = snprintf(fec + res, FEC_MAX_SIZE - res, FEC_TTL_FORMAT,
+                   config_get_int(MULTICAST_TTL_OPTION,
+                                  MULTICAST_TTL_DEFAULT));
+  }
+  metrics_set("bambucam_rtp_fec_overhead_ratio",
+              (double) (columns + rows) / (columns * rows));
+  return res < 0 ? res : 0;
+}
+
+// Starts announcing the multicast output on the given port over SAP, unless
+// the output isn't multicast or announcing is disabled.
+static int start_announcing(ctx_internal_t* ctx_internal, int port) {
+  const char* group = config_get_string(MULTICAST_GROUP_OPTION, NULL);
+  if (group == NULL || !config_get_bool(SAP_OPTION, SAP_DEFAULT)) {
+    return 0;
+  }
+
+  int res = sap_alloc_ctx(&ctx_internal->sap);
+  if (res < 0) {
+    return res;
+  }
+  return sap_start(ctx_internal->sap,
+                   config_get_string(SESSION_NAME_OPTION,
+                                     SESSION_NAME_DEFAULT),
+                   group, port,
+                   config_get_int(MULTICAST_TTL_OPTION, MULTICAST_TTL_DEFAULT),
+                   config_get_string(MULTICAST_INTERFACE_OPTION, NULL));
+}
 
 int server_start(server_ctx_t ctx,
                  int port, server_callbacks_t* callbacks,
                  int width, int height, int fps, size_t buffer_size) {
   ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
   char out_url[URL_MAX_SIZE];
+  char fec[FEC_MAX_SIZE];
   int res;
 
-  res = snprintf(out_url, URL_MAX_SIZE, URL_OUTPUT_FORMAT, port);
-  if (res < 0) {
+  res = format_output_url(out_url, port);
+  if (res < 0 || res >= URL_MAX_SIZE) {
     fprintf(stderr, "Error formatting output URL\n");
     return res;
   }
@@ -259,7 +531,25 @@ int server_start(server_ctx_t ctx,
 #endif
 
   ctx_internal->callbacks = callbacks;
-  ctx_internal->run_server = false;  // Wait for first image to start.
+
+  frame_queue_policy_t policy;
+  res = frame_queue_parse_policy(config_get_string(DROP_POLICY_OPTION,
+                                                   DROP_POLICY_DEFAULT),
+                                 &policy);
+  if (res < 0) {
+    return res;
+  }
+  frame_queue_t queue;
+  res = frame_queue_alloc(&queue,
+                          config_get_int(QUEUE_SIZE_OPTION, QUEUE_SIZE_DEFAULT),
+                          buffer_size, policy);
+  if (res < 0) {
+    fprintf(stderr, "Error allocating frame queue\n");
+    return res;
+  }
+  pthread_mutex_lock(&ctx_internal->queue_mutex);
+  ctx_internal->queue = queue;
+  pthread_mutex_unlock(&ctx_internal->queue_mutex);
 
   // TODO: Wait for a client connection before writing any data and support
   // more than one connection.
@@ -270,11 +560,34 @@ int server_start(server_ctx_t ctx,
   // Initialize the many many FFmpeg objects needed to produce a video stream.
   //
 
-  res = avio_open(&ctx_internal->output_ctx, out_url, AVIO_FLAG_WRITE);
-  if (res < 0) {
-    fprintf(stderr, "Error opening output context %s: %s\n",
-            out_url, av_err2str(res));
-    return res;
+  if (ctx_internal->output_ctx == NULL) {
+    res = format_fec(ctx_internal, fec);
+    if (res < 0) {
+      return res;
+    }
+    AVDictionary* options = NULL;
+    if (fec[0] != '\0') {
+      av_dict_set(&options, "fec", fec, 0);
+    }
+    res = avio_open2(&ctx_internal->output_ctx, out_url, AVIO_FLAG_WRITE, NULL,
+                     &options);
+    av_dict_free(&options);
+    if (res < 0) {
+      fprintf(stderr, "Error opening output context %s: %s\n",
+              out_url, av_err2str(res));
+      return res;
+    }
+    res = start_announcing(ctx_internal, port);
+    if (res < 0) {
+      fprintf(stderr, "Error announcing output %s\n", out_url);
+      return res;
+    }
+  }
+
+  if (ctx_internal->output_ctx->max_packet_size > RTP_HEADER_SIZE) {
+    ctx_internal->packet_size =
+        RTP_HEADER_SIZE + (ctx_internal->output_ctx->max_packet_size -
+                           RTP_HEADER_SIZE) / TS_PACKET_SIZE * TS_PACKET_SIZE;
   }
 
   ctx_internal->output_format_ctx = avformat_alloc_context();
@@ -330,12 +643,6 @@ int server_start(server_ctx_t ctx,
     return -1;
   }
 
-  ctx_internal->parser_ctx = av_parser_init(ctx_internal->decoder_codec->id);
-  if (!ctx_internal->parser_ctx) {
-    fprintf(stderr, "Error initializing decoder parser context\n");
-    return -1;
-  }
-
   //
   // Configure the video encoder and output stream.
   //
@@ -352,6 +659,34 @@ int server_start(server_ctx_t ctx,
     ctx_internal->encoder_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
   ctx_internal->output_stream->time_base = ctx_internal->encoder_ctx->time_base;
 
+  //
+  // Allocate the buffer pools, for decoded frames in any pixel format the
+  // MJPEG decoder produces (at most 4:4:4) and for packets up to the size of
+  // a frame buffer, and have the decoder allocate frames from them.
+  //
+
+  int pool_width = FFALIGN(width, FRAME_POOL_ALIGN);
+  int pool_height = FFALIGN(height, FRAME_POOL_ALIGN);
+  res = av_image_get_buffer_size(AV_PIX_FMT_YUVJ444P, pool_width, pool_height,
+                                 FRAME_POOL_ALIGN);
+  if (res < 0) {
+    fprintf(stderr, "Error sizing frame pool: %s\n", av_err2str(res));
+    return res;
+  }
+  ctx_internal->frame_pool_size = res;
+  ctx_internal->frame_pool = av_buffer_pool_init(ctx_internal->frame_pool_size,
+                                                 av_buffer_alloc);
+  ctx_internal->packet_pool_size = buffer_size + AV_INPUT_BUFFER_PADDING_SIZE;
+  ctx_internal->packet_pool = av_buffer_pool_init(
+      ctx_internal->packet_pool_size, av_buffer_alloc);
+  if (!ctx_internal->frame_pool || !ctx_internal->packet_pool) {
+    fprintf(stderr, "Error allocating buffer pools\n");
+    return AVERROR(ENOMEM);
+  }
+
+  ctx_internal->decoder_ctx->opaque = ctx_internal;
+  ctx_internal->decoder_ctx->get_buffer2 = get_frame_buffer;
+
   //
   // Open the encoders and allocate intermediary objects.
   //
@@ -392,10 +727,8 @@ int server_start(server_ctx_t ctx,
     return res;
   }
 
-  pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
   ctx_internal->image_buffer_size = buffer_size;
   ctx_internal->image_buffer = malloc(ctx_internal->image_buffer_size);
-  pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
   if (ctx_internal->image_buffer == NULL) {
     fprintf(stderr, "Error allocating image buffer: %s\n", strerror(errno));
     return -errno;
@@ -407,6 +740,7 @@ int server_start(server_ctx_t ctx,
     fprintf(stderr, "Error creating server thread\n");
     return -1;
   }
+  ctx_internal->is_server_thread_started = true;
 
   return 0;
 }
@@ -415,9 +749,15 @@ int server_stop(server_ctx_t ctx) {
   ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
   server_callbacks_t* callbacks = ctx_internal->callbacks;
 
+  if (ctx_internal->sap) {
+    sap_stop(ctx_internal->sap);
+  }
+  if (!ctx_internal->is_server_thread_started) {
+    return 0;  // Never started.
+  }
   ctx_internal->callbacks->on_client_change(callbacks->callback_ctx, 0);
+  frame_queue_close(ctx_internal->queue);
 
-  // TODO: This will hang forever. Make server thread cancellable.
   int res = pthread_join(ctx_internal->server_thread, NULL);
   if (res != 0) {
     fprintf(stderr, "Error joining server thread\n");
@@ -426,25 +766,26 @@ int server_stop(server_ctx_t ctx) {
   return 0;
 }
 
-int server_send_image(server_ctx_t ctx, uint8_t* buffer, size_t size) {
+int server_send_image(server_ctx_t ctx, uint8_t* buffer, size_t size,
+                      int64_t timestamp_us) {
   ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
-
-  pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
-  if (size > ctx_internal->image_buffer_size) {
-    fprintf(stderr, "Image buffer too large: %ld > %ld\n", size,
-            ctx_internal->image_buffer_size);
-    pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
-    return -1;
+  pthread_mutex_lock(&ctx_internal->queue_mutex);
+  frame_queue_t queue = ctx_internal->queue;
+  pthread_mutex_unlock(&ctx_internal->queue_mutex);
+  if (queue == NULL) {
+    return -1;  // Not started.
   }
-  memcpy(ctx_internal->image_buffer, buffer, size);
-  ctx_internal->frame_size = size;
-  pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
 
-  pthread_mutex_lock(&ctx_internal->run_server_mutex);
-  ctx_internal->run_server = true;
-  if (ctx_internal->run_server) {
-    pthread_cond_signal(&ctx_internal->run_server_cond);
+  int64_t trace_start_us = trace_begin();
+  int res = frame_queue_push(queue, buffer, size, timestamp_us);
+  trace_end("queue_push", trace_start_us, timestamp_us);
+
+  // Export frames dropped because the encoder fell behind.
+  uint64_t dropped = frame_queue_dropped(queue);
+  if (dropped != ctx_internal->reported_dropped) {
+    metrics_add("bambucam_rtp_frames_dropped_total",
+                dropped - ctx_internal->reported_dropped);
+    ctx_internal->reported_dropped = dropped;
   }
-  pthread_mutex_unlock(&ctx_internal->run_server_mutex);
-  return 0;
+  return res;
 }
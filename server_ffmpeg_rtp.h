@@ -0,0 +1,13 @@
+// RTP server extensions
+//
+// Functions specific to the RTP server implementation (see server.h for the
+// generic interface).
+
+#include <libavformat/avio.h>
+
+// Has the server write its RTP stream to the given output instead of opening
+// one for the port passed to server_start, e.g., to capture the stream in
+// memory. Must be called before server_start. The server takes ownership of
+// the output and closes it with avio_closep, so its opaque pointer must not
+// need freeing.
+void server_rtp_set_output(server_ctx_t ctx, AVIOContext* output_ctx);
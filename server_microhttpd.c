@@ -2,14 +2,30 @@
 // MJPEG data stream.
 
 #include "server.h"
+#include "config.h"
+#include "frame_ring.h"
+#include "jpeg_transform.h"
+#include "metrics.h"
+#include "thread_setup.h"
+#include "timestamp.h"
+#include "trace.h"
+#include "websocket.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <microhttpd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 
 // The string separating each frame in the multipart/x-mixed-replace response.
 #define BOUNDARY "boundary"
@@ -20,6 +36,120 @@
 // Maximum number of active connections supported
 #define MAX_NUM_CONNECTIONS 100
 
+// Query argument (e.g., "/?timestamps=1") that enables the X-Frame-Timestamp
+// part header, i.e., the frame's capture time in seconds since the Unix epoch.
+#define TIMESTAMPS_ARGUMENT "timestamps"
+
+// Query argument (e.g., "/?kbps=500") that limits the stream's bandwidth in
+// kilobits per second, assuming frames arrive at the stream's frame rate.
+// Frames that don't fit are sent at a lower quality instead.
+#define KBPS_ARGUMENT "kbps"
+
+// Factors the quantization tables of lower quality frames are scaled by, from
+// the first level below the original frame down to the lowest quality.
+#define REQUANT_SCALES { 2, 4, 8, 16 }
+#define NUM_REQUANT_LEVELS 4
+
+// Path prefix serving regions of interest cropped from every frame, e.g.,
+// "/roi/nozzle" for the region set with "-o roi_nozzle=640x360+320+180", i.e.,
+// its width, height and offset from the top left in pixels. Frames are cropped
+// without any loss, so regions grow to start on the frame's MCU boundaries.
+#define ROI_PATH "/roi/"
+#define ROI_OPTION_PREFIX "roi_"
+#define ROI_NAME_SIZE 64
+#define MAX_NUM_ROIS 8
+
+// Path serving recent frames from the replay ring buffer, e.g.,
+// "/replay?from=-30s" to stream frames starting 30 seconds ago at their
+// original pace, or "/replay?from=-30s&download=1" to download every frame
+// since then as a single Motion JPEG clip.
+#define REPLAY_PATH "/replay"
+#define REPLAY_FROM_ARGUMENT "from"
+#define REPLAY_DOWNLOAD_ARGUMENT "download"
+#define REPLAY_FROM_DEFAULT_US (-30 * TIMESTAMP_US_PER_SEC)
+
+// Path serving frames over a WebSocket, one JPEG per binary message. Each
+// message starts with a WEBSOCKET_METADATA_SIZE byte header of little endian
+// fields: the capture time (uint64, microseconds since the Unix epoch), the
+// frame sequence number (uint32) and the JPEG size (uint32).
+//
+// Frames are sent against credits: the client starts with one and grants more
+// by sending a text message with a number, e.g., "1" after rendering each
+// frame. Without credits, frames are skipped so that the next one sent is
+// always the latest.
+#define WEBSOCKET_PATH "/ws"
+#define WEBSOCKET_METADATA_SIZE 16
+#define WEBSOCKET_INITIAL_CREDITS 1
+#define WEBSOCKET_MAX_CREDITS 8
+
+// Size of the buffer for incoming WebSocket messages, which only ever need to
+// hold credit grants and control messages.
+#define WEBSOCKET_INPUT_SIZE 1024
+
+// How long a WebSocket thread waits for a new frame or client message before
+// checking the other one, in milliseconds.
+#define WEBSOCKET_POLL_MS 50
+
+// How long a WebSocket thread waits for a client to take more data before
+// closing the connection, so that a client that stopped reading can't block
+// it forever.
+#define WEBSOCKET_SEND_TIMEOUT_MS 5000
+
+// Path serving the current frame as a single JPEG, which caches, e.g., reverse
+// proxies, may keep for SNAPSHOT_MAX_AGE_OPTION seconds. Every request for the
+// same frame shares one response. Frames older than that, e.g., while the
+// camera is idle without viewers, are only served once the next frame arrives.
+#define SNAPSHOT_PATH "/snapshot.jpg"
+#define SNAPSHOT_MAX_AGE_OPTION "snapshot_max_age"
+#define SNAPSHOT_MAX_AGE_DEFAULT 1
+#define SNAPSHOT_ETAG_SIZE 32
+
+// Streams change with every frame, so caches must never keep them.
+#define STREAM_CACHE_CONTROL "no-store"
+
+// Whether to send streams to HTTP/1.1 clients with chunked transfer encoding,
+// which lets proxies keep their connections to the server alive, instead of
+// ending them by closing the connection like for HTTP/1.0.
+#define HTTP_CHUNKED_OPTION "http_chunked"
+
+// Socket options set on every accepted connection, where zero leaves the
+// system default. TCP_NOTSENT_LOWAT keeps the kernel from taking more of a
+// stream than it's about to send, so that frames don't queue up in send
+// buffers behind older ones for slow clients, which skip to the latest frame
+// instead. SO_SNDBUF caps the send buffer, which otherwise grows on demand.
+// TCP_NODELAY is also set by microhttpd itself while sending responses.
+#define TCP_NOTSENT_LOWAT_OPTION "tcp_notsent_lowat"
+#define TCP_NOTSENT_LOWAT_DEFAULT (16 * 1024)
+#define TCP_SNDBUF_OPTION "tcp_sndbuf"
+#define TCP_NODELAY_OPTION "tcp_nodelay"
+
+// Path serving metrics in the Prometheus text format (see metrics.h).
+#define METRICS_PATH "/metrics"
+
+// Initial size of the metrics response buffer, which grows as needed.
+#define METRICS_BUFFER_SIZE 4096
+
+// Path serving recorded trace spans as Chrome trace JSON (see trace.h).
+#define TRACE_PATH "/debug/trace"
+
+// How long server_stop waits for WebSocket threads to close their connections
+// before shutting down their sockets, in milliseconds.
+#define STOP_TIMEOUT_MS 2000
+
+// Status code sent to WebSocket clients when the server stops.
+#define WEBSOCKET_STATUS_GOING_AWAY 1001
+
+// Memory budget of the replay ring buffer, in megabytes. Zero disables replay.
+#define REPLAY_BUFFER_MB_OPTION "replay_buffer_mb"
+#define REPLAY_BUFFER_MB_DEFAULT 0
+
+// PEM files with the certificate chain and private key to serve HTTPS instead
+// of HTTP with, and optionally a GnuTLS priority string to restrict the
+// protocol versions and ciphers with.
+#define TLS_CERT_OPTION "tls_cert"
+#define TLS_KEY_OPTION "tls_key"
+#define TLS_PRIORITIES_OPTION "tls_priorities"
+
 // Special case for frame_start_pos in connection_ctx_t that represents
 // end-of-file.
 #define FRAME_END_POSITION -1
@@ -36,9 +166,29 @@ typedef struct {
   // server state, e.g., the frame buffer.
   server_ctx_t server_ctx;
 
+  // Whether the connection requested frames and counts as a client, unlike,
+  // e.g., metrics scrapes, which shouldn't wake up the camera.
+  bool is_client;
+
+  // Whether the connection is suspended until the next frame to serve it at
+  // SNAPSHOT_PATH.
+  bool is_snapshot;
+
   // Frame counter to know when serving the first frame and logging.
   ssize_t frame_i;
 
+  // Whether to send each frame's capture time in an X-Frame-Timestamp header.
+  bool send_timestamps;
+
+  // Size each frame should fit in, or zero to always send the original frame,
+  // and the region of interest to send instead of whole frames (if any).
+  size_t frame_budget;
+  struct roi* roi;
+
+  // Version of the current frame to send instead of the original frame in the
+  // image buffer, e.g., a lower quality one, or NULL to send the original.
+  struct derived_frame* derived_frame;
+
   // Current frame's starting position in the ever-growing multipart response,
   // because it might get chucked and we need to know how far into the image
   // buffer we need to seek.
@@ -46,14 +196,83 @@ typedef struct {
   // If set to FRAME_END_POSITION, then the current frame was completely sent
   // and the connection should suspend until the next frame is available.
   ssize_t frame_start_pos;  // TODO: Protect with a mutex.
+
+  // Copy of the frame being sent, taken when the frame it's from is replaced
+  // before the connection sent all of it, and whether a newer frame is waiting
+  // to be sent right after it. Slow connections thereby finish every frame
+  // they start, then skip to the latest one. Protected by image_buffer_mutex.
+  uint8_t* held_frame;
+  size_t held_frame_size;
+  bool is_frame_held;
+  bool has_next_frame;
+
+  // Start times of the trace spans from a new frame being available until
+  // microhttpd asks for it, and from then until the frame was sent.
+  int64_t resume_trace_us;
+  int64_t send_trace_us;
+
+  // Replay state, where frames come from the replay ring buffer instead of the
+  // image buffer. The replay_seq field is the ring sequence number of the
+  // current frame. Streamed replays send frames replay_delay_us after their
+  // capture time, while downloads send all frames up to replay_end_seq as fast
+  // as possible.
+  bool is_replay;
+  bool is_download;
+  uint64_t replay_seq;
+  uint64_t replay_end_seq;
+  int64_t replay_delay_us;
+
+  // Whether the connection was upgraded to a WebSocket, after which it is
+  // served by its own thread and no longer by microhttpd, and the socket of
+  // that thread while it runs, which server_stop shuts down if the thread
+  // takes too long to close it. Protected by image_buffer_mutex.
+  bool is_websocket;
+  bool has_websocket_socket;
+  MHD_socket websocket_socket;
 } connection_ctx_t;
 
+// State of a WebSocket connection's thread.
+typedef struct {
+  connection_ctx_t* connection_ctx;
+  MHD_socket socket;
+  struct MHD_UpgradeResponseHandle* handle;
+
+  // Unparsed client messages.
+  uint8_t input[WEBSOCKET_INPUT_SIZE];
+  size_t input_size;
+
+  // Copy of the frame being sent, so that sending doesn't hold the lock.
+  uint8_t* frame;
+  int credits;
+} websocket_ctx_t;
+
+// A version of the current frame derived from it, e.g., at a lower quality,
+// and the buffer the next frame's version is derived into before swapping.
+typedef struct derived_frame {
+  uint8_t* buffer;
+  uint8_t* next_buffer;
+  size_t size;  // Zero if deriving it failed.
+  uint64_t frame_seq;  // Frame it was derived from, zero if none yet.
+} derived_frame_t;
+
+// A region of interest and its crop of the current frame.
+typedef struct roi {
+  char name[ROI_NAME_SIZE];
+  int x;
+  int y;
+  int width;
+  int height;
+  derived_frame_t frame;
+} roi_t;
+
 // Internal bookkeeping state for the HTTP server.
 typedef struct {
   // Pointer to the server callbacks to use when creating an HTTP response.
   server_callbacks_t* callbacks;
 
-  // Image buffer and its max size (as allocated by this file).
+  // Image buffer and its max size (as allocated by this file). Set by
+  // server_start under image_buffer_mutex, along with replay_ring, since
+  // frames may already arrive before then, e.g., while recording.
   uint8_t* image_buffer;
   size_t image_buffer_size;
   pthread_mutex_t image_buffer_mutex;
@@ -61,14 +280,64 @@ typedef struct {
   // Current frame's size (always less than or equal to image_buffer_size).
   ssize_t frame_size;
 
-  // Number of active client connections and underlying state.
+  // Current frame's capture time in microseconds since the Unix epoch.
+  int64_t frame_timestamp_us;
+
+  // Current frame's sequence number and a condition signaled on every new
+  // frame, for WebSocket threads waiting on image_buffer_mutex. Also signaled
+  // when stopping and when a WebSocket thread exits, which server_stop waits
+  // for.
+  uint64_t frame_seq;
+  pthread_cond_t frame_cond;
+  bool is_stopping;
+  size_t num_websockets;
+
+  // Recent frames available for replay, or NULL if replay is disabled.
+  frame_ring_t replay_ring;
+
+  // Versions of the current frame derived for clients, i.e., lower quality
+  // versions for clients with a bandwidth limit and crops of regions of
+  // interest, each shared by every client asking for the same. Derived by
+  // server_send_image from every new frame, only as far as current clients
+  // need them, and published along with it. Protected by image_buffer_mutex,
+  // except for the next buffers, which only server_send_image uses.
+  int fps;
+  derived_frame_t requant_levels[NUM_REQUANT_LEVELS];
+  roi_t rois[MAX_NUM_ROIS];
+  size_t num_rois;
+
+  // Response serving the current frame at SNAPSHOT_PATH, created on the first
+  // request for the frame and shared by every request until the next one, the
+  // frame's sequence number and its entity tag. Only used by the microhttpd
+  // thread.
+  struct MHD_Response* snapshot_response;
+  uint64_t snapshot_seq;
+  char snapshot_etag[SNAPSHOT_ETAG_SIZE];
+  int snapshot_max_age;
+  bool is_chunked;
+
+  // Socket options for accepted connections, zero to leave them unchanged.
+  int tcp_notsent_lowat;
+  int tcp_sndbuf;
+  bool tcp_nodelay;
+
+  // Number of open connections, of which num_clients requested frames, and
+  // underlying state.
   // TODO: Put individual connections on the heap, not this static array.
   size_t num_connections;
+  size_t num_clients;
   connection_ctx_t connections[MAX_NUM_CONNECTIONS];
   size_t next_connection_id;
 
-  // The underlying microhttpd daemon.
+  // The underlying microhttpd daemon, whose polling thread is set up on its
+  // first callback since microhttpd creates it.
   struct MHD_Daemon* daemon;
+  bool is_thread_setup;
+
+  // Contents of the TLS certificate chain and private key, or NULL when
+  // serving plain HTTP.
+  char* tls_cert;
+  char* tls_key;
 } ctx_internal_t;
 
 int server_alloc_ctx(server_ctx_t* ctx) {
@@ -79,8 +348,10 @@ int server_alloc_ctx(server_ctx_t* ctx) {
   }
 
   pthread_mutex_t image_buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t frame_cond = PTHREAD_COND_INITIALIZER;
   memset(ctx_internal, 0, sizeof(ctx_internal_t));
   ctx_internal->image_buffer_mutex = image_buffer_mutex;
+  ctx_internal->frame_cond = frame_cond;
   *ctx = (server_ctx_t) ctx_internal;
   return 0;
 }
@@ -90,10 +361,330 @@ int server_free_ctx(server_ctx_t ctx) {
   if (ctx_internal->image_buffer) {
     free(ctx_internal->image_buffer);
   }
+  if (ctx_internal->replay_ring) {
+    frame_ring_free(ctx_internal->replay_ring);
+  }
+  if (ctx_internal->snapshot_response) {
+    MHD_destroy_response(ctx_internal->snapshot_response);
+  }
+  for (int i = 0; i < NUM_REQUANT_LEVELS; i++) {
+    free(ctx_internal->requant_levels[i].buffer);
+    free(ctx_internal->requant_levels[i].next_buffer);
+  }
+  for (size_t i = 0; i < ctx_internal->num_rois; i++) {
+    free(ctx_internal->rois[i].frame.buffer);
+    free(ctx_internal->rois[i].frame.next_buffer);
+  }
+  free(ctx_internal->tls_cert);
+  free(ctx_internal->tls_key);
   free(ctx_internal);
   return 0;
 }
 
+// Writes the headers preceding a frame in the multipart response. Returns the
+// number of bytes written or a negative value on error.
+static int write_part_headers(connection_ctx_t* connection_ctx,
+                              char* buf, size_t max,
+                              size_t frame_size, int64_t timestamp_us) {
+  int res = snprintf(buf, max,
+                     "%s"  // Special case for first frame.
+                     "Content-Type: image/jpeg\r\n"
+                     "Content-Length: %ld\r\n",
+                     connection_ctx->frame_i == 0 ? "--" BOUNDARY "\r\n" : "",
+                     frame_size);
+  if (res < 0) {
+    return res;
+  }
+
+  // Optional capture time header, then the blank line ending the headers.
+  int headers_res = connection_ctx->send_timestamps
+      ? snprintf(buf + res, max - res,
+                 "X-Frame-Timestamp: %ld.%06ld\r\n\r\n",
+                 timestamp_us / TIMESTAMP_US_PER_SEC,
+                 timestamp_us % TIMESTAMP_US_PER_SEC)
+      : snprintf(buf + res, max - res, "\r\n");
+  if (headers_res < 0) {
+    return headers_res;
+  }
+  return res + headers_res;
+}
+
+static int alloc_derived_frame(ctx_internal_t* ctx_internal,
+                               derived_frame_t* frame) {
+  for (int i = 0; i < 2; i++) {
+    uint8_t** buffer = i == 0 ? &frame->buffer : &frame->next_buffer;
+    if (*buffer == NULL) {
+      *buffer = malloc(ctx_internal->image_buffer_size);
+      if (*buffer == NULL) {
+        fprintf(stderr, "Error allocating derived frame: %s\n",
+                strerror(errno));
+        return -ENOMEM;
+      }
+    }
+  }
+  return 0;
+}
+
+// Returns whether the connection streams live frames, as opposed to, e.g.,
+// replays, snapshots and WebSockets.
+static bool is_live_stream(connection_ctx_t* connection_ctx) {
+  return connection_ctx->is_client && !connection_ctx->is_websocket &&
+         !connection_ctx->is_replay && !connection_ctx->is_snapshot;
+}
+
+// Copies the frame the connection is sending, before it's replaced, so that
+// the connection can finish sending it. Expects image_buffer_mutex to be held.
+static void hold_frame(ctx_internal_t* ctx_internal,
+                       connection_ctx_t* connection_ctx,
+                       const uint8_t* buffer, size_t size) {
+  if (connection_ctx->held_frame == NULL) {
+    connection_ctx->held_frame = malloc(ctx_internal->image_buffer_size);
+    if (connection_ctx->held_frame == NULL) {
+      fprintf(stderr, "Error allocating held frame: %s\n", strerror(errno));
+      return;
+    }
+  }
+  memcpy(connection_ctx->held_frame, buffer, size);
+  connection_ctx->held_frame_size = size;
+  connection_ctx->is_frame_held = true;
+  metrics_add("bambucam_http_held_frames_total", 1);
+}
+
+// Versions of a new frame that the live streams need, i.e., crops of their
+// regions of interest and requantized versions down to the smallest budget,
+// gathered under image_buffer_mutex so that deriving them doesn't need it, and
+// the sizes of the derived versions.
+typedef struct {
+  bool is_roi_used[MAX_NUM_ROIS];
+  roi_t rois[MAX_NUM_ROIS];  // Copies of the regions when gathered.
+  size_t roi_sizes[MAX_NUM_ROIS];
+  size_t min_budget;  // SIZE_MAX if no stream needs a lower quality.
+  size_t level_sizes[NUM_REQUANT_LEVELS];
+  int num_levels;
+} derivation_t;
+
+// Gathers which versions of a new frame of the given size the live streams
+// need. Expects image_buffer_mutex to be held.
+static void plan_derivation(ctx_internal_t* ctx_internal, size_t size,
+                            derivation_t* derivation) {
+  memset(derivation->is_roi_used, 0, sizeof(derivation->is_roi_used));
+  derivation->min_budget = SIZE_MAX;
+  derivation->num_levels = 0;
+  for (int i = 0; i < MAX_NUM_CONNECTIONS; i++) {
+    connection_ctx_t* connection_ctx = &ctx_internal->connections[i];
+    if (!is_live_stream(connection_ctx)) {
+      continue;
+    }
+    if (connection_ctx->roi) {
+      size_t roi_i = connection_ctx->roi - ctx_internal->rois;
+      derivation->is_roi_used[roi_i] = true;
+      derivation->rois[roi_i] = *connection_ctx->roi;
+    } else if (connection_ctx->frame_budget > 0 &&
+               connection_ctx->frame_budget < size) {
+      derivation->min_budget = MIN(derivation->min_budget,
+                                   connection_ctx->frame_budget);
+    }
+  }
+}
+
+// Derives a version of the given frame into the next buffer of the given
+// derived frame by scaling its quantization tables by scale, or by cropping it
+// to roi if given. Returns the size of the result, or zero on error.
+static size_t derive_frame(ctx_internal_t* ctx_internal, derived_frame_t* frame,
+                           const uint8_t* buffer, size_t size,
+                           int64_t timestamp_us, int scale, const roi_t* roi) {
+  if (alloc_derived_frame(ctx_internal, frame) < 0) {
+    return 0;
+  }
+
+  int64_t trace_start_us = trace_begin();
+  ssize_t res = roi
+      ? jpeg_crop(buffer, size, roi->x, roi->y, roi->width, roi->height,
+                  frame->next_buffer, ctx_internal->image_buffer_size)
+      : jpeg_requantize(buffer, size, scale, frame->next_buffer,
+                        ctx_internal->image_buffer_size);
+  trace_end(roi ? "crop" : "requantize", trace_start_us, timestamp_us);
+  metrics_add(roi ? "bambucam_http_cropped_frames_total"
+                  : "bambucam_http_requantized_frames_total", 1);
+  if (res < 0 && roi) {
+    fprintf(stderr, "Error cropping frame to %s, sending original\n",
+            roi->name);
+  } else if (res < 0) {
+    fprintf(stderr, "Error lowering frame quality, sending original\n");
+  }
+  return MAX(res, 0);
+}
+
+// Derives the planned versions of the given frame, each only once no matter
+// how many clients asked for it. Quality levels are derived from the highest
+// down, until one fits the smallest budget.
+static void derive_frames(ctx_internal_t* ctx_internal,
+                          derivation_t* derivation, const uint8_t* buffer,
+                          size_t size, int64_t timestamp_us) {
+  for (int i = 0; i < MAX_NUM_ROIS; i++) {
+    if (derivation->is_roi_used[i]) {
+      derivation->roi_sizes[i] = derive_frame(
+          ctx_internal, &ctx_internal->rois[i].frame, buffer, size,
+          timestamp_us, 0, &derivation->rois[i]);
+    }
+  }
+
+  static const int scales[NUM_REQUANT_LEVELS] = REQUANT_SCALES;
+  size_t level_size = size;
+  while (derivation->num_levels < NUM_REQUANT_LEVELS &&
+         level_size > derivation->min_budget) {
+    int i = derivation->num_levels++;
+    level_size = derive_frame(ctx_internal, &ctx_internal->requant_levels[i],
+                              buffer, size, timestamp_us, scales[i], NULL);
+    derivation->level_sizes[i] = level_size;
+    if (level_size == 0) {
+      break;
+    }
+  }
+}
+
+// Swaps the derived version of the current frame of the given size in for
+// the previous one. Expects image_buffer_mutex to be held, and connections
+// still sending the previous one to hold a copy of it.
+static void publish_derived_frame(ctx_internal_t* ctx_internal,
+                                  derived_frame_t* frame, size_t size) {
+  uint8_t* buffer = frame->buffer;
+  frame->buffer = frame->next_buffer;
+  frame->next_buffer = buffer;
+  frame->size = size;
+  frame->frame_seq = ctx_internal->frame_seq;
+}
+
+// Publishes the derived versions of the current frame, except crops of regions
+// that changed since, which connections wait for the next frame for. Expects
+// image_buffer_mutex to be held.
+static void publish_derived_frames(ctx_internal_t* ctx_internal,
+                                   const derivation_t* derivation) {
+  for (int i = 0; i < MAX_NUM_ROIS; i++) {
+    roi_t* roi = &ctx_internal->rois[i];
+    const roi_t* region = &derivation->rois[i];
+    if (derivation->is_roi_used[i] && roi->x == region->x &&
+        roi->y == region->y && roi->width == region->width &&
+        roi->height == region->height) {
+      publish_derived_frame(ctx_internal, &roi->frame,
+                            derivation->roi_sizes[i]);
+    }
+  }
+  for (int i = 0; i < derivation->num_levels; i++) {
+    publish_derived_frame(ctx_internal, &ctx_internal->requant_levels[i],
+                          derivation->level_sizes[i]);
+  }
+}
+
+// Picks the version of the current frame to send to the given connection,
+// i.e., the crop of its region of interest, or else the highest quality
+// version that fits its budget (or the lowest quality one if none does), and
+// passes it in derived_frame, NULL to send the original frame. Returns -EAGAIN
+// if the version wasn't derived from the current frame, e.g., for a new
+// connection, which gets it with the next frame. Expects image_buffer_mutex to
+// be held.
+static int select_derived_frame(connection_ctx_t* connection_ctx) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) connection_ctx->server_ctx;
+  connection_ctx->derived_frame = NULL;
+
+  roi_t* roi = connection_ctx->roi;
+  if (roi) {
+    if (roi->frame.frame_seq != ctx_internal->frame_seq) {
+      return -EAGAIN;
+    }
+    if (roi->frame.size > 0) {
+      connection_ctx->derived_frame = &roi->frame;
+    }
+    return 0;
+  }
+
+  size_t budget = connection_ctx->frame_budget;
+  if (budget == 0 || (size_t) ctx_internal->frame_size <= budget) {
+    return 0;
+  }
+  for (int i = 0; i < NUM_REQUANT_LEVELS; i++) {
+    derived_frame_t* level = &ctx_internal->requant_levels[i];
+    if (level->frame_seq != ctx_internal->frame_seq) {
+      return -EAGAIN;
+    }
+    if (level->size == 0) {
+      return 0;  // Failed, so send the original.
+    }
+    if (level->size <= budget || i == NUM_REQUANT_LEVELS - 1) {
+      connection_ctx->derived_frame = level;
+      return 0;
+    }
+  }
+  return 0;
+}
+
+// Returns the region of interest of the given name, as currently configured,
+// or NULL if there is none.
+static roi_t* find_roi(ctx_internal_t* ctx_internal, const char* name) {
+  char option[ROI_NAME_SIZE + sizeof(ROI_OPTION_PREFIX)];
+  if (strlen(name) >= ROI_NAME_SIZE) {
+    return NULL;
+  }
+  snprintf(option, sizeof(option), ROI_OPTION_PREFIX "%s", name);
+  const char* value = config_get_string(option, NULL);
+  roi_t region;
+  if (value == NULL || sscanf(value, "%dx%d+%d+%d", &region.width,
+                              &region.height, &region.x, &region.y) != 4) {
+    fprintf(stderr, "Expected a region of interest like "
+            ROI_OPTION_PREFIX "%s=<width>x<height>+<x>+<y>\n", name);
+    return NULL;
+  }
+
+  // Regions are shared with server_send_image, which crops frames to them.
+  pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
+  roi_t* roi = NULL;
+  for (size_t i = 0; i < ctx_internal->num_rois; i++) {
+    if (strcmp(ctx_internal->rois[i].name, name) == 0) {
+      roi = &ctx_internal->rois[i];
+    }
+  }
+  if (roi == NULL && ctx_internal->num_rois < MAX_NUM_ROIS) {
+    roi = &ctx_internal->rois[ctx_internal->num_rois++];
+    snprintf(roi->name, ROI_NAME_SIZE, "%s", name);
+  }
+
+  // Crop again if the region changed, e.g., after reloading the configuration.
+  if (roi && (roi->x != region.x || roi->y != region.y ||
+              roi->width != region.width || roi->height != region.height)) {
+    roi->x = region.x;
+    roi->y = region.y;
+    roi->width = region.width;
+    roi->height = region.height;
+    roi->frame.frame_seq = 0;
+  }
+  pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+  if (roi == NULL) {
+    fprintf(stderr, "Too many regions of interest\n");
+  }
+  return roi;
+}
+
+// Returns the size of the current frame as sent to the given connection.
+static size_t get_frame_size(connection_ctx_t* connection_ctx) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) connection_ctx->server_ctx;
+  if (connection_ctx->is_frame_held) {
+    return connection_ctx->held_frame_size;
+  }
+  return connection_ctx->derived_frame ? connection_ctx->derived_frame->size
+                                       : ctx_internal->frame_size;
+}
+
+// Returns the current frame as sent to the given connection. Expects
+// image_buffer_mutex to be held.
+static const uint8_t* get_frame_buffer(connection_ctx_t* connection_ctx) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) connection_ctx->server_ctx;
+  if (connection_ctx->is_frame_held) {
+    return connection_ctx->held_frame;
+  }
+  return connection_ctx->derived_frame ? connection_ctx->derived_frame->buffer
+                                       : ctx_internal->image_buffer;
+}
+
 static ssize_t response_callback(void* ctx, uint64_t pos,
                                  char* buf, size_t max) {
   connection_ctx_t* connection_ctx = (connection_ctx_t*) ctx;
@@ -104,8 +695,14 @@ static ssize_t response_callback(void* ctx, uint64_t pos,
     return MHD_CONTENT_READER_END_OF_STREAM;
   }
 
+  // Everything below happens under the lock, which keeps the capture thread
+  // from replacing the frame, e.g., between its headers and its data.
+  pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
   if (ctx_internal->frame_size == 0 ||
-      connection_ctx->frame_start_pos == FRAME_END_POSITION) {
+      connection_ctx->frame_start_pos == FRAME_END_POSITION ||
+      (connection_ctx->frame_start_pos == 0 &&
+       select_derived_frame(connection_ctx) < 0)) {
+    pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
 #ifdef DEBUG
     fprintf(stderr, "Received end of frame on connection %ld, suspending\n",
             connection_ctx->id);
@@ -119,42 +716,484 @@ static ssize_t response_callback(void* ctx, uint64_t pos,
 #ifdef DEBUG
     fprintf(stderr, "Connection %ld Frame #%ld (%ld bytes)\n",
             connection_ctx->id, connection_ctx->frame_i,
-            ctx_internal->frame_size);
+            get_frame_size(connection_ctx));
 #endif
-
-    int res = snprintf(buf, max,
-                       "%s"  // Special case for first frame.
-                       "Content-Type: image/jpeg\r\n"
-                       "Content-Length: %ld\r\n\r\n",
-                       connection_ctx->frame_i == 0 ? "--" BOUNDARY "\r\n" : "",
-                       ctx_internal->frame_size);
+    int res = write_part_headers(connection_ctx, buf, max,
+                                 get_frame_size(connection_ctx),
+                                 ctx_internal->frame_timestamp_us);
+    if (res >= 0) {
+      connection_ctx->frame_start_pos = pos + res;
+    }
+    pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
     if (res < 0) {
       return MHD_CONTENT_READER_END_WITH_ERROR;
     }
-    connection_ctx->frame_start_pos = pos + res;
+    trace_end("mhd_resume", connection_ctx->resume_trace_us,
+              ctx_internal->frame_timestamp_us);
+    connection_ctx->send_trace_us = trace_begin();
     return res;
   }
 
-  // If we're at the end of a frame, update state and send footer.
+  // If we're at the end of a frame, update state and send footer, moving on
+  // to the next frame right away if one arrived while sending this one.
+  size_t frame_size = get_frame_size(connection_ctx);
   size_t frame_offset = pos - connection_ctx->frame_start_pos;
-  if (frame_offset >= ctx_internal->frame_size) {
+  if (frame_offset >= frame_size) {
+    connection_ctx->is_frame_held = false;
+    connection_ctx->frame_start_pos = connection_ctx->has_next_frame
+        ? 0 : FRAME_END_POSITION;
+    connection_ctx->has_next_frame = false;
+    pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+
     int res = snprintf(buf, max, "\r\n--%s\r\n", BOUNDARY);
     if (res < 0) {
       return MHD_CONTENT_READER_END_WITH_ERROR;
     }
-    connection_ctx->frame_start_pos = FRAME_END_POSITION;
     connection_ctx->frame_i++;
+    trace_end("send_frame", connection_ctx->send_trace_us,
+              ctx_internal->frame_timestamp_us);
+#ifdef DEBUG
+    fprintf(stderr, "Connection %ld sent frame %ld us after capture\n",
+            connection_ctx->id,
+            timestamp_now_us() - ctx_internal->frame_timestamp_us);
+#endif
     return res;
   }
 
   // Otherwise, attempt to send the entire image buffer data.
-  size_t size = MIN(ctx_internal->frame_size - frame_offset, max);
+  size_t size = MIN(frame_size - frame_offset, max);
+  memcpy(buf, get_frame_buffer(connection_ctx) + frame_offset, size);
+  pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+  return size;
+}
+
+static ssize_t replay_response_callback(void* ctx, uint64_t pos,
+                                        char* buf, size_t max) {
+  connection_ctx_t* connection_ctx = (connection_ctx_t*) ctx;
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) connection_ctx->server_ctx;
+  frame_ring_t ring = ctx_internal->replay_ring;
+  size_t frame_size;
+  int64_t timestamp_us;
+  ssize_t res;
+
+  if (connection_ctx->connection == NULL) {
+    fprintf(stderr, "Response callback called with dead connection, ending\n");
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+
+  while (1) {
+    // In between frames, wait until the next frame is due.
+    if (connection_ctx->frame_start_pos == FRAME_END_POSITION) {
+      if (connection_ctx->is_download &&
+          connection_ctx->replay_seq >= connection_ctx->replay_end_seq) {
+        return MHD_CONTENT_READER_END_OF_STREAM;
+      }
+
+      res = frame_ring_read(ring, connection_ctx->replay_seq, 0, NULL, 0,
+                            &frame_size, &timestamp_us);
+      if (res == -ENOENT) {
+        // Fell behind the ring buffer's eviction, so skip to the oldest frame.
+        connection_ctx->replay_seq = frame_ring_find(ring, INT64_MIN);
+        continue;
+      }
+      if (res == -EAGAIN ||
+          (!connection_ctx->is_download &&
+           timestamp_us + connection_ctx->replay_delay_us > timestamp_now_us())) {
+        // Resumed along with the live stream whenever a new frame arrives.
+        MHD_suspend_connection(connection_ctx->connection);
+        return 0;
+      }
+
+      connection_ctx->frame_start_pos = pos;
+      if (!connection_ctx->is_download) {
+        res = write_part_headers(connection_ctx, buf, max, frame_size,
+                                 timestamp_us);
+        if (res < 0) {
+          return MHD_CONTENT_READER_END_WITH_ERROR;
+        }
+        connection_ctx->frame_start_pos = pos + res;
+        return res;
+      }
+    }
+
+    res = frame_ring_read(ring, connection_ctx->replay_seq,
+                          pos - connection_ctx->frame_start_pos,
+                          (uint8_t*) buf, max, &frame_size, &timestamp_us);
+    if (res < 0) {
+      fprintf(stderr, "Replay frame evicted while sending on connection %ld\n",
+              connection_ctx->id);
+      return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+    if (res > 0) {
+      return res;
+    }
+
+    // The frame was completely sent, so move on to the next one.
+    connection_ctx->replay_seq++;
+    connection_ctx->frame_i++;
+    connection_ctx->frame_start_pos = FRAME_END_POSITION;
+    if (!connection_ctx->is_download) {
+      res = snprintf(buf, max, "\r\n--%s\r\n", BOUNDARY);
+      if (res < 0) {
+        return MHD_CONTENT_READER_END_WITH_ERROR;
+      }
+      return res;
+    }
+  }
+}
+
+// Parses a replay start time relative to now, e.g., "-30s", "-2m" or "-90"
+// (seconds), into microseconds. Returns a negative value if malformed.
+static int parse_replay_from(const char* value, int64_t* from_us) {
+  char* end;
+  double from = strtod(value, &end);
+  if (end == value || from > 0) {
+    return -EINVAL;
+  }
+
+  if (strcmp(end, "m") == 0) {
+    from *= 60;
+  } else if (strcmp(end, "h") == 0) {
+    from *= 60 * 60;
+  } else if (strcmp(end, "s") != 0 && strcmp(end, "") != 0) {
+    return -EINVAL;
+  }
+  *from_us = from * TIMESTAMP_US_PER_SEC;
+  return 0;
+}
+
+// Sends all of the given buffers, blocking until done, or until the socket's
+// send timeout passes without progress, which fails with -EAGAIN.
+static int send_buffers(MHD_socket socket, struct iovec* iov, int count) {
+  struct msghdr message = { .msg_iov = iov, .msg_iovlen = count };
+#ifdef MSG_NOSIGNAL
+  int flags = MSG_NOSIGNAL;
+#else
+  int flags = 0;
+#endif
+  while (message.msg_iovlen > 0) {
+    ssize_t res = sendmsg(socket, &message, flags);
+    if (res < 0) {
+      if (errno == EINTR) continue;
+      return -errno;
+    }
+    // Skip past whatever was sent.
+    while (message.msg_iovlen > 0 && (size_t) res >= message.msg_iov->iov_len) {
+      res -= message.msg_iov->iov_len;
+      message.msg_iov++;
+      message.msg_iovlen--;
+    }
+    if (message.msg_iovlen > 0) {
+      message.msg_iov->iov_base = (uint8_t*) message.msg_iov->iov_base + res;
+      message.msg_iov->iov_len -= res;
+    }
+  }
+  return 0;
+}
+
+static int send_websocket_message(websocket_ctx_t* websocket_ctx,
+                                  uint8_t opcode,
+                                  const uint8_t* payload, size_t size) {
+  uint8_t header[WEBSOCKET_HEADER_SIZE_MAX];
+  struct iovec iov[] = {
+    { header, websocket_write_header(header, opcode, size) },
+    { (void*) payload, size },
+  };
+  return send_buffers(websocket_ctx->socket, iov, 2);
+}
+
+// Handles the complete client messages in the input buffer. Returns a negative
+// value if the connection should close.
+static int handle_websocket_messages(websocket_ctx_t* websocket_ctx) {
+  while (1) {
+    ssize_t res;
+    uint8_t opcode;
+    uint8_t* payload;
+    size_t payload_size;
+    res = websocket_parse_frame(websocket_ctx->input,
+                                websocket_ctx->input_size,
+                                &opcode, &payload, &payload_size);
+    if (res < 0 || (res == 0 &&
+                    websocket_ctx->input_size == WEBSOCKET_INPUT_SIZE)) {
+      fprintf(stderr, "Invalid WebSocket message on connection %ld\n",
+              websocket_ctx->connection_ctx->id);
+      return -1;
+    }
+    if (res == 0) {
+      return 0;  // Wait for the rest of the message.
+    }
+
+    switch (opcode) {
+    case WEBSOCKET_OPCODE_TEXT:
+    case WEBSOCKET_OPCODE_BINARY: {
+      char credits[16] = { 0 };
+      memcpy(credits, payload, MIN(payload_size, sizeof(credits) - 1));
+      websocket_ctx->credits += MAX(atoi(credits), 0);
+      websocket_ctx->credits = MIN(websocket_ctx->credits,
+                                   WEBSOCKET_MAX_CREDITS);
+      break;
+    }
+    case WEBSOCKET_OPCODE_PING:
+      send_websocket_message(websocket_ctx, WEBSOCKET_OPCODE_PONG, payload,
+                             payload_size);
+      break;
+    case WEBSOCKET_OPCODE_CLOSE:
+      send_websocket_message(websocket_ctx, WEBSOCKET_OPCODE_CLOSE, payload,
+                             MIN(payload_size, 2));  // Echo the status code.
+      return -1;
+    }
+
+    websocket_ctx->input_size -= res;
+    memmove(websocket_ctx->input, websocket_ctx->input + res,
+            websocket_ctx->input_size);
+  }
+}
+
+// Reads and handles pending client messages. Returns a negative value if the
+// connection should close.
+static int receive_websocket_messages(websocket_ctx_t* websocket_ctx) {
+  ssize_t res = recv(websocket_ctx->socket,
+                     websocket_ctx->input + websocket_ctx->input_size,
+                     WEBSOCKET_INPUT_SIZE - websocket_ctx->input_size, 0);
+  if (res <= 0) {
+    return res < 0 && errno == EINTR ? 0 : -1;
+  }
+  websocket_ctx->input_size += res;
+  return handle_websocket_messages(websocket_ctx);
+}
+
+// Waits up to WEBSOCKET_POLL_MS for a frame newer than the given sequence
+// number and copies it. Returns the frame size or zero if there's none.
+static size_t copy_next_frame(websocket_ctx_t* websocket_ctx, uint64_t* seq,
+                              int64_t* timestamp_us) {
+  ctx_internal_t* ctx_internal =
+      (ctx_internal_t*) websocket_ctx->connection_ctx->server_ctx;
+  size_t size = 0;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += WEBSOCKET_POLL_MS * 1000 * 1000;
+  if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000 * 1000 * 1000;
+  }
+
   pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
-  memcpy(buf, ctx_internal->image_buffer + frame_offset, size);
+  while (ctx_internal->frame_seq == *seq && !ctx_internal->is_stopping) {
+    if (pthread_cond_timedwait(&ctx_internal->frame_cond,
+                               &ctx_internal->image_buffer_mutex,
+                               &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  if (ctx_internal->frame_seq != *seq) {
+    size = ctx_internal->frame_size;
+    memcpy(websocket_ctx->frame, ctx_internal->image_buffer, size);
+    *seq = ctx_internal->frame_seq;
+    *timestamp_us = ctx_internal->frame_timestamp_us;
+  }
   pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
   return size;
 }
 
+static void* websocket_routine(void* ctx) {
+  websocket_ctx_t* websocket_ctx = (websocket_ctx_t*) ctx;
+  connection_ctx_t* connection_ctx = websocket_ctx->connection_ctx;
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) connection_ctx->server_ctx;
+  uint64_t seq = 0;
+
+  // Handle any messages that arrived along with the upgrade request.
+  bool is_open = handle_websocket_messages(websocket_ctx) >= 0;
+  while (is_open) {
+    pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
+    bool is_stopping = ctx_internal->is_stopping;
+    pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+    if (is_stopping) {
+      uint8_t status[] = { WEBSOCKET_STATUS_GOING_AWAY >> 8,
+                           WEBSOCKET_STATUS_GOING_AWAY & 0xff };
+      send_websocket_message(websocket_ctx, WEBSOCKET_OPCODE_CLOSE, status,
+                             sizeof(status));
+      break;
+    }
+
+    struct pollfd poll_fd = { .fd = websocket_ctx->socket, .events = POLLIN };
+    int res = poll(&poll_fd, 1,
+                   websocket_ctx->credits > 0 ? 0 : WEBSOCKET_POLL_MS);
+    if (res < 0 && errno != EINTR) {
+      break;
+    }
+    if (res > 0 && receive_websocket_messages(websocket_ctx) < 0) {
+      break;
+    }
+    if (websocket_ctx->credits == 0) {
+      continue;
+    }
+
+    int64_t timestamp_us;
+    uint64_t last_seq = seq;
+    size_t size = copy_next_frame(websocket_ctx, &seq, &timestamp_us);
+    if (size == 0) {
+      continue;
+    }
+    if (last_seq > 0 && seq - last_seq > 1) {
+      // Skipped frames while waiting for credits or sending.
+      metrics_add("bambucam_websocket_frames_skipped_total",
+                  seq - last_seq - 1);
+    }
+
+    uint8_t metadata[WEBSOCKET_METADATA_SIZE];
+    for (int i = 0; i < 8; i++) {
+      metadata[i] = (uint64_t) timestamp_us >> (i * 8);
+    }
+    for (int i = 0; i < 4; i++) {
+      metadata[8 + i] = (uint32_t) seq >> (i * 8);
+      metadata[12 + i] = (uint32_t) size >> (i * 8);
+    }
+
+    uint8_t header[WEBSOCKET_HEADER_SIZE_MAX];
+    struct iovec iov[] = {
+      { header, websocket_write_header(header, WEBSOCKET_OPCODE_BINARY,
+                                       sizeof(metadata) + size) },
+      { metadata, sizeof(metadata) },
+      { websocket_ctx->frame, size },
+    };
+    int64_t trace_start_us = trace_begin();
+    if (send_buffers(websocket_ctx->socket, iov, 3) < 0) {
+      break;
+    }
+    trace_end("websocket_send", trace_start_us, timestamp_us);
+    websocket_ctx->credits--;
+    connection_ctx->frame_i++;
+#ifdef DEBUG
+    fprintf(stderr, "WebSocket connection %ld sent frame %ld us after "
+            "capture\n", connection_ctx->id, timestamp_now_us() - timestamp_us);
+#endif
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "Closing WebSocket connection %ld\n", connection_ctx->id);
+#endif
+  // The connection context is released once microhttpd closes the connection,
+  // and the socket may be reused right after.
+  pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
+  connection_ctx->has_websocket_socket = false;
+  pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+  MHD_upgrade_action(websocket_ctx->handle, MHD_UPGRADE_ACTION_CLOSE);
+  free(websocket_ctx->frame);
+  free(websocket_ctx);
+
+  pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
+  ctx_internal->num_websockets--;
+  pthread_cond_broadcast(&ctx_internal->frame_cond);
+  pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+  return NULL;
+}
+
+static void on_websocket_upgrade(void* ctx, struct MHD_Connection* connection,
+                                 void* request_ctx,
+                                 const char* extra_in, size_t extra_in_size,
+                                 MHD_socket socket,
+                                 struct MHD_UpgradeResponseHandle* handle) {
+  connection_ctx_t* connection_ctx = (connection_ctx_t*) ctx;
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) connection_ctx->server_ctx;
+
+  websocket_ctx_t* websocket_ctx = calloc(1, sizeof(websocket_ctx_t));
+  if (websocket_ctx == NULL || extra_in_size > WEBSOCKET_INPUT_SIZE ||
+      !(websocket_ctx->frame = malloc(ctx_internal->image_buffer_size))) {
+    fprintf(stderr, "Error allocating WebSocket state\n");
+    if (websocket_ctx) free(websocket_ctx->frame);
+    free(websocket_ctx);
+    MHD_upgrade_action(handle, MHD_UPGRADE_ACTION_CLOSE);
+    return;
+  }
+  websocket_ctx->connection_ctx = connection_ctx;
+  websocket_ctx->socket = socket;
+  websocket_ctx->handle = handle;
+  websocket_ctx->credits = WEBSOCKET_INITIAL_CREDITS;
+  memcpy(websocket_ctx->input, extra_in, extra_in_size);
+  websocket_ctx->input_size = extra_in_size;
+
+  // The thread blocks on sends, up to a timeout, while microhttpd hands out
+  // non-blocking sockets.
+  struct timeval send_timeout = {
+    .tv_sec = WEBSOCKET_SEND_TIMEOUT_MS / 1000,
+    .tv_usec = (WEBSOCKET_SEND_TIMEOUT_MS % 1000) * 1000,
+  };
+  fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) & ~O_NONBLOCK);
+  if (setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+                 sizeof(send_timeout)) < 0) {
+    fprintf(stderr, "Error setting WebSocket send timeout: %s\n",
+            strerror(errno));
+  }
+
+  pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
+  ctx_internal->num_websockets++;
+  connection_ctx->has_websocket_socket = true;
+  connection_ctx->websocket_socket = socket;
+  pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, &websocket_routine, websocket_ctx) != 0) {
+    fprintf(stderr, "Error creating WebSocket thread\n");
+    pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
+    ctx_internal->num_websockets--;
+    connection_ctx->has_websocket_socket = false;
+    pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+    free(websocket_ctx->frame);
+    free(websocket_ctx);
+    MHD_upgrade_action(handle, MHD_UPGRADE_ACTION_CLOSE);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+// Answers a WebSocket opening handshake, after which on_websocket_upgrade
+// takes over the connection.
+static enum MHD_Result queue_websocket_response(
+    connection_ctx_t* connection_ctx) {
+  struct MHD_Connection* connection = connection_ctx->connection;
+  struct MHD_Response* response;
+  enum MHD_Result res;
+
+  const char* key = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                                "Sec-WebSocket-Key");
+  const char* upgrade = MHD_lookup_connection_value(
+      connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_UPGRADE);
+  if (key == NULL || upgrade == NULL || strcasecmp(upgrade, "websocket") != 0) {
+    fprintf(stderr, "Expected a WebSocket handshake\n");
+    response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+    res = MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, response);
+    MHD_destroy_response(response);
+    return res;
+  }
+
+  char accept[WEBSOCKET_ACCEPT_SIZE];
+  websocket_accept_key(key, accept);
+
+  response = MHD_create_response_for_upgrade(on_websocket_upgrade,
+                                             connection_ctx);
+  if (!response) {
+    fprintf(stderr, "Error generating upgrade response\n");
+    return MHD_NO;
+  }
+
+  res = MHD_add_response_header(response, MHD_HTTP_HEADER_UPGRADE,
+                                "websocket");
+  if (res == MHD_YES) {
+    res = MHD_add_response_header(response, "Sec-WebSocket-Accept", accept);
+  }
+  if (res != MHD_YES) {
+    fprintf(stderr, "Error setting upgrade response headers\n");
+    MHD_destroy_response(response);
+    return res;
+  }
+
+  connection_ctx->is_websocket = true;
+  res = MHD_queue_response(connection, MHD_HTTP_SWITCHING_PROTOCOLS, response);
+  MHD_destroy_response(response);
+  return res;
+}
+
 static connection_ctx_t* get_connection_ctx(ctx_internal_t* ctx_internal,
                                             struct MHD_Connection *connection) {
   for (int i = 0; i < MAX_NUM_CONNECTIONS; i++) {
@@ -165,6 +1204,212 @@ static connection_ctx_t* get_connection_ctx(ctx_internal_t* ctx_internal,
   return NULL;
 }
 
+// Reports a changed number of clients, skipping the callback for more than
+// one client since that always follows a call with one (see server.h).
+static void notify_client_change(ctx_internal_t* ctx_internal) {
+  metrics_set("bambucam_clients", ctx_internal->num_clients);
+  if (ctx_internal->num_clients <= 1) {
+    ctx_internal->callbacks->on_client_change(
+        ctx_internal->callbacks->callback_ctx,
+        ctx_internal->num_clients);
+  }
+}
+
+// Counts the connection as a client once it requests frames.
+static void add_client(connection_ctx_t* connection_ctx) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) connection_ctx->server_ctx;
+  if (!connection_ctx->is_client) {
+    connection_ctx->is_client = true;
+    ctx_internal->num_clients++;
+    notify_client_change(ctx_internal);
+  }
+}
+
+// Stops counting the connection as a client, e.g., once it closes.
+static void remove_client(connection_ctx_t* connection_ctx) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) connection_ctx->server_ctx;
+  if (connection_ctx->is_client) {
+    connection_ctx->is_client = false;
+    ctx_internal->num_clients--;
+    notify_client_change(ctx_internal);
+  }
+}
+
+static enum MHD_Result queue_metrics_response(
+    struct MHD_Connection* connection) {
+  struct MHD_Response* response;
+  enum MHD_Result res;
+
+  // Grow the buffer until the metrics fit.
+  size_t buffer_size = METRICS_BUFFER_SIZE;
+  char* buffer;
+  size_t size;
+  while (1) {
+    buffer = malloc(buffer_size);
+    if (buffer == NULL) {
+      fprintf(stderr, "Error allocating metrics: %s\n", strerror(errno));
+      return MHD_NO;
+    }
+    size = metrics_format(buffer, buffer_size);
+    if (size < buffer_size) {
+      break;
+    }
+    free(buffer);
+    buffer_size = size + 1;
+  }
+
+  response = MHD_create_response_from_buffer(size, buffer,
+                                             MHD_RESPMEM_MUST_FREE);
+  if (!response) {
+    fprintf(stderr, "Error generating metrics response\n");
+    free(buffer);
+    return MHD_NO;
+  }
+  res = MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
+                                "text/plain; version=0.0.4");
+  if (res == MHD_YES) {
+    res = MHD_queue_response(connection, MHD_HTTP_OK, response);
+  }
+  MHD_destroy_response(response);
+  return res;
+}
+
+static enum MHD_Result queue_trace_response(
+    struct MHD_Connection* connection) {
+  struct MHD_Response* response;
+  enum MHD_Result res;
+
+  char* buffer;
+  size_t size;
+  FILE* file = open_memstream(&buffer, &size);
+  if (file == NULL) {
+    fprintf(stderr, "Error opening trace buffer: %s\n", strerror(errno));
+    return MHD_NO;
+  }
+  int trace_res = trace_write(file);
+  if (fclose(file) != 0 || trace_res < 0) {
+    free(buffer);
+    return MHD_NO;
+  }
+
+  response = MHD_create_response_from_buffer(size, buffer,
+                                             MHD_RESPMEM_MUST_FREE);
+  if (!response) {
+    fprintf(stderr, "Error generating trace response\n");
+    free(buffer);
+    return MHD_NO;
+  }
+  res = MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
+                                "application/json");
+  if (res == MHD_YES) {
+    res = MHD_queue_response(connection, MHD_HTTP_OK, response);
+  }
+  MHD_destroy_response(response);
+  return res;
+}
+
+// Returns whether the current frame is recent enough to serve at
+// SNAPSHOT_PATH, given how long caches may keep it.
+static bool is_snapshot_fresh(ctx_internal_t* ctx_internal) {
+  pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
+  bool is_fresh = ctx_internal->frame_size > 0 &&
+                  timestamp_now_us() - ctx_internal->frame_timestamp_us <=
+                  ctx_internal->snapshot_max_age * TIMESTAMP_US_PER_SEC;
+  pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+  return is_fresh;
+}
+
+static enum MHD_Result add_snapshot_headers(ctx_internal_t* ctx_internal,
+                                            struct MHD_Response* response) {
+  char cache_control[32];
+  snprintf(cache_control, sizeof(cache_control), "public, max-age=%d",
+           ctx_internal->snapshot_max_age);
+  enum MHD_Result res = MHD_add_response_header(
+      response, MHD_HTTP_HEADER_CACHE_CONTROL, cache_control);
+  if (res == MHD_YES) {
+    res = MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG,
+                                  ctx_internal->snapshot_etag);
+  }
+  return res;
+}
+
+// Returns the response serving the current frame at SNAPSHOT_PATH, copying
+// the frame into a new one on the first request for it, or NULL on error.
+static struct MHD_Response* get_snapshot_response(
+    ctx_internal_t* ctx_internal) {
+  pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
+  if (ctx_internal->snapshot_response &&
+      ctx_internal->snapshot_seq == ctx_internal->frame_seq) {
+    pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+    return ctx_internal->snapshot_response;
+  }
+  uint64_t frame_seq = ctx_internal->frame_seq;
+  int64_t timestamp_us = ctx_internal->frame_timestamp_us;
+  size_t size = ctx_internal->frame_size;
+  uint8_t* buffer = malloc(size);
+  if (buffer) {
+    memcpy(buffer, ctx_internal->image_buffer, size);
+  }
+  pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+  if (buffer == NULL) {
+    fprintf(stderr, "Error allocating snapshot: %s\n", strerror(errno));
+    return NULL;
+  }
+
+  struct MHD_Response* response = MHD_create_response_from_buffer(
+      size, buffer, MHD_RESPMEM_MUST_FREE);
+  if (!response) {
+    fprintf(stderr, "Error generating snapshot response\n");
+    free(buffer);
+    return NULL;
+  }
+  // The capture time identifies the frame even across restarts.
+  snprintf(ctx_internal->snapshot_etag, SNAPSHOT_ETAG_SIZE, "\"%ld\"",
+           timestamp_us);
+  if (MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
+                              "image/jpeg") != MHD_YES ||
+      add_snapshot_headers(ctx_internal, response) != MHD_YES) {
+    fprintf(stderr, "Error setting snapshot headers\n");
+    MHD_destroy_response(response);
+    return NULL;
+  }
+
+  // Requests still sending the previous snapshot keep their own reference.
+  if (ctx_internal->snapshot_response) {
+    MHD_destroy_response(ctx_internal->snapshot_response);
+  }
+  ctx_internal->snapshot_response = response;
+  ctx_internal->snapshot_seq = frame_seq;
+  return response;
+}
+
+static enum MHD_Result queue_snapshot_response(
+    ctx_internal_t* ctx_internal, struct MHD_Connection* connection) {
+  struct MHD_Response* response = get_snapshot_response(ctx_internal);
+  if (!response) {
+    return MHD_NO;
+  }
+
+  // Let caches revalidate a snapshot they already have without resending it.
+  const char* if_none_match = MHD_lookup_connection_value(
+      connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
+  if (if_none_match == NULL ||
+      strcmp(if_none_match, ctx_internal->snapshot_etag) != 0) {
+    return MHD_queue_response(connection, MHD_HTTP_OK, response);
+  }
+  response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+  if (!response) {
+    fprintf(stderr, "Error generating snapshot response\n");
+    return MHD_NO;
+  }
+  enum MHD_Result res = add_snapshot_headers(ctx_internal, response);
+  if (res == MHD_YES) {
+    res = MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, response);
+  }
+  MHD_destroy_response(response);
+  return res;
+}
+
 static enum MHD_Result default_handler(void* ctx,
                                        struct MHD_Connection *connection,
                                        const char *url,
@@ -173,18 +1418,48 @@ static enum MHD_Result default_handler(void* ctx,
                                        const char *upload_data,
                                        size_t *upload_data_size,
                                        void **con_cls) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
   struct MHD_Response* response;
   enum MHD_Result res;
 
-  if (strcmp(url, "/") != 0 || strcmp(method, "GET") != 0) {
-    fprintf(stderr, "Only handling GET /\n");
+  if (strcmp(url, METRICS_PATH) == 0 && strcmp(method, "GET") == 0) {
+    return queue_metrics_response(connection);
+  }
+  if (strcmp(url, TRACE_PATH) == 0 && strcmp(method, "GET") == 0) {
+    return queue_trace_response(connection);
+  }
+
+  bool is_replay = strcmp(url, REPLAY_PATH) == 0 && ctx_internal->replay_ring;
+  bool is_websocket = strcmp(url, WEBSOCKET_PATH) == 0;
+  bool is_snapshot = strcmp(url, SNAPSHOT_PATH) == 0;
+  roi_t* roi = strncmp(url, ROI_PATH, strlen(ROI_PATH)) == 0 &&
+               strcmp(method, "GET") == 0
+      ? find_roi(ctx_internal, url + strlen(ROI_PATH))
+      : NULL;
+  if ((strcmp(url, "/") != 0 && !is_replay && !is_websocket && !is_snapshot &&
+       !roi) ||
+      strcmp(method, "GET") != 0) {
+    fprintf(stderr, "Only handling GET /, GET " ROI_PATH "<name>, GET "
+            REPLAY_PATH ", GET " WEBSOCKET_PATH ", GET " SNAPSHOT_PATH
+            ", GET " METRICS_PATH " and GET " TRACE_PATH "\n");
     response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
     res = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
     MHD_destroy_response(response);
     return res;
   }
 
-  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+  int64_t replay_from_us = REPLAY_FROM_DEFAULT_US;
+  const char* replay_from = MHD_lookup_connection_value(
+      connection, MHD_GET_ARGUMENT_KIND, REPLAY_FROM_ARGUMENT);
+  if (is_replay && replay_from &&
+      parse_replay_from(replay_from, &replay_from_us) < 0) {
+    fprintf(stderr, "Invalid replay start time: %s\n", replay_from);
+    response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+    res = MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, response);
+    MHD_destroy_response(response);
+    return res;
+  }
+
   connection_ctx_t* connection_ctx = get_connection_ctx(ctx_internal,
                                                         connection);
   if (connection_ctx == NULL) {
@@ -196,11 +1471,60 @@ static enum MHD_Result default_handler(void* ctx,
     return res;
   }
 
+  // Snapshots of stale frames wait for the next frame as clients, which wakes
+  // up the camera if needed, and are served once server_send_image resumes
+  // them, calling this handler again.
+  if (is_snapshot) {
+    if (connection_ctx->is_snapshot) {
+      connection_ctx->is_snapshot = false;
+      remove_client(connection_ctx);
+      return queue_snapshot_response(ctx_internal, connection);
+    }
+    if (is_snapshot_fresh(ctx_internal)) {
+      return queue_snapshot_response(ctx_internal, connection);
+    }
+    connection_ctx->is_snapshot = true;
+    add_client(connection_ctx);
+    MHD_suspend_connection(connection);
+    return MHD_YES;
+  }
+
+  add_client(connection_ctx);
   connection_ctx->frame_i = 0;
+  if (is_websocket) {
+    return queue_websocket_response(connection_ctx);
+  }
+
   connection_ctx->frame_start_pos = 0;
+  connection_ctx->is_frame_held = false;
+  connection_ctx->has_next_frame = false;
+  const char* kbps = MHD_lookup_connection_value(connection,
+                                                 MHD_GET_ARGUMENT_KIND,
+                                                 KBPS_ARGUMENT);
+  connection_ctx->frame_budget = kbps ? MAX(atol(kbps), 1) * 1000 / 8 /
+                                        MAX(ctx_internal->fps, 1) : 0;
+  connection_ctx->roi = roi;
+  connection_ctx->derived_frame = NULL;
+  connection_ctx->send_timestamps =
+      MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND,
+                                  TIMESTAMPS_ARGUMENT) != NULL;
+  connection_ctx->is_replay = is_replay;
+  if (is_replay) {
+    int64_t now_us = timestamp_now_us();
+    connection_ctx->frame_start_pos = FRAME_END_POSITION;
+    connection_ctx->is_download =
+        MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND,
+                                    REPLAY_DOWNLOAD_ARGUMENT) != NULL;
+    connection_ctx->replay_seq = frame_ring_find(ctx_internal->replay_ring,
+                                                 now_us + replay_from_us);
+    connection_ctx->replay_end_seq = frame_ring_next(ctx_internal->replay_ring);
+    connection_ctx->replay_delay_us = -replay_from_us;
+  }
   response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN,
                                                RESPONSE_BLOCK_SIZE_BYTES,
-                                               response_callback,
+                                               is_replay
+                                               ? replay_response_callback
+                                               : response_callback,
                                                connection_ctx,
                                                NULL);  // No free callback.
   if (!response) {
@@ -208,20 +1532,38 @@ static enum MHD_Result default_handler(void* ctx,
     return MHD_NO;
   }
 
-  res = MHD_add_response_header(response,
-                                MHD_HTTP_HEADER_CONTENT_TYPE,
-                                "multipart/x-mixed-replace;boundary=" BOUNDARY);
+  if (connection_ctx->is_download) {
+    res = MHD_add_response_header(response,
+                                  MHD_HTTP_HEADER_CONTENT_TYPE,
+                                  "video/x-motion-jpeg");
+    if (res == MHD_YES) {
+      res = MHD_add_response_header(response,
+                                    MHD_HTTP_HEADER_CONTENT_DISPOSITION,
+                                    "attachment; filename=\"replay.mjpeg\"");
+    }
+  } else {
+    res = MHD_add_response_header(response,
+                                  MHD_HTTP_HEADER_CONTENT_TYPE,
+                                  "multipart/x-mixed-replace;boundary="
+                                  BOUNDARY);
+  }
+  if (res == MHD_YES) {
+    res = MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL,
+                                  STREAM_CACHE_CONTROL);
+  }
   if (res != MHD_YES) {
-    fprintf(stderr, "Error setting content type: multipart/x-mixed-replace\n");
+    fprintf(stderr, "Error setting response headers\n");
     return res;
   }
 
-  res = MHD_set_response_options(response,
-                                 MHD_RF_HTTP_1_0_COMPATIBLE_STRICT,
-                                 MHD_RO_END);
-  if (res != MHD_YES) {
-    fprintf(stderr, "Error setting response option\n");
-    return res;
+  if (!ctx_internal->is_chunked) {
+    res = MHD_set_response_options(response,
+                                   MHD_RF_HTTP_1_0_COMPATIBLE_STRICT,
+                                   MHD_RO_END);
+    if (res != MHD_YES) {
+      fprintf(stderr, "Error setting response option\n");
+      return res;
+    }
   }
 
   res = MHD_queue_response(connection, MHD_HTTP_OK, response);
@@ -229,11 +1571,55 @@ static enum MHD_Result default_handler(void* ctx,
   return res;
 }
 
+// Sets the configured socket options on the connection's socket, if any.
+// Failing to is logged but not fatal.
+static void setup_socket(ctx_internal_t* ctx_internal,
+                         connection_ctx_t* connection_ctx) {
+  if (ctx_internal->tcp_notsent_lowat == 0 && ctx_internal->tcp_sndbuf == 0 &&
+      !ctx_internal->tcp_nodelay) {
+    return;
+  }
+  const union MHD_ConnectionInfo* info = MHD_get_connection_info(
+      connection_ctx->connection, MHD_CONNECTION_INFO_CONNECTION_FD);
+  if (info == NULL) {
+    fprintf(stderr, "Error fetching connection %ld socket\n",
+            connection_ctx->id);
+    return;
+  }
+
+  MHD_socket socket = info->connect_fd;
+  int one = 1;
+  if (ctx_internal->tcp_sndbuf > 0 &&
+      setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &ctx_internal->tcp_sndbuf,
+                 sizeof(int)) < 0) {
+    fprintf(stderr, "Error setting SO_SNDBUF on connection %ld: %s\n",
+            connection_ctx->id, strerror(errno));
+  }
+#ifdef TCP_NOTSENT_LOWAT
+  if (ctx_internal->tcp_notsent_lowat > 0 &&
+      setsockopt(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                 &ctx_internal->tcp_notsent_lowat, sizeof(int)) < 0) {
+    fprintf(stderr, "Error setting TCP_NOTSENT_LOWAT on connection %ld: %s\n",
+            connection_ctx->id, strerror(errno));
+  }
+#endif
+  if (ctx_internal->tcp_nodelay &&
+      setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int)) < 0) {
+    fprintf(stderr, "Error setting TCP_NODELAY on connection %ld: %s\n",
+            connection_ctx->id, strerror(errno));
+  }
+}
+
 static void on_connection_change(void* ctx, struct MHD_Connection *connection,
                                  void** socket_context,
                                  enum MHD_ConnectionNotificationCode code) {
   ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
   connection_ctx_t* connection_ctx;
+  if (!ctx_internal->is_thread_setup) {
+    thread_setup("http");
+    ctx_internal->is_thread_setup = true;
+  }
+
   switch (code) {
   case MHD_CONNECTION_NOTIFY_STARTED:
     ctx_internal->num_connections++;
@@ -244,6 +1630,7 @@ static void on_connection_change(void* ctx, struct MHD_Connection *connection,
       connection_ctx->id = ctx_internal->next_connection_id++;
       connection_ctx->connection = connection;
       connection_ctx->server_ctx = (server_ctx_t) ctx;
+      setup_socket(ctx_internal, connection_ctx);
     }
     break;
   case MHD_CONNECTION_NOTIFY_CLOSED:
@@ -252,13 +1639,97 @@ static void on_connection_change(void* ctx, struct MHD_Connection *connection,
     if (connection_ctx == NULL) {
       fprintf(stderr, "Error locating connection state\n");
     } else {
+      remove_client(connection_ctx);
+      pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
+      free(connection_ctx->held_frame);
       memset(connection_ctx, 0, sizeof(connection_ctx_t));
+      pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
     }
     break;
   }
-  ctx_internal->callbacks->on_client_change(
-      ctx_internal->callbacks->callback_ctx,
-      ctx_internal->num_connections);
+}
+
+// Reads the whole file at path into a null-terminated string, which the caller
+// frees. Returns a negative value on error.
+static int read_file(const char* path, char** contents) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+    return -errno;
+  }
+
+  char* buffer = NULL;
+  size_t size = 0;
+  FILE* stream = open_memstream(&buffer, &size);
+  if (stream == NULL) {
+    fprintf(stderr, "Error allocating %s contents: %s\n", path,
+            strerror(errno));
+    fclose(file);
+    return -errno;
+  }
+  char block[4096];
+  size_t block_size;
+  while ((block_size = fread(block, 1, sizeof(block), file)) > 0) {
+    fwrite(block, 1, block_size, stream);
+  }
+  int res = ferror(file) ? -EIO : 0;
+  fclose(file);
+  if (fclose(stream) != 0 && res == 0) {
+    res = -ENOMEM;
+  }
+  if (res < 0) {
+    fprintf(stderr, "Error reading %s\n", path);
+    free(buffer);
+    return res;
+  }
+  *contents = buffer;
+  return 0;
+}
+
+// Loads the TLS certificate and key, if configured, and fills options with
+// the microhttpd options serving HTTPS with them, terminated by
+// MHD_OPTION_END. Returns whether TLS is enabled, or a negative value on
+// error.
+static int setup_tls(ctx_internal_t* ctx_internal,
+                     struct MHD_OptionItem options[4]) {
+  const char* cert_path = config_get_string(TLS_CERT_OPTION, NULL);
+  const char* key_path = config_get_string(TLS_KEY_OPTION, NULL);
+  const char* priorities = config_get_string(TLS_PRIORITIES_OPTION, NULL);
+  size_t num_options = 0;
+  options[num_options] = (struct MHD_OptionItem) { MHD_OPTION_END, 0, NULL };
+  if (cert_path == NULL && key_path == NULL) {
+    return false;
+  }
+  if (cert_path == NULL || key_path == NULL) {
+    fprintf(stderr, "Expected both %s and %s to serve HTTPS\n",
+            TLS_CERT_OPTION, TLS_KEY_OPTION);
+    return -EINVAL;
+  }
+  if (MHD_is_feature_supported(MHD_FEATURE_TLS) != MHD_YES) {
+    fprintf(stderr, "Can't serve HTTPS, microhttpd was built without TLS\n");
+    return -ENOTSUP;
+  }
+
+  int res = read_file(cert_path, &ctx_internal->tls_cert);
+  if (res == 0) {
+    res = read_file(key_path, &ctx_internal->tls_key);
+  }
+  if (res < 0) {
+    return res;
+  }
+  options[num_options++] = (struct MHD_OptionItem) {
+    MHD_OPTION_HTTPS_MEM_CERT, 0, ctx_internal->tls_cert
+  };
+  options[num_options++] = (struct MHD_OptionItem) {
+    MHD_OPTION_HTTPS_MEM_KEY, 0, ctx_internal->tls_key
+  };
+  if (priorities) {
+    options[num_options++] = (struct MHD_OptionItem) {
+      MHD_OPTION_HTTPS_PRIORITIES, 0, (void*) priorities
+    };
+  }
+  options[num_options] = (struct MHD_OptionItem) { MHD_OPTION_END, 0, NULL };
+  return true;
 }
 
 int server_start(server_ctx_t ctx,
@@ -266,24 +1737,62 @@ int server_start(server_ctx_t ctx,
                  int width, int height, int fps, size_t buffer_size) {
   ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
   ctx_internal->num_connections = 0;
+  ctx_internal->num_clients = 0;
   ctx_internal->callbacks = callbacks;
-  ctx_internal->image_buffer_size = buffer_size;
-  ctx_internal->image_buffer = malloc(ctx_internal->image_buffer_size);
-  if (ctx_internal->image_buffer == NULL) {
+  ctx_internal->fps = fps;
+  ctx_internal->snapshot_max_age = MAX(config_get_int(SNAPSHOT_MAX_AGE_OPTION,
+                                                      SNAPSHOT_MAX_AGE_DEFAULT),
+                                       0);
+  ctx_internal->is_chunked = config_get_bool(HTTP_CHUNKED_OPTION, false);
+  ctx_internal->tcp_notsent_lowat = MAX(config_get_int(
+      TCP_NOTSENT_LOWAT_OPTION, TCP_NOTSENT_LOWAT_DEFAULT), 0);
+  ctx_internal->tcp_sndbuf = MAX(config_get_int(TCP_SNDBUF_OPTION, 0), 0);
+  ctx_internal->tcp_nodelay = config_get_bool(TCP_NODELAY_OPTION, false);
+  uint8_t* image_buffer = malloc(buffer_size);
+  if (image_buffer == NULL) {
     fprintf(stderr, "Error allocating image buffer: %s\n", strerror(errno));
     return -errno;
   }
 
+  frame_ring_t replay_ring = NULL;
+  long replay_buffer_mb = config_get_int(REPLAY_BUFFER_MB_OPTION,
+                                         REPLAY_BUFFER_MB_DEFAULT);
+  if (replay_buffer_mb > 0) {
+    int res = frame_ring_alloc(&replay_ring, replay_buffer_mb * 1024 * 1024);
+    if (res < 0) {
+      fprintf(stderr, "Error allocating replay buffer\n");
+      free(image_buffer);
+      return res;
+    }
+  }
+
+  pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
+  ctx_internal->image_buffer = image_buffer;
+  ctx_internal->image_buffer_size = buffer_size;
+  ctx_internal->replay_ring = replay_ring;
+  pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+
+  struct MHD_OptionItem tls_options[4];
+  int is_tls = setup_tls(ctx_internal, tls_options);
+  if (is_tls < 0) {
+    return is_tls;
+  }
+
   enum MHD_FLAG flags = MHD_NO_FLAG;
   // Not supported on Darwin? Maybe use poll or just not bother?
   // flags |= MHD_USE_EPOLL_INTERNAL_THREAD;
   // I assume there's some synchronization expectation that we want this. Looks like the API changed so it's not per polling method.
   flags |= MHD_USE_INTERNAL_POLLING_THREAD;
   flags |= MHD_ALLOW_SUSPEND_RESUME;
+  flags |= MHD_ALLOW_UPGRADE;
+  flags |= MHD_USE_ITC;  // Needed by MHD_quiesce_daemon.
   flags |= MHD_USE_ERROR_LOG;
 #ifdef DEBUG
   flags |= MHD_USE_DEBUG;
 #endif
+  if (is_tls) {
+    flags |= MHD_USE_TLS;
+  }
   ctx_internal->daemon = MHD_start_daemon(flags, port,
                                           NULL, NULL,  // Accept all IPs.
                                           &default_handler, ctx,
@@ -291,13 +1800,15 @@ int server_start(server_ctx_t ctx,
                                           MAX_NUM_CONNECTIONS,
                                           MHD_OPTION_NOTIFY_CONNECTION,
                                           on_connection_change, ctx,
+                                          MHD_OPTION_ARRAY, tls_options,
                                           MHD_OPTION_END);
   if (!ctx_internal->daemon) {
     fprintf(stderr, "Error starting MHD daemon\n");
     return -1;
   }
 
-  fprintf(stderr, "Serving video stream at: http://localhost:%d/\n", port);
+  fprintf(stderr, "Serving video stream at: %s://localhost:%d/\n",
+          is_tls ? "https" : "http", port);
   return 0;
 }
 
@@ -307,34 +1818,126 @@ int server_stop(server_ctx_t ctx) {
     fprintf(stderr, "Attempting to close an uninitialized server\n");
     return -1;
   }
+
+  // Stop accepting connections, then have the WebSocket threads close their
+  // connections, which microhttpd no longer manages, before stopping the
+  // daemon along with the remaining connections.
+  MHD_quiesce_daemon(ctx_internal->daemon);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += STOP_TIMEOUT_MS / 1000;
+  deadline.tv_nsec += (STOP_TIMEOUT_MS % 1000) * 1000 * 1000;
+  if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000 * 1000 * 1000;
+  }
+
+  // Threads still sending to clients that don't read after the timeout get
+  // their sockets shut down, failing the send. Either way, every thread has
+  // to be done with the context before it can be freed.
+  pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
+  ctx_internal->is_stopping = true;
+  pthread_cond_broadcast(&ctx_internal->frame_cond);
+  bool is_timed_out = false;
+  while (ctx_internal->num_websockets > 0) {
+    if (is_timed_out) {
+      pthread_cond_wait(&ctx_internal->frame_cond,
+                        &ctx_internal->image_buffer_mutex);
+    } else if (pthread_cond_timedwait(&ctx_internal->frame_cond,
+                                      &ctx_internal->image_buffer_mutex,
+                                      &deadline) == ETIMEDOUT) {
+      fprintf(stderr, "Timed out closing %ld WebSocket connection(s), "
+              "shutting them down\n", ctx_internal->num_websockets);
+      for (int i = 0; i < MAX_NUM_CONNECTIONS; i++) {
+        connection_ctx_t* connection_ctx = &ctx_internal->connections[i];
+        if (connection_ctx->has_websocket_socket) {
+          shutdown(connection_ctx->websocket_socket, SHUT_RDWR);
+        }
+      }
+      is_timed_out = true;
+    }
+  }
+  pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+
   MHD_stop_daemon(ctx_internal->daemon);
   return 0;
 }
 
-int server_send_image(server_ctx_t ctx, uint8_t* buffer, size_t size) {
+int server_send_image(server_ctx_t ctx, uint8_t* buffer, size_t size,
+                      int64_t timestamp_us) {
   ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+  pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
+  if (ctx_internal->image_buffer == NULL) {
+    pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+    return -1;  // Not started.
+  }
   if (size > ctx_internal->image_buffer_size) {
     fprintf(stderr, "Image buffer too large: %ld > %ld\n", size,
             ctx_internal->image_buffer_size);
+    pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
     return -1;
   }
+  frame_ring_t replay_ring = ctx_internal->replay_ring;
+  derivation_t derivation;
+  plan_derivation(ctx_internal, size, &derivation);
+  pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+
+  // Derive versions of the frame for clients without holding the lock, which
+  // the microhttpd thread needs to keep serving the current frame meanwhile.
+  derive_frames(ctx_internal, &derivation, buffer, size, timestamp_us);
 
+  int64_t trace_start_us = trace_begin();
   pthread_mutex_lock(&ctx_internal->image_buffer_mutex);
+  for (int i = 0; i < MAX_NUM_CONNECTIONS; i++) {
+    connection_ctx_t* connection_ctx = &ctx_internal->connections[i];
+    if (!is_live_stream(connection_ctx)) {
+      continue;
+    }
+
+    // Connections still sending a frame finish it from a copy, then send this
+    // one. Any frame they were going to send after it is dropped, like frames
+    // connections didn't even start sending.
+    if (connection_ctx->frame_start_pos > 0) {
+      if (connection_ctx->has_next_frame) {
+        metrics_add("bambucam_http_frames_dropped_total", 1);
+      } else if (!connection_ctx->is_frame_held) {
+        hold_frame(ctx_internal, connection_ctx,
+                   get_frame_buffer(connection_ctx),
+                   get_frame_size(connection_ctx));
+      }
+      connection_ctx->has_next_frame = true;
+    } else {
+      if (connection_ctx->frame_start_pos == 0 &&
+          ctx_internal->frame_size > 0) {
+        metrics_add("bambucam_http_frames_dropped_total", 1);
+      }
+      connection_ctx->frame_start_pos = 0;
+    }
+    connection_ctx->resume_trace_us = trace_begin();
+  }
   memcpy(ctx_internal->image_buffer, buffer, size);
   ctx_internal->frame_size = size;
+  ctx_internal->frame_timestamp_us = timestamp_us;
+  ctx_internal->frame_seq++;
+  publish_derived_frames(ctx_internal, &derivation);
+  pthread_cond_broadcast(&ctx_internal->frame_cond);
   pthread_mutex_unlock(&ctx_internal->image_buffer_mutex);
+  trace_end("image_buffer_copy", trace_start_us, timestamp_us);
+
+  if (replay_ring) {
+    trace_start_us = trace_begin();
+    frame_ring_push(replay_ring, buffer, size, timestamp_us);
+    trace_end("replay_push", trace_start_us, timestamp_us);
+  }
+
+  trace_start_us = trace_begin();
 
   for (int i = 0; i < MAX_NUM_CONNECTIONS; i++) {
     connection_ctx_t* connection_ctx = &ctx_internal->connections[i];
-    if (connection_ctx->connection == NULL) {
-      continue;  // Skip inactive connection contexts.
-    }
-
-    if (connection_ctx->frame_start_pos != FRAME_END_POSITION) {
-      fprintf(stderr, "Sending frame before connection %ld is ready\n",
-              connection_ctx->id);
+    if (!connection_ctx->is_client || connection_ctx->is_websocket) {
+      continue;  // Skip connections without clients, e.g., served snapshots.
     }
-    connection_ctx->frame_start_pos = 0;
 
     const union MHD_ConnectionInfo* info;
     info = MHD_get_connection_info(connection_ctx->connection,
@@ -351,5 +1954,6 @@ int server_send_image(server_ctx_t ctx, uint8_t* buffer, size_t size) {
 #endif
     }
   }
+  trace_end("resume_connections", trace_start_us, timestamp_us);
   return 0;
 }
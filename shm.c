@@ -0,0 +1,158 @@
+#include "shm.h"
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// Number of frames kept in the ring.
+#define SLOTS_OPTION "shm_slots"
+#define SLOTS_DEFAULT 4
+
+// Slot alignment, one cache line.
+#define SLOT_ALIGNMENT 64
+
+// The internal representation of the opaque pointer.
+typedef struct {
+  char* name;
+  uint8_t* mapping;
+  size_t mapping_size;
+  shm_header_t* header;
+  uint64_t seq;
+} ctx_internal_t;
+
+int shm_alloc_ctx(shm_ctx_t* ctx) {
+  ctx_internal_t* ctx_internal = malloc(sizeof(ctx_internal_t));
+  if (ctx_internal == NULL) {
+    fprintf(stderr, "Error allocating context: %s\n", strerror(errno));
+    return -errno;
+  }
+
+  memset(ctx_internal, 0, sizeof(ctx_internal_t));
+  *ctx = (shm_ctx_t) ctx_internal;
+  return 0;
+}
+
+int shm_free_ctx(shm_ctx_t ctx) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+  free(ctx_internal->name);
+  free(ctx_internal);
+  return 0;
+}
+
+int shm_start(shm_ctx_t ctx, const char* name, size_t buffer_size,
+              int width, int height) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+
+  long slot_count = config_get_int(SLOTS_OPTION, SLOTS_DEFAULT);
+  if (slot_count < 2) {
+    fprintf(stderr, "Expected at least two shared memory slots\n");
+    return -EINVAL;
+  }
+  size_t slot_stride = sizeof(shm_slot_t) + buffer_size;
+  slot_stride = (slot_stride + SLOT_ALIGNMENT - 1) & ~(SLOT_ALIGNMENT - 1);
+
+  ctx_internal->name = strdup(name);
+  if (ctx_internal->name == NULL) {
+    fprintf(stderr, "Error allocating name: %s\n", strerror(errno));
+    return -errno;
+  }
+
+  // Start from a fresh object in case a previous instance left one behind.
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Error opening shared memory %s: %s\n", name,
+            strerror(errno));
+    return -errno;
+  }
+
+  ctx_internal->mapping_size = SHM_HEADER_SIZE + slot_count * slot_stride;
+  if (ftruncate(fd, ctx_internal->mapping_size) < 0) {
+    fprintf(stderr, "Error sizing shared memory: %s\n", strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return -errno;
+  }
+
+  void* mapping = mmap(NULL, ctx_internal->mapping_size,
+                       PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Error mapping shared memory: %s\n", strerror(errno));
+    shm_unlink(name);
+    return -errno;
+  }
+  ctx_internal->mapping = mapping;
+
+  // The object starts zeroed, so only the non-zero fields need setting.
+  shm_header_t* header = (shm_header_t*) ctx_internal->mapping;
+  header->version = SHM_VERSION;
+  header->slot_count = slot_count;
+  header->slot_size = buffer_size;
+  header->slot_stride = slot_stride;
+  header->width = width;
+  header->height = height;
+  atomic_thread_fence(memory_order_release);
+  header->magic = SHM_MAGIC;  // Written last to mark the header as valid.
+  ctx_internal->header = header;
+
+  fprintf(stderr, "Publishing frames to shared memory: %s\n", name);
+  return 0;
+}
+
+int shm_stop(shm_ctx_t ctx) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+  if (ctx_internal->mapping == NULL) {
+    return 0;  // Never started.
+  }
+
+  munmap(ctx_internal->mapping, ctx_internal->mapping_size);
+  ctx_internal->mapping = NULL;
+  ctx_internal->header = NULL;
+  shm_unlink(ctx_internal->name);
+  return 0;
+}
+
+int shm_send_image(shm_ctx_t ctx, uint8_t* buffer, size_t size,
+                   int64_t timestamp_us) {
+  ctx_internal_t* ctx_internal = (ctx_internal_t*) ctx;
+  shm_header_t* header = ctx_internal->header;
+  if (size > header->slot_size) {
+    fprintf(stderr, "Image buffer too large: %ld > %d\n", size,
+            header->slot_size);
+    return -1;
+  }
+
+  uint64_t seq = ++ctx_internal->seq;
+  shm_slot_t* slot = (shm_slot_t*) (ctx_internal->mapping + SHM_HEADER_SIZE +
+      (seq % header->slot_count) * header->slot_stride);
+
+  // Mark the slot as being written (odd) before touching its contents.
+  uint32_t seqlock = atomic_load_explicit(&slot->seqlock,
+                                          memory_order_relaxed);
+  atomic_store_explicit(&slot->seqlock, seqlock + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  memcpy((uint8_t*) (slot + 1), buffer, size);
+  slot->seq = seq;
+  slot->timestamp_us = timestamp_us;
+  slot->size = size;
+
+  atomic_store_explicit(&slot->seqlock, seqlock + 2, memory_order_release);
+  atomic_store_explicit(&header->latest_seq, seq, memory_order_release);
+
+  atomic_fetch_add_explicit(&header->futex, 1, memory_order_release);
+#ifdef __linux__
+  syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#endif
+  return 0;
+}
@@ -0,0 +1,73 @@
+// Shared memory frame publisher
+//
+// Publishes each camera frame into a POSIX shared memory ring so that other
+// processes on the same host can read the latest JPEG straight out of the
+// mapping, without any sockets or copies.
+//
+// The shared memory object (e.g., "/dev/shm/bambucam" for the name
+// "/bambucam") starts with a shm_header_t, followed by slot_count slots of
+// slot_stride bytes each. Each slot starts with a shm_slot_t, followed by up
+// to slot_size bytes of JPEG data. Frame N lives in slot N % slot_count.
+//
+// Consumers read a frame from a slot under its seqlock:
+//
+//   1. Load latest_seq (acquire) to find the newest frame's slot.
+//   2. Load the slot's seqlock (acquire). If odd, it is being written: retry.
+//   3. Read or decode the frame in place.
+//   4. Load the slot's seqlock again (after an acquire fence). If it changed,
+//      the frame was overwritten while reading: discard and retry.
+//
+// Since the writer cycles through all slots, a consumer usually has
+// slot_count - 1 frame periods to finish reading a frame in place. On Linux,
+// consumers can sleep until the next frame with FUTEX_WAIT (without
+// FUTEX_PRIVATE_FLAG) on the header's futex word, which changes with every
+// frame. Otherwise, poll latest_seq.
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_MAGIC 0x314d4342  // "BCM1" in little endian.
+#define SHM_VERSION 1
+
+// Size reserved for the header before the first slot.
+#define SHM_HEADER_SIZE 4096
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t slot_size;    // Maximum frame size in bytes.
+  uint32_t slot_stride;  // Distance between slots in bytes.
+  uint32_t width;
+  uint32_t height;
+  _Atomic uint32_t futex;  // Incremented on every frame.
+  _Atomic uint64_t latest_seq;  // Newest frame, or zero if none yet.
+} shm_header_t;
+
+typedef struct {
+  _Atomic uint32_t seqlock;  // Odd while the slot is being written.
+  uint32_t reserved;
+  uint64_t seq;  // Frame sequence number, starting at one.
+  int64_t timestamp_us;  // Capture time in microseconds since the Unix epoch.
+  uint64_t size;  // Frame size in bytes.
+} shm_slot_t;
+
+// Opaque pointer to the publisher state. The caller owns this object.
+typedef struct shm_ctx* shm_ctx_t;
+
+// Allocates the objects required to publish frames. The caller is expected to
+// call shm_free_ctx when done with it.
+int shm_alloc_ctx(shm_ctx_t* ctx);
+int shm_free_ctx(shm_ctx_t ctx);
+
+// Creates (or replaces) the shared memory object with the given name, e.g.,
+// "/bambucam", with slots of buffer_size bytes. The object is removed again
+// by shm_stop.
+int shm_start(shm_ctx_t ctx, const char* name, size_t buffer_size,
+              int width, int height);
+int shm_stop(shm_ctx_t ctx);
+
+// Publishes the provided image and wakes up any waiting consumers.
+int shm_send_image(shm_ctx_t ctx, uint8_t* buffer, size_t size,
+                   int64_t timestamp_us);
@@ -0,0 +1,91 @@
+#include "stream_cache.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Entries are small text files named after the device, e.g.,
+// "<directory>/<device>.stream", holding "width height fps".
+#define ENTRY_FORMAT "%s/%s.stream"
+
+static int get_entry_path(const char* directory, const char* device,
+                          char path[PATH_MAX], const char* suffix) {
+  if (strchr(device, '/') != NULL) {
+    fprintf(stderr, "Not caching stream parameters of device: %s\n", device);
+    return -EINVAL;
+  }
+  int res = snprintf(path, PATH_MAX, ENTRY_FORMAT "%s", directory, device,
+                     suffix);
+  if (res < 0 || res >= PATH_MAX) {
+    fprintf(stderr, "Stream cache path is too long\n");
+    return -ENAMETOOLONG;
+  }
+  return 0;
+}
+
+int stream_cache_load(const char* directory, const char* device,
+                      stream_params_t* params) {
+  char path[PATH_MAX];
+  int res = get_entry_path(directory, device, path, "");
+  if (res < 0) {
+    return res;
+  }
+
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    if (errno != ENOENT) {
+      fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+    }
+    return -errno;
+  }
+  res = fscanf(file, "%d %d %d", &params->width, &params->height,
+               &params->fps);
+  fclose(file);
+
+  if (res != 3 || params->width <= 0 || params->height <= 0 ||
+      params->fps <= 0) {
+    fprintf(stderr, "Ignoring malformed stream cache entry %s\n", path);
+    return -EINVAL;
+  }
+  return 0;
+}
+
+int stream_cache_save(const char* directory, const char* device,
+                      const stream_params_t* params) {
+  char path[PATH_MAX];
+  char temp_path[PATH_MAX];
+  int res = get_entry_path(directory, device, path, "");
+  if (res == 0) {
+    res = get_entry_path(directory, device, temp_path, ".tmp");
+  }
+  if (res < 0) {
+    return res;
+  }
+
+  if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Error creating %s: %s\n", directory, strerror(errno));
+    return -errno;
+  }
+
+  // Write then rename, so that readers never see a partial entry.
+  FILE* file = fopen(temp_path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Error opening %s: %s\n", temp_path, strerror(errno));
+    return -errno;
+  }
+  res = fprintf(file, "%d %d %d\n", params->width, params->height,
+                params->fps);
+  if (fclose(file) != 0 || res < 0) {
+    fprintf(stderr, "Error writing %s: %s\n", temp_path, strerror(errno));
+    remove(temp_path);
+    return -EIO;
+  }
+  if (rename(temp_path, path) < 0) {
+    fprintf(stderr, "Error renaming %s: %s\n", temp_path, strerror(errno));
+    remove(temp_path);
+    return -errno;
+  }
+  return 0;
+}
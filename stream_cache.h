@@ -0,0 +1,22 @@
+// Stream parameter cache
+//
+// Remembers each printer's stream parameters on disk, keyed by device, so that
+// startup doesn't need a probe connection just to learn them. Cached values are
+// validated lazily against the first real connection.
+
+// Stream parameters needed before the first connection, e.g., to size encoders.
+typedef struct {
+  int width;
+  int height;
+  int fps;
+} stream_params_t;
+
+// Loads the given device's parameters from the cache directory. Returns a
+// negative value if there is no (valid) entry.
+int stream_cache_load(const char* directory, const char* device,
+                      stream_params_t* params);
+
+// Stores the given device's parameters in the cache directory, replacing any
+// previous entry.
+int stream_cache_save(const char* directory, const char* device,
+                      const stream_params_t* params);
@@ -0,0 +1,38 @@
+// Runs the unit tests of every module (see test.h).
+//
+// Usage: bambucam-test
+
+#include "test.h"
+
+#include <stdio.h>
+
+void test_fill_frame(uint8_t* buffer, size_t size, int64_t timestamp_us) {
+  for (size_t i = 0; i < size; i++) {
+    buffer[i] = (uint8_t) (timestamp_us + i);
+  }
+}
+
+int test_is_frame(const uint8_t* buffer, size_t size, int64_t timestamp_us) {
+  for (size_t i = 0; i < size; i++) {
+    if (buffer[i] != (uint8_t) (timestamp_us + i)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int main(void) {
+  test_config();
+  test_frame_ring();
+  test_recorder();
+  test_websocket();
+  test_stream_cache();
+  test_connect_limit();
+  test_frame_queue();
+  test_trace();
+  test_jpeg_transform();
+  test_jpeg_validate();
+  test_frame_mailbox();
+  printf("All tests passed\n");
+  return 0;
+}
@@ -0,0 +1,30 @@
+// Unit tests
+//
+// Tests of the modules that need neither a camera, a server nor a client, one
+// file per module, e.g., test_frame_ring.c for frame_ring.c. Each test asserts
+// on the documented behavior of its module, so that any failure aborts with
+// the failing line. test.c runs them all.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fills a frame with bytes derived from its timestamp, so that readers can
+// tell frames apart and spot torn copies.
+void test_fill_frame(uint8_t* buffer, size_t size, int64_t timestamp_us);
+
+// Returns whether the given frame was filled by test_fill_frame with the given
+// timestamp.
+int test_is_frame(const uint8_t* buffer, size_t size, int64_t timestamp_us);
+
+// Tests of each module, in the order test.c runs them.
+void test_config(void);
+void test_frame_ring(void);
+void test_recorder(void);
+void test_websocket(void);
+void test_stream_cache(void);
+void test_connect_limit(void);
+void test_frame_queue(void);
+void test_trace(void);
+void test_jpeg_transform(void);
+void test_jpeg_validate(void);
+void test_frame_mailbox(void);
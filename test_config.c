@@ -0,0 +1,51 @@
+#include "config.h"
+#include "test.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void test_config(void) {
+  assert(config_set("test_string=value") == 0);
+  assert(config_set("test_int=0x10") == 0);
+  assert(config_set("test_double=2.5") == 0);
+  assert(config_set("test_bool=yes") == 0);
+  assert(config_set("=value") < 0);
+  assert(config_set("test_missing_separator") < 0);
+
+  assert(strcmp(config_get_string("test_string", "default"), "value") == 0);
+  assert(strcmp(config_get_string("test_unset", "default"), "default") == 0);
+  assert(config_get_int("test_int", 0) == 16);
+  assert(config_get_double("test_double", 0) == 2.5);
+  assert(config_get_bool("test_bool", false));
+  assert(config_get_int("test_string", 7) == 7);  // Malformed.
+  assert(config_get_bool("test_string", true));
+
+  // Setting an option again replaces its value.
+  assert(config_set("test_string=other") == 0);
+  assert(strcmp(config_get_string("test_string", "default"), "other") == 0);
+
+  // Options from the command line take precedence over the file's, and
+  // reloading unsets options removed from the file.
+  char path[] = "/tmp/bambucam-test-XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  FILE* file = fdopen(fd, "w");
+  fputs("# Comment\n\n  test_file = from file  \ntest_int=1\n", file);
+  fclose(file);
+  unsigned generation = config_get_generation();
+  assert(config_load_file(path) == 0);
+  assert(config_get_generation() != generation);
+  assert(strcmp(config_get_string("test_file", ""), "from file") == 0);
+  assert(config_get_int("test_int", 0) == 16);
+
+  file = fopen(path, "w");
+  fputs("test_other=1\n", file);
+  fclose(file);
+  assert(config_load_file(path) == 0);
+  assert(config_get_string("test_file", NULL) == NULL);
+  assert(config_get_int("test_other", 0) == 1);
+  unlink(path);
+}
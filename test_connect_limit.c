@@ -0,0 +1,62 @@
+#include "config.h"
+#include "connect_limit.h"
+#include "test.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void test_connect_limit(void) {
+  atomic_bool is_stopping = true;
+  int slot;
+  assert(connect_limit_acquire(&slot, &is_stopping) == 0);
+  assert(slot == -1);  // No limit configured.
+  connect_limit_release(slot);
+
+  char parent[] = "/tmp/bambucam-test-XXXXXX";
+  assert(mkdtemp(parent) != NULL);
+  char directory[PATH_MAX];
+  snprintf(directory, sizeof(directory), "%s/connect", parent);
+  char option[PATH_MAX + 32];
+  snprintf(option, sizeof(option), "connect_lock_dir=%s", directory);
+  assert(config_set(option) == 0);
+  assert(config_set("connect_limit=2") == 0);
+
+  // The directory is shared by all users, whatever the umask.
+  int slots[2];
+  assert(connect_limit_acquire(&slots[0], &is_stopping) == 0);
+  struct stat st;
+  assert(stat(directory, &st) == 0);
+  assert((st.st_mode & 07777) == 01777);
+
+  // Once both slots are held, waiting is canceled by stopping, until one is
+  // released.
+  assert(connect_limit_acquire(&slots[1], &is_stopping) == 0);
+  assert(slots[0] >= 0 && slots[1] >= 0 && slots[0] != slots[1]);
+  assert(connect_limit_acquire(&slot, &is_stopping) == -ECANCELED);
+  connect_limit_release(slots[0]);
+  assert(connect_limit_acquire(&slot, &is_stopping) == 0);
+  connect_limit_release(slot);
+  connect_limit_release(slots[1]);
+
+  // Slot files that can't be opened fail rather than count as busy.
+  char path[PATH_MAX + 16];
+  for (int i = 0; i < 2; i++) {
+    snprintf(path, sizeof(path), "%s/slot-%d", directory, i);
+    assert(unlink(path) == 0);
+    assert(mkdir(path, 0755) == 0);
+  }
+  assert(connect_limit_acquire(&slot, &is_stopping) == -EISDIR);
+
+  for (int i = 0; i < 2; i++) {
+    snprintf(path, sizeof(path), "%s/slot-%d", directory, i);
+    assert(rmdir(path) == 0);
+  }
+  assert(rmdir(directory) == 0);
+  assert(rmdir(parent) == 0);
+  assert(config_set("connect_limit=0") == 0);
+}
@@ -0,0 +1,69 @@
+#include "frame_mailbox.h"
+#include "test.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+
+// Frames posted by the producer of the threaded mailbox test.
+#define MAILBOX_NUM_FRAMES 100000
+
+typedef struct {
+  frame_mailbox_t mailbox;
+  size_t frame_size;
+} mailbox_test_t;
+
+static void* mailbox_producer_routine(void* arg) {
+  mailbox_test_t* test = (mailbox_test_t*) arg;
+  for (int64_t i = 1; i <= MAILBOX_NUM_FRAMES; i++) {
+    uint8_t* buffer = frame_mailbox_get_buffer(test->mailbox);
+    test_fill_frame(buffer, test->frame_size, i);
+    frame_mailbox_post(test->mailbox, test->frame_size, i);
+  }
+  return NULL;
+}
+
+void test_frame_mailbox(void) {
+  frame_mailbox_t mailbox;
+  assert(frame_mailbox_alloc(&mailbox, 64) == 0);
+  uint8_t* buffer;
+  size_t size;
+  int64_t timestamp_us;
+
+  // Only the latest frame is taken, the ones before it are skipped.
+  for (int64_t i = 0; i < 3; i++) {
+    test_fill_frame(frame_mailbox_get_buffer(mailbox), 64, i);
+    frame_mailbox_post(mailbox, 64, i);
+  }
+  assert(frame_mailbox_take(mailbox, &buffer, &size, &timestamp_us) == 0);
+  assert(size == 64 && timestamp_us == 2 && test_is_frame(buffer, size, 2));
+  assert(frame_mailbox_skipped(mailbox) == 2);
+
+  frame_mailbox_close(mailbox);
+  assert(frame_mailbox_take(mailbox, &buffer, &size, &timestamp_us) ==
+         -ECANCELED);
+  frame_mailbox_free(mailbox);
+
+  // Racing a producer, every taken frame is newer than the previous one and
+  // never torn, and every posted frame is either taken or skipped.
+  mailbox_test_t test = { .frame_size = 4096 };
+  assert(frame_mailbox_alloc(&test.mailbox, test.frame_size) == 0);
+  pthread_t producer;
+  assert(pthread_create(&producer, NULL, &mailbox_producer_routine,
+                        &test) == 0);
+  int64_t previous_us = 0;
+  uint64_t num_taken = 0;
+  while (previous_us < MAILBOX_NUM_FRAMES) {
+    assert(frame_mailbox_take(test.mailbox, &buffer, &size,
+                              &timestamp_us) == 0);
+    assert(timestamp_us > previous_us);
+    assert(size == test.frame_size &&
+           test_is_frame(buffer, size, timestamp_us));
+    previous_us = timestamp_us;
+    num_taken++;
+  }
+  assert(pthread_join(producer, NULL) == 0);
+  assert(num_taken + frame_mailbox_skipped(test.mailbox) ==
+         MAILBOX_NUM_FRAMES);
+  frame_mailbox_free(test.mailbox);
+}
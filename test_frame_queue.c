@@ -0,0 +1,50 @@
+#include "frame_queue.h"
+#include "test.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+
+void test_frame_queue(void) {
+  frame_queue_policy_t policy;
+  assert(frame_queue_parse_policy("drop-oldest", &policy) == 0);
+  assert(policy == FRAME_QUEUE_DROP_OLDEST);
+  assert(frame_queue_parse_policy("drop-newest", &policy) == 0);
+  assert(policy == FRAME_QUEUE_DROP_NEWEST);
+  assert(frame_queue_parse_policy("drop-none", &policy) < 0);
+
+  uint8_t frame[64];
+  size_t size;
+  int64_t timestamp_us;
+  frame_queue_policy_t policies[] = {
+    FRAME_QUEUE_DROP_OLDEST, FRAME_QUEUE_DROP_NEWEST
+  };
+  for (size_t p = 0; p < 2; p++) {
+    frame_queue_t queue;
+    assert(frame_queue_alloc(&queue, 2, sizeof(frame), policies[p]) == 0);
+    uint8_t* buffer = malloc(sizeof(frame));
+
+    for (int64_t i = 0; i < 3; i++) {
+      test_fill_frame(frame, sizeof(frame), i);
+      assert(frame_queue_push(queue, frame, sizeof(frame), i) == 0);
+    }
+    assert(frame_queue_dropped(queue) == 1);
+    assert(frame_queue_push(queue, frame, sizeof(frame) + 1, 3) < 0);
+
+    // Either the oldest or the newest frame was dropped.
+    int64_t first = policies[p] == FRAME_QUEUE_DROP_OLDEST ? 1 : 0;
+    for (int64_t i = first; i < first + 2; i++) {
+      assert(frame_queue_pop(queue, &buffer, &size, &timestamp_us) == 0);
+      assert(size == sizeof(frame) && timestamp_us == i);
+      assert(test_is_frame(buffer, size, i));
+    }
+
+    frame_queue_close(queue);
+    assert(frame_queue_pop(queue, &buffer, &size, &timestamp_us) ==
+           -ECANCELED);
+    assert(frame_queue_push(queue, frame, sizeof(frame), 3) == -ECANCELED);
+    free(buffer);
+    frame_queue_free(queue);
+  }
+}
+
@@ -0,0 +1,52 @@
+#include "frame_ring.h"
+#include "test.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+
+void test_frame_ring(void) {
+  // 16 KiB only fits two 6 KiB frames.
+  frame_ring_t ring;
+  assert(frame_ring_alloc(&ring, 16 * 1024) == 0);
+  uint8_t frame[6 * 1024];
+  uint8_t buffer[6 * 1024];
+  size_t size;
+  int64_t timestamp_us;
+
+  assert(frame_ring_next(ring) == 0);
+  assert(frame_ring_read(ring, 0, 0, buffer, sizeof(buffer), &size,
+                         &timestamp_us) == -EAGAIN);
+  for (int64_t i = 0; i < 3; i++) {
+    test_fill_frame(frame, sizeof(frame), i * 100);
+    assert(frame_ring_push(ring, frame, sizeof(frame), i * 100) == 0);
+  }
+  assert(frame_ring_next(ring) == 3);
+
+  assert(frame_ring_read(ring, 0, 0, buffer, sizeof(buffer), &size,
+                         &timestamp_us) == -ENOENT);
+  assert(frame_ring_read(ring, 2, 0, buffer, sizeof(buffer), &size,
+                         &timestamp_us) == (ssize_t) sizeof(frame));
+  assert(size == sizeof(frame) && timestamp_us == 200);
+  assert(test_is_frame(buffer, size, 200));
+
+  // Partial reads, and fetching only the details.
+  assert(frame_ring_read(ring, 1, 1000, buffer, 10, &size,
+                         &timestamp_us) == 10);
+  assert(buffer[0] == (uint8_t) (100 + 1000));
+  assert(frame_ring_read(ring, 1, 0, NULL, 0, &size, &timestamp_us) == 0);
+  assert(size == sizeof(frame) && timestamp_us == 100);
+  assert(frame_ring_read(ring, 1, sizeof(frame), buffer, sizeof(buffer),
+                         &size, &timestamp_us) == 0);
+
+  assert(frame_ring_find(ring, 0) == 1);  // Frame 0 was evicted.
+  assert(frame_ring_find(ring, 100) == 1);
+  assert(frame_ring_find(ring, 150) == 2);
+  assert(frame_ring_find(ring, 201) == 3);
+
+  uint8_t* too_large = calloc(1, 32 * 1024);
+  assert(frame_ring_push(ring, too_large, 32 * 1024, 300) < 0);
+  assert(frame_ring_next(ring) == 3);
+  free(too_large);
+  frame_ring_free(ring);
+}
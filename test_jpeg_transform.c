@@ -0,0 +1,108 @@
+#include "jpeg_transform.h"
+#include "test.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <jpeglib.h>
+
+#define WIDTH 100
+#define HEIGHT 80
+
+// Encodes a frame of noise, which takes realistic sizes, at the given quality
+// with the default 2x2 chroma subsampling, i.e., 16x16 pixel MCUs.
+static void encode_frame(int quality, uint8_t** buffer, size_t* size) {
+  struct jpeg_compress_struct info;
+  struct jpeg_error_mgr error;
+  info.err = jpeg_std_error(&error);
+  jpeg_create_compress(&info);
+  unsigned long mem_size = 0;
+  *buffer = NULL;
+  jpeg_mem_dest(&info, buffer, &mem_size);
+  info.image_width = WIDTH;
+  info.image_height = HEIGHT;
+  info.input_components = 3;
+  info.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&info);
+  jpeg_set_quality(&info, quality, TRUE);
+  jpeg_start_compress(&info, TRUE);
+
+  JSAMPLE row[WIDTH * 3];
+  unsigned int seed = 1;
+  while (info.next_scanline < HEIGHT) {
+    for (int i = 0; i < WIDTH * 3; i++) {
+      row[i] = rand_r(&seed);
+    }
+    JSAMPROW rows[] = { row };
+    jpeg_write_scanlines(&info, rows, 1);
+  }
+  jpeg_finish_compress(&info);
+  jpeg_destroy_compress(&info);
+  *size = mem_size;
+}
+
+// Fully decodes the given JPEG, passing its dimensions.
+static void decode_frame(const uint8_t* buffer, size_t size, int* width,
+                         int* height) {
+  struct jpeg_decompress_struct info;
+  struct jpeg_error_mgr error;
+  info.err = jpeg_std_error(&error);
+  jpeg_create_decompress(&info);
+  jpeg_mem_src(&info, buffer, size);
+  assert(jpeg_read_header(&info, TRUE) == JPEG_HEADER_OK);
+  jpeg_start_decompress(&info);
+  JSAMPLE* row = malloc(info.output_width * info.output_components);
+  while (info.output_scanline < info.output_height) {
+    JSAMPROW rows[] = { row };
+    jpeg_read_scanlines(&info, rows, 1);
+  }
+  assert(error.num_warnings == 0);
+  *width = info.output_width;
+  *height = info.output_height;
+  free(row);
+  jpeg_finish_decompress(&info);
+  jpeg_destroy_decompress(&info);
+}
+
+void test_jpeg_transform(void) {
+  uint8_t* frame;
+  size_t frame_size;
+  encode_frame(95, &frame, &frame_size);
+  uint8_t* output = malloc(frame_size);
+  int width;
+  int height;
+
+  // Lower quality frames decode like the original, only smaller.
+  ssize_t size = jpeg_requantize(frame, frame_size, 4, output, frame_size);
+  assert(size > 0 && (size_t) size < frame_size);
+  decode_frame(output, size, &width, &height);
+  assert(width == WIDTH && height == HEIGHT);
+  assert(jpeg_requantize(frame, frame_size, 4, output, size / 2) < 0);
+  assert(jpeg_requantize(frame + 2, frame_size - 2, 4, output,
+                         frame_size) < 0);  // Not a JPEG.
+
+  // Crops start on the MCU boundary up and left of the region, growing it to
+  // still cover the region.
+  size = jpeg_crop(frame, frame_size, 20, 40, 40, 20, output, frame_size);
+  assert(size > 0);
+  decode_frame(output, size, &width, &height);
+  assert(width == 44 && height == 28);
+
+  // Regions are clipped to the image, and fail outside of it.
+  size = jpeg_crop(frame, frame_size, 64, 70, 100, 100, output, frame_size);
+  assert(size > 0);
+  decode_frame(output, size, &width, &height);
+  assert(width == WIDTH - 64 && height == HEIGHT - 64);
+  assert(jpeg_crop(frame, frame_size, WIDTH, 0, 16, 16, output,
+                   frame_size) < 0);
+  assert(jpeg_crop(frame, frame_size, 0, HEIGHT + 16, 16, 16, output,
+                   frame_size) < 0);
+  assert(jpeg_crop(frame, frame_size, 0, 0, 0, 16, output, frame_size) < 0);
+
+  // Crops that don't fit fail rather than write past the output.
+  assert(jpeg_crop(frame, frame_size, 0, 0, WIDTH, HEIGHT, output, 64) < 0);
+
+  free(output);
+  free(frame);
+}
@@ -0,0 +1,40 @@
+#include "jpeg_validate.h"
+#include "test.h"
+
+#include <assert.h>
+
+void test_jpeg_validate(void) {
+  // Headers, then a scan with a stuffed byte and a restart marker, the EOI
+  // and trailing bytes.
+  static const uint8_t jpeg[] = {
+    0xFF, 0xD8,
+    0xFF, 0xE0, 0x00, 0x04, 0x00, 0x00,
+    0xFF, 0xDA, 0x00, 0x02,
+    0x12, 0xFF, 0x00, 0x34, 0xFF, 0xD0, 0x56,
+    0xFF, 0xD9,
+    0x00, 0x00,
+  };
+  size_t length;
+  assert(jpeg_validate(jpeg, sizeof(jpeg), &length) == JPEG_VALID);
+  assert(length == sizeof(jpeg) - 2);
+
+  // Cut in the scan, in a restart marker, or in the EOI marker.
+  assert(jpeg_validate(jpeg, 16, &length) == JPEG_TRUNCATED);
+  assert(length == 16);
+  assert(jpeg_validate(jpeg, 17, &length) == JPEG_TRUNCATED);
+  assert(length == 16);
+  assert(jpeg_validate(jpeg, 20, &length) == JPEG_TRUNCATED);
+  assert(length == 19);
+
+  uint8_t repaired[sizeof(jpeg) + JPEG_EOI_SIZE];
+  size_t repaired_size = jpeg_repair(jpeg, 16, repaired);
+  assert(repaired_size == 16 + JPEG_EOI_SIZE);
+  assert(jpeg_validate(repaired, repaired_size, &length) == JPEG_VALID);
+  assert(length == repaired_size);
+
+  // Not a JPEG, cut before the scan, or with a broken segment.
+  static const uint8_t broken[] = { 0xFF, 0xD8, 0xFF, 0xE0, 0x00, 0x01 };
+  assert(jpeg_validate(jpeg + 1, sizeof(jpeg) - 1, &length) == JPEG_INVALID);
+  assert(jpeg_validate(jpeg, 10, &length) == JPEG_INVALID);
+  assert(jpeg_validate(broken, sizeof(broken), &length) == JPEG_INVALID);
+}
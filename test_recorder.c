@@ -0,0 +1,76 @@
+#include "config.h"
+#include "recorder.h"
+#include "test.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FRAME_SIZE_MAX 4096
+
+// Reads the whole given file into buffer, returning its size.
+static size_t read_file(const char* path, void* buffer, size_t size) {
+  FILE* file = fopen(path, "rb");
+  assert(file != NULL);
+  size_t read = fread(buffer, 1, size, file);
+  assert(fgetc(file) == EOF);
+  fclose(file);
+  return read;
+}
+
+void test_recorder(void) {
+  char directory[] = "/tmp/bambucam-test-XXXXXX";
+  assert(mkdtemp(directory) != NULL);
+  assert(config_set("record_every=2") == 0);
+  assert(config_set("record_change_percent=0") == 0);
+
+  recorder_ctx_t recorder;
+  assert(recorder_alloc_ctx(&recorder) == 0);
+  assert(recorder_start(recorder, directory, FRAME_SIZE_MAX) == 0);
+
+  // Every other frame is selected, unless forced, e.g., on print events.
+  uint8_t frame[FRAME_SIZE_MAX];
+  for (int64_t i = 0; i < 6; i++) {
+    size_t size = 1000 + i * 100;
+    test_fill_frame(frame, size, 1000 + i);
+    assert(recorder_submit(recorder, frame, size, 1000 + i, i == 5) == 0);
+  }
+  assert(recorder_submit(recorder, frame, FRAME_SIZE_MAX + 1, 2000, true) < 0);
+  assert(recorder_stop(recorder) == 0);
+  recorder_free_ctx(recorder);
+
+  // A single segment, named after its first frame, where every index entry
+  // points at its frame in the data file, back to back.
+  char data_path[PATH_MAX];
+  char index_path[PATH_MAX];
+  snprintf(data_path, sizeof(data_path), "%s/" RECORDER_SEGMENT_PREFIX
+           "%020" PRId64 RECORDER_DATA_SUFFIX, directory, (int64_t) 1000);
+  snprintf(index_path, sizeof(index_path), "%s/" RECORDER_SEGMENT_PREFIX
+           "%020" PRId64 RECORDER_INDEX_SUFFIX, directory, (int64_t) 1000);
+  static uint8_t data[6 * FRAME_SIZE_MAX];
+  recorder_index_entry_t entries[8];
+  size_t data_size = read_file(data_path, data, sizeof(data));
+  size_t index_size = read_file(index_path, entries, sizeof(entries));
+
+  static const int64_t recorded[] = { 0, 2, 4, 5 };
+  assert(index_size == sizeof(recorded) / sizeof(recorded[0]) *
+                       sizeof(recorder_index_entry_t));
+  uint64_t offset = 0;
+  for (size_t i = 0; i < sizeof(recorded) / sizeof(recorded[0]); i++) {
+    int64_t timestamp_us = 1000 + recorded[i];
+    assert(entries[i].timestamp_us == timestamp_us);
+    assert(entries[i].offset == offset);
+    assert(entries[i].size == (uint64_t) (1000 + recorded[i] * 100));
+    assert(test_is_frame(data + offset, entries[i].size, timestamp_us));
+    offset += entries[i].size;
+  }
+  assert(data_size == offset);
+
+  unlink(data_path);
+  unlink(index_path);
+  assert(rmdir(directory) == 0);
+}
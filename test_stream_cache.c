@@ -0,0 +1,50 @@
+#include "stream_cache.h"
+#include "test.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+void test_stream_cache(void) {
+  char parent[] = "/tmp/bambucam-test-XXXXXX";
+  assert(mkdtemp(parent) != NULL);
+  char directory[PATH_MAX];
+  snprintf(directory, sizeof(directory), "%s/cache", parent);
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/printer.stream", directory);
+
+  // Nothing cached yet, and saving creates the directory.
+  stream_params_t params;
+  assert(stream_cache_load(directory, "printer", &params) == -ENOENT);
+  stream_params_t saved = { .width = 1920, .height = 1080, .fps = 30 };
+  assert(stream_cache_save(directory, "printer", &saved) == 0);
+  assert(stream_cache_load(directory, "printer", &params) == 0);
+  assert(params.width == 1920 && params.height == 1080 && params.fps == 30);
+
+  // Saving replaces the entry, without leaving the temporary file behind.
+  saved.fps = 15;
+  assert(stream_cache_save(directory, "printer", &saved) == 0);
+  assert(stream_cache_load(directory, "printer", &params) == 0);
+  assert(params.fps == 15);
+  char temp_path[PATH_MAX];
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+  assert(access(temp_path, F_OK) < 0);
+
+  // Malformed entries are ignored.
+  FILE* file = fopen(path, "w");
+  assert(file != NULL);
+  fprintf(file, "1920 0 30\n");
+  fclose(file);
+  assert(stream_cache_load(directory, "printer", &params) == -EINVAL);
+
+  // Devices that would escape the directory aren't cached.
+  assert(stream_cache_save(directory, "../printer", &saved) == -EINVAL);
+  assert(stream_cache_load(directory, "../printer", &params) == -EINVAL);
+
+  unlink(path);
+  assert(rmdir(directory) == 0);
+  assert(rmdir(parent) == 0);
+}
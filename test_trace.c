@@ -0,0 +1,49 @@
+#include "config.h"
+#include "trace.h"
+#include "test.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Returns whether the given trace JSON has a span of the given frame.
+static int has_span(const char* json, int64_t frame_timestamp_us) {
+  char arg[64];
+  snprintf(arg, sizeof(arg), "\"frame_us\":%ld}", (long) frame_timestamp_us);
+  return strstr(json, arg) != NULL;
+}
+
+void test_trace(void) {
+  assert(trace_begin() == 0);  // Disabled by default.
+  trace_end("span", 0, 1);
+
+  // Only the spans the thread can't be overwriting are written, i.e., the last
+  // three of a buffer of four.
+  assert(config_set("trace=1") == 0);
+  assert(config_set("trace_events=4") == 0);
+  trace_configure();
+  for (int64_t i = 0; i < 6; i++) {
+    int64_t start_us = trace_begin();
+    assert(start_us != 0);
+    trace_end("span", start_us, 1000 + i);
+  }
+
+  char* json;
+  size_t json_size;
+  FILE* file = open_memstream(&json, &json_size);
+  assert(file != NULL);
+  assert(trace_write(file) == 0);
+  fclose(file);
+  assert(strncmp(json, "{\"traceEvents\":[", 16) == 0);
+  assert(strcmp(json + json_size - 4, "\n]}\n") == 0);
+  for (int64_t i = 0; i < 6; i++) {
+    assert(has_span(json, 1000 + i) == (i >= 3));
+  }
+  assert(strstr(json, "\"dur\":-") == NULL);
+  free(json);
+
+  assert(config_set("trace=0") == 0);
+  trace_configure();
+  assert(trace_begin() == 0);
+}
@@ -0,0 +1,54 @@
+#include "websocket.h"
+#include "test.h"
+
+#include <assert.h>
+#include <string.h>
+
+void test_websocket(void) {
+  // Example from RFC 6455 section 1.3, which takes two SHA-1 blocks, then
+  // messages taking one and three.
+  char accept[WEBSOCKET_ACCEPT_SIZE];
+  websocket_accept_key("dGhlIHNhbXBsZSBub25jZQ==", accept);
+  assert(strcmp(accept, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") == 0);
+  websocket_accept_key("", accept);
+  assert(strcmp(accept, "Kfh9QIsMVZcl6xEPYxPHzW8SZ8w=") == 0);
+  char long_key[101];
+  memset(long_key, 'x', 100);
+  long_key[100] = '\0';
+  websocket_accept_key(long_key, accept);
+  assert(strcmp(accept, "DJTE+uYDnPxiT+W6VvIG/iPUxv8=") == 0);
+
+  uint8_t header[WEBSOCKET_HEADER_SIZE_MAX];
+  assert(websocket_write_header(header, WEBSOCKET_OPCODE_BINARY, 125) == 2);
+  assert(header[0] == 0x82 && header[1] == 125);
+  assert(websocket_write_header(header, WEBSOCKET_OPCODE_BINARY, 126) == 4);
+  assert(header[1] == 126 && header[2] == 0 && header[3] == 126);
+  assert(websocket_write_header(header, WEBSOCKET_OPCODE_TEXT, 65535) == 4);
+  assert(header[0] == 0x81 && header[2] == 0xFF && header[3] == 0xFF);
+  assert(websocket_write_header(header, WEBSOCKET_OPCODE_BINARY,
+                                65536) == 10);
+  assert(header[1] == 127 && header[7] == 1 && header[8] == 0 &&
+         header[9] == 0);
+
+  // Masked "Hello" from RFC 6455 section 5.7, followed by a partial frame.
+  uint8_t frame[] = {
+    0x81, 0x85, 0x37, 0xFA, 0x21, 0x3D, 0x7F, 0x9F, 0x4D, 0x51, 0x58,
+    0x89, 0x80,
+  };
+  uint8_t opcode;
+  uint8_t* payload;
+  size_t payload_size;
+  assert(websocket_parse_frame(frame, 10, &opcode, &payload,
+                               &payload_size) == 0);
+  assert(websocket_parse_frame(frame, sizeof(frame), &opcode, &payload,
+                               &payload_size) == 11);
+  assert(opcode == WEBSOCKET_OPCODE_TEXT && payload_size == 5);
+  assert(memcmp(payload, "Hello", 5) == 0);
+  assert(websocket_parse_frame(frame + 11, 2, &opcode, &payload,
+                               &payload_size) == 0);
+
+  // Clients must mask their frames.
+  uint8_t unmasked[] = { 0x81, 0x05, 'H', 'e', 'l', 'l', 'o' };
+  assert(websocket_parse_frame(unmasked, sizeof(unmasked), &opcode, &payload,
+                               &payload_size) < 0);
+}
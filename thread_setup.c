@@ -0,0 +1,157 @@
+#define _GNU_SOURCE  // For CPU affinity and thread names.
+
+#include "thread_setup.h"
+
+#include "config.h"
+#include "metrics.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// Maximum size of an option key, a thread name (including the terminating
+// null character, as limited by Linux) and a metric name.
+#define OPTION_MAX_SIZE 64
+#define NAME_MAX_SIZE 16
+#define METRIC_NAME_SIZE 128
+
+// Maximum number of threads whose CPU time is exported.
+#define MAX_NUM_THREADS 16
+
+#define NANOSECONDS_PER_SEC (1000 * 1000 * 1000)
+
+#ifdef __linux__
+typedef struct {
+  char metric[METRIC_NAME_SIZE];
+  clockid_t clock;
+} thread_entry_t;
+
+static thread_entry_t threads[MAX_NUM_THREADS];
+static size_t num_threads;
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Updates the CPU time metrics before they're formatted.
+static void collect_cpu_time(void) {
+  pthread_mutex_lock(&threads_mutex);
+  for (size_t i = 0; i < num_threads; i++) {
+    struct timespec cpu_time;
+    if (clock_gettime(threads[i].clock, &cpu_time) == 0) {
+      metrics_set(threads[i].metric,
+                  cpu_time.tv_sec + (double) cpu_time.tv_nsec /
+                                    NANOSECONDS_PER_SEC);
+    }  // Otherwise the thread exited, so keep its last value.
+  }
+  pthread_mutex_unlock(&threads_mutex);
+}
+
+static void register_cpu_time(const char* role) {
+  clockid_t clock;
+  if (pthread_getcpuclockid(pthread_self(), &clock) != 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&threads_mutex);
+  if (num_threads == 0) {
+    metrics_add_collector(collect_cpu_time);
+  }
+  if (num_threads < MAX_NUM_THREADS) {
+    thread_entry_t* entry = &threads[num_threads++];
+    snprintf(entry->metric, METRIC_NAME_SIZE,
+             "bambucam_thread_cpu_seconds_total{thread=\"%s\"}", role);
+    entry->clock = clock;
+  }
+  pthread_mutex_unlock(&threads_mutex);
+}
+
+// Parses a CPU list such as "0,2-3" into the given set.
+static int parse_cpus(const char* cpus, cpu_set_t* set) {
+  CPU_ZERO(set);
+  while (*cpus) {
+    char* end;
+    long first = strtol(cpus, &end, 10);
+    long last = first;
+    if (end == cpus) {
+      return -EINVAL;
+    }
+    if (*end == '-') {
+      cpus = end + 1;
+      last = strtol(cpus, &end, 10);
+      if (end == cpus) {
+        return -EINVAL;
+      }
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) {
+      return -EINVAL;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    if (*end == ',') {
+      end++;
+    } else if (*end != '\0') {
+      return -EINVAL;
+    }
+    cpus = end;
+  }
+  return 0;
+}
+#endif
+
+void thread_setup(const char* role) {
+  char option[OPTION_MAX_SIZE];
+  char name[NAME_MAX_SIZE];
+  int res;
+
+  snprintf(name, NAME_MAX_SIZE, "bcam-%s", role);
+#ifdef __APPLE__
+  pthread_setname_np(name);
+#else
+  pthread_setname_np(pthread_self(), name);
+#endif
+
+#ifdef __linux__
+  register_cpu_time(role);
+
+  snprintf(option, OPTION_MAX_SIZE, "%s_cpus", role);
+  const char* cpus = config_get_string(option, NULL);
+  if (cpus) {
+    cpu_set_t set;
+    res = parse_cpus(cpus, &set);
+    if (res == 0) {
+      res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    if (res != 0) {
+      fprintf(stderr, "Error pinning %s thread to CPUs %s: %s\n", role, cpus,
+              strerror(abs(res)));
+    }
+  }
+
+  // Nice values apply per thread on Linux.
+  snprintf(option, OPTION_MAX_SIZE, "%s_nice", role);
+  const char* nice = config_get_string(option, NULL);
+  if (nice && setpriority(PRIO_PROCESS, syscall(SYS_gettid),
+                          config_get_int(option, 0)) < 0) {
+    fprintf(stderr, "Error setting %s thread nice value: %s\n", role,
+            strerror(errno));
+  }
+#endif
+
+  snprintf(option, OPTION_MAX_SIZE, "%s_rt_priority", role);
+  long rt_priority = config_get_int(option, 0);
+  if (rt_priority > 0) {
+    struct sched_param param = { .sched_priority = rt_priority };
+    res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (res != 0) {
+      fprintf(stderr, "Error setting %s thread real-time priority: %s\n", role,
+              strerror(res));
+    }
+  }
+}
@@ -0,0 +1,16 @@
+// Thread setup
+//
+// Applies per-role thread options from the configuration, where a role is a
+// short name such as "capture" or "encoder":
+//
+//   <role>_cpus         CPUs to pin the thread to, e.g., "0,2-3" (Linux only).
+//   <role>_rt_priority  SCHED_FIFO priority from 1 to 99 (needs privileges).
+//   <role>_nice         Nice value of the thread (Linux only).
+//
+// The thread is also named "bcam-<role>" for tools like top and perf, and its
+// CPU time is exported as bambucam_thread_cpu_seconds_total{thread="<role>"}.
+// Threads started by a set up thread inherit its CPUs, scheduling and name.
+
+// Sets up the calling thread for the given role. Failing to apply an option is
+// reported but not fatal.
+void thread_setup(const char* role);
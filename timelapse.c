@@ -0,0 +1,344 @@
+// Exports frames recorded by bambucam (see recorder.h) into an MP4 timelapse
+// video using FFmpeg.
+//
+// Usage: bambucam-timelapse <record-dir> <output.mp4> [fps]
+
+#include "recorder.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FPS_DEFAULT 30
+
+// The FFmpeg objects used to decode recorded JPEG frames and encode them into
+// the output video.
+typedef struct {
+  const char* output_path;
+  int fps;
+
+  AVCodecContext* decoder_ctx;
+  AVCodecContext* encoder_ctx;
+  AVFormatContext* output_format_ctx;
+  AVStream* output_stream;
+  AVPacket* packet;
+  AVFrame* frame;
+  int64_t frame_i;
+} ctx_t;
+
+// Opens the encoder and output file based on the first decoded frame.
+static int open_output(ctx_t* ctx) {
+  int res;
+
+  res = avformat_alloc_output_context2(&ctx->output_format_ctx, NULL, NULL,
+                                       ctx->output_path);
+  if (res < 0) {
+    fprintf(stderr, "Error allocating output context: %s\n", av_err2str(res));
+    return res;
+  }
+
+  // Prefer H.264 if FFmpeg was built with an encoder for it.
+  const AVCodec* encoder_codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  if (!encoder_codec) {
+    encoder_codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+  }
+  if (!encoder_codec) {
+    fprintf(stderr, "Encoder codec not found\n");
+    return -1;
+  }
+
+  ctx->output_stream = avformat_new_stream(ctx->output_format_ctx, NULL);
+  if (!ctx->output_stream) {
+    fprintf(stderr, "Error creating output stream\n");
+    return -1;
+  }
+
+  ctx->encoder_ctx = avcodec_alloc_context3(encoder_codec);
+  if (!ctx->encoder_ctx) {
+    fprintf(stderr, "Error allocating encoder codec context\n");
+    return -1;
+  }
+
+  ctx->encoder_ctx->width = ctx->frame->width;
+  ctx->encoder_ctx->height = ctx->frame->height;
+  ctx->encoder_ctx->bit_rate = ctx->frame->width * ctx->frame->height * 4;
+  ctx->encoder_ctx->time_base = (AVRational) { 1, ctx->fps };
+  ctx->encoder_ctx->framerate = (AVRational) { ctx->fps, 1 };
+  ctx->encoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  if (ctx->output_format_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    ctx->encoder_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  ctx->output_stream->time_base = ctx->encoder_ctx->time_base;
+
+  res = avcodec_open2(ctx->encoder_ctx, encoder_codec, NULL);
+  if (res < 0) {
+    fprintf(stderr, "Error opening encoder codec: %s\n", av_err2str(res));
+    return res;
+  }
+
+  res = avcodec_parameters_from_context(ctx->output_stream->codecpar,
+                                        ctx->encoder_ctx);
+  if (res < 0) {
+    fprintf(stderr, "Error initializing stream parameters: %s\n",
+            av_err2str(res));
+    return res;
+  }
+
+  res = avio_open(&ctx->output_format_ctx->pb, ctx->output_path,
+                  AVIO_FLAG_WRITE);
+  if (res < 0) {
+    fprintf(stderr, "Error opening %s: %s\n", ctx->output_path,
+            av_err2str(res));
+    return res;
+  }
+
+  res = avformat_write_header(ctx->output_format_ctx, NULL);
+  if (res < 0) {
+    fprintf(stderr, "Error writing output header: %s\n", av_err2str(res));
+    return res;
+  }
+  return 0;
+}
+
+// Encodes the decoded frame (or flushes the encoder if is_flush is set) and
+// writes the resulting packets to the output file.
+static int encode_frame(ctx_t* ctx, int is_flush) {
+  int res;
+
+  if (!is_flush) {
+    ctx->frame->pts = ctx->frame_i++;
+  }
+  res = avcodec_send_frame(ctx->encoder_ctx, is_flush ? NULL : ctx->frame);
+  if (res < 0) {
+    fprintf(stderr, "Error sending a frame to encoder: %s\n", av_err2str(res));
+    return res;
+  }
+
+  while (1) {
+    res = avcodec_receive_packet(ctx->encoder_ctx, ctx->packet);
+    if (res == AVERROR(EAGAIN) || res == AVERROR_EOF) {
+      return 0;
+    } else if (res < 0) {
+      fprintf(stderr, "Error receiving encoder result: %s\n", av_err2str(res));
+      return res;
+    }
+
+    av_packet_rescale_ts(ctx->packet, ctx->encoder_ctx->time_base,
+                         ctx->output_stream->time_base);
+    ctx->packet->stream_index = ctx->output_stream->index;
+    res = av_interleaved_write_frame(ctx->output_format_ctx, ctx->packet);
+    if (res < 0) {
+      fprintf(stderr, "Error writing frame: %s\n", av_err2str(res));
+      return res;
+    }
+  }
+}
+
+// Decodes a single recorded JPEG frame and passes it on to the encoder.
+// Corrupt frames are skipped.
+static int export_frame(ctx_t* ctx, const uint8_t* buffer, size_t size) {
+  int res = av_new_packet(ctx->packet, size);  // Adds the required padding.
+  if (res < 0) {
+    fprintf(stderr, "Error allocating packet: %s\n", av_err2str(res));
+    return res;
+  }
+  memcpy(ctx->packet->data, buffer, size);
+
+  res = avcodec_send_packet(ctx->decoder_ctx, ctx->packet);
+  av_packet_unref(ctx->packet);
+  if (res >= 0) {
+    res = avcodec_receive_frame(ctx->decoder_ctx, ctx->frame);
+  }
+  if (res < 0) {
+    fprintf(stderr, "Skipping undecodable frame: %s\n", av_err2str(res));
+    return 0;
+  }
+
+  if (!ctx->encoder_ctx) {
+    res = open_output(ctx);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  res = encode_frame(ctx, 0 /* is_flush */);
+  av_frame_unref(ctx->frame);
+  return res;
+}
+
+// Maps a file into memory, passing its address and size in the given
+// arguments. Empty files map to NULL.
+static int map_file(const char* path, void** data, size_t* size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+    return -errno;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    fprintf(stderr, "Error reading %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -errno;
+  }
+
+  *size = st.st_size;
+  *data = NULL;
+  if (*size > 0) {
+    *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*data == MAP_FAILED) {
+      fprintf(stderr, "Error mapping %s: %s\n", path, strerror(errno));
+      close(fd);
+      return -errno;
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+// Exports every frame of the segment with the given index file name.
+static int export_segment(ctx_t* ctx, const char* directory,
+                          const char* index_name) {
+  char index_path[PATH_MAX];
+  char data_path[PATH_MAX];
+  void* index;
+  void* data;
+  size_t index_size;
+  size_t data_size;
+  int res;
+
+  snprintf(index_path, sizeof(index_path), "%s/%s", directory, index_name);
+  snprintf(data_path, sizeof(data_path), "%s/%.*s" RECORDER_DATA_SUFFIX,
+           directory,
+           (int) (strlen(index_name) - strlen(RECORDER_INDEX_SUFFIX)),
+           index_name);
+
+  res = map_file(index_path, &index, &index_size);
+  if (res < 0) {
+    return res;
+  }
+  res = map_file(data_path, &data, &data_size);
+  if (res < 0) {
+    if (index) munmap(index, index_size);
+    return res;
+  }
+
+  recorder_index_entry_t* entries = (recorder_index_entry_t*) index;
+  size_t count = index_size / sizeof(recorder_index_entry_t);
+  for (size_t i = 0; i < count && res >= 0; i++) {
+    if (entries[i].offset + entries[i].size > data_size) {
+      fprintf(stderr, "Index entry past the end of %s\n", data_path);
+      break;
+    }
+    res = export_frame(ctx, (uint8_t*) data + entries[i].offset,
+                       entries[i].size);
+  }
+
+  if (index) munmap(index, index_size);
+  if (data) munmap(data, data_size);
+  return res;
+}
+
+static int is_index_file(const struct dirent* entry) {
+  size_t length = strlen(entry->d_name);
+  size_t suffix_length = strlen(RECORDER_INDEX_SUFFIX);
+  return strncmp(entry->d_name, RECORDER_SEGMENT_PREFIX,
+                 strlen(RECORDER_SEGMENT_PREFIX)) == 0 &&
+         length > suffix_length &&
+         strcmp(entry->d_name + length - suffix_length,
+                RECORDER_INDEX_SUFFIX) == 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "Usage: %s <record-dir> <output.mp4> [fps]\n", argv[0]);
+    return -1;
+  }
+
+  char* directory = argv[1];
+  ctx_t ctx = {
+    .output_path = argv[2],
+    .fps = argc == 4 ? atoi(argv[3]) : FPS_DEFAULT,
+  };
+  struct dirent** segments = NULL;
+  int num_segments = 0;
+  int res = -1;
+
+  if (ctx.fps <= 0) {
+    fprintf(stderr, "Invalid frame rate: %s\n", argv[3]);
+    return -1;
+  }
+
+  const AVCodec* decoder_codec = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
+  if (!decoder_codec) {
+    fprintf(stderr, "Decoder codec not found\n");
+    goto close_and_exit;
+  }
+  ctx.decoder_ctx = avcodec_alloc_context3(decoder_codec);
+  ctx.packet = av_packet_alloc();
+  ctx.frame = av_frame_alloc();
+  if (!ctx.decoder_ctx || !ctx.packet || !ctx.frame) {
+    fprintf(stderr, "Error allocating decoder objects\n");
+    goto close_and_exit;
+  }
+  res = avcodec_open2(ctx.decoder_ctx, decoder_codec, NULL);
+  if (res < 0) {
+    fprintf(stderr, "Error opening decoder codec: %s\n", av_err2str(res));
+    goto close_and_exit;
+  }
+
+  // Segment names start with zero-padded timestamps, so they sort in time.
+  num_segments = scandir(directory, &segments, is_index_file, alphasort);
+  if (num_segments < 0) {
+    fprintf(stderr, "Error reading %s: %s\n", directory, strerror(errno));
+    res = -errno;
+    goto close_and_exit;
+  }
+
+  for (int i = 0; i < num_segments && res >= 0; i++) {
+    res = export_segment(&ctx, directory, segments[i]->d_name);
+  }
+  if (res < 0) {
+    goto close_and_exit;
+  }
+
+  if (!ctx.encoder_ctx) {
+    fprintf(stderr, "No recorded frames found in %s\n", directory);
+    res = -1;
+    goto close_and_exit;
+  }
+
+  res = encode_frame(&ctx, 1 /* is_flush */);
+  if (res < 0) {
+    goto close_and_exit;
+  }
+  res = av_write_trailer(ctx.output_format_ctx);
+  if (res < 0) {
+    fprintf(stderr, "Error writing output trailer: %s\n", av_err2str(res));
+    goto close_and_exit;
+  }
+  fprintf(stderr, "Exported %ld frames to %s\n", ctx.frame_i, ctx.output_path);
+
+close_and_exit:
+  for (int i = 0; i < num_segments; i++) {
+    free(segments[i]);
+  }
+  free(segments);
+  if (ctx.output_format_ctx) {
+    if (ctx.output_format_ctx->pb) avio_closep(&ctx.output_format_ctx->pb);
+    avformat_free_context(ctx.output_format_ctx);
+  }
+  if (ctx.encoder_ctx) avcodec_free_context(&ctx.encoder_ctx);
+  if (ctx.decoder_ctx) avcodec_free_context(&ctx.decoder_ctx);
+  if (ctx.frame) av_frame_free(&ctx.frame);
+  if (ctx.packet) av_packet_free(&ctx.packet);
+  return res;
+}
@@ -0,0 +1,20 @@
+// Timestamp helpers
+//
+// Frames carry their capture time as microseconds since the Unix epoch so that
+// every stage (camera, servers, clients) can compare against the same clock.
+
+// Guarded, unlike the other headers, since it defines a function that
+// including it twice would redefine.
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#define TIMESTAMP_US_PER_SEC 1000000
+
+// Returns the current wall clock time in microseconds since the Unix epoch.
+static inline int64_t timestamp_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t) ts.tv_sec * TIMESTAMP_US_PER_SEC + ts.tv_nsec / 1000;
+}
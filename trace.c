@@ -0,0 +1,216 @@
+#define _GNU_SOURCE  // For pthread_getname_np.
+
+#include "trace.h"
+
+#include "config.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define TRACE_OPTION "trace"
+#define EVENTS_OPTION "trace_events"
+#define EVENTS_DEFAULT 4096
+
+// Maximum size of a thread name, including the terminating null character.
+#define THREAD_NAME_SIZE 16
+
+// Spans start and end on the monotonic clock, so that wall clock adjustments
+// don't skew their durations.
+typedef struct {
+  const char* name;
+  int64_t start_us;
+  int64_t duration_us;
+  int64_t frame_timestamp_us;
+} event_t;
+
+// A thread's recent spans, where span i lives in events[i % num_events] for
+// the last num_events spans before count. Only the owning thread writes to it,
+// while readers detect spans overwritten as they copied them by checking count
+// again afterwards.
+typedef struct buffer {
+  struct buffer* next;
+  long tid;
+  char thread_name[THREAD_NAME_SIZE];
+  event_t* events;
+  size_t num_events;
+  atomic_uint_fast64_t count;
+
+  // Set once the owning thread exits, after which a new thread may take over
+  // the buffer, e.g., when WebSocket connections come and go.
+  bool is_free;
+} buffer_t;
+
+static atomic_bool is_enabled;
+
+// Every buffer ever allocated, and the size of buffers allocated from now on.
+static buffer_t* buffers;
+static size_t num_events = EVENTS_DEFAULT;
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The calling thread's buffer, also kept in buffer_key to release it when the
+// thread exits.
+static __thread buffer_t* thread_buffer;
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+
+void trace_configure(void) {
+  long events = config_get_int(EVENTS_OPTION, EVENTS_DEFAULT);
+  pthread_mutex_lock(&buffers_mutex);
+  num_events = MAX(events, 1);
+  pthread_mutex_unlock(&buffers_mutex);
+  atomic_store(&is_enabled, config_get_bool(TRACE_OPTION, false));
+}
+
+static int64_t get_monotonic_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 * 1000 + ts.tv_nsec / 1000;
+}
+
+static void release_buffer(void* buffer) {
+  pthread_mutex_lock(&buffers_mutex);
+  ((buffer_t*) buffer)->is_free = true;
+  pthread_mutex_unlock(&buffers_mutex);
+}
+
+static void create_buffer_key(void) {
+  pthread_key_create(&buffer_key, release_buffer);
+}
+
+static long get_thread_id(void) {
+#ifdef __linux__
+  return syscall(SYS_gettid);
+#else
+  static atomic_long next_thread_id = 1;
+  return atomic_fetch_add(&next_thread_id, 1);
+#endif
+}
+
+// Returns the calling thread's buffer, taking over a free one or allocating a
+// new one on first use. Returns NULL on error.
+static buffer_t* get_buffer(void) {
+  if (thread_buffer) {
+    return thread_buffer;
+  }
+  pthread_once(&buffer_key_once, create_buffer_key);
+
+  pthread_mutex_lock(&buffers_mutex);
+  buffer_t* buffer = buffers;
+  while (buffer && !(buffer->is_free && buffer->num_events == num_events)) {
+    buffer = buffer->next;
+  }
+  if (buffer == NULL) {
+    buffer = calloc(1, sizeof(buffer_t));
+    event_t* events = calloc(num_events, sizeof(event_t));
+    if (buffer == NULL || events == NULL) {
+      pthread_mutex_unlock(&buffers_mutex);
+      fprintf(stderr, "Error allocating trace buffer, disabling tracing\n");
+      atomic_store(&is_enabled, false);
+      free(buffer);
+      free(events);
+      return NULL;
+    }
+    buffer->events = events;
+    buffer->num_events = num_events;
+    buffer->next = buffers;
+    buffers = buffer;
+  }
+  buffer->is_free = false;
+  buffer->tid = get_thread_id();
+  atomic_store(&buffer->count, 0);
+  pthread_getname_np(pthread_self(), buffer->thread_name, THREAD_NAME_SIZE);
+  pthread_mutex_unlock(&buffers_mutex);
+
+  pthread_setspecific(buffer_key, buffer);
+  thread_buffer = buffer;
+  return buffer;
+}
+
+int64_t trace_begin(void) {
+  if (!atomic_load_explicit(&is_enabled, memory_order_relaxed)) {
+    return 0;
+  }
+  return get_monotonic_us();
+}
+
+void trace_end(const char* name, int64_t start_us, int64_t frame_timestamp_us) {
+  if (start_us == 0) {
+    return;
+  }
+  int64_t end_us = get_monotonic_us();
+  buffer_t* buffer = get_buffer();
+  if (buffer == NULL) {
+    return;
+  }
+
+  uint64_t count = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+  event_t* event = &buffer->events[count % buffer->num_events];
+  event->name = name;
+  event->start_us = start_us;
+  event->duration_us = end_us - start_us;
+  event->frame_timestamp_us = frame_timestamp_us;
+  atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+}
+
+// Writes the given buffer's spans, each preceded by a separator.
+static int write_buffer(FILE* file, buffer_t* buffer, pid_t pid) {
+  event_t* events = malloc(buffer->num_events * sizeof(event_t));
+  if (events == NULL) {
+    fprintf(stderr, "Error allocating trace copy: %s\n", strerror(errno));
+    return -ENOMEM;
+  }
+
+  // Copy the spans first so that the owning thread can keep recording, then
+  // skip those it overwrote in the meantime.
+  uint64_t end = atomic_load_explicit(&buffer->count, memory_order_acquire);
+  memcpy(events, buffer->events, buffer->num_events * sizeof(event_t));
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t count = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+  // The owning thread may already be writing span count, over the oldest one
+  // still counted.
+  uint64_t begin = count + 1 > buffer->num_events ?
+                   count + 1 - buffer->num_events : 0;
+
+  fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"tid\":%ld,\"args\":{\"name\":\"%s\"}}", pid, buffer->tid,
+          buffer->thread_name);
+  for (uint64_t i = begin; i < end; i++) {
+    event_t* event = &events[i % buffer->num_events];
+    fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,"
+            "\"ts\":%ld,\"dur\":%ld,\"args\":{\"frame_us\":%ld}}",
+            event->name, pid, buffer->tid, event->start_us,
+            event->duration_us, event->frame_timestamp_us);
+  }
+  free(events);
+  return 0;
+}
+
+int trace_write(FILE* file) {
+  pid_t pid = getpid();
+  int res = 0;
+
+  // Starts with a process name, so that every span can follow a separator.
+  fprintf(file, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\","
+          "\"pid\":%d,\"args\":{\"name\":\"bambucam\"}}", pid);
+  pthread_mutex_lock(&buffers_mutex);
+  for (buffer_t* buffer = buffers; buffer && res == 0; buffer = buffer->next) {
+    res = write_buffer(file, buffer, pid);
+  }
+  pthread_mutex_unlock(&buffers_mutex);
+  fprintf(file, "\n]}\n");
+
+  if (res == 0 && ferror(file)) {
+    fprintf(stderr, "Error writing trace\n");
+    res = -EIO;
+  }
+  return res;
+}
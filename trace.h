@@ -0,0 +1,32 @@
+// Tracing
+//
+// Opt-in spans timing each stage of a frame's way through the pipeline, e.g.,
+// reading it from the printer, copying it into the server or encoding it, to
+// find which stage is to blame when a stream stutters. Enabled with
+// "-o trace=1", after which every thread keeps its most recent trace_events
+// spans (4096 by default) in a buffer of its own, so that recording a span
+// never takes a lock.
+//
+// Spans are dumped in the Chrome trace event format, which ui.perfetto.dev and
+// chrome://tracing open, with each span tagged with the capture time of its
+// frame to line up the stages of the same frame. Spans themselves are timed on
+// the monotonic clock, unlike capture times.
+
+#include <stdint.h>
+#include <stdio.h>
+
+// (Re)reads the trace options, e.g., after reloading the configuration.
+void trace_configure(void);
+
+// Returns the start time of a span to pass to trace_end, or zero if tracing is
+// disabled. Only meaningful to trace_end.
+int64_t trace_begin(void);
+
+// Records the span from start_us until now for the frame captured at
+// frame_timestamp_us, or does nothing if start_us is zero. The name must be a
+// string literal, since only the pointer is kept.
+void trace_end(const char* name, int64_t start_us, int64_t frame_timestamp_us);
+
+// Writes every recorded span as Chrome trace JSON. Returns a negative value on
+// error.
+int trace_write(FILE* file);
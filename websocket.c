@@ -0,0 +1,191 @@
+#include "websocket.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+// Appended to the client's key before hashing, as defined by RFC 6455.
+#define ACCEPT_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define SHA1_DIGEST_SIZE 20
+#define SHA1_BLOCK_SIZE 64
+
+#define FIN_BIT 0x80
+#define OPCODE_MASK 0x0F
+#define MASK_BIT 0x80
+#define PAYLOAD_SIZE_MASK 0x7F
+#define PAYLOAD_SIZE_16 126
+#define PAYLOAD_SIZE_64 127
+
+static uint32_t rotate_left(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+static void sha1_block(uint32_t state[5], const uint8_t block[SHA1_BLOCK_SIZE]) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 |
+           (uint32_t) block[i * 4 + 2] << 8 | (uint32_t) block[i * 4 + 3];
+  }
+  for (int i = 16; i < 80; i++) {
+    w[i] = rotate_left(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    uint32_t temp = rotate_left(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotate_left(b, 30);
+    b = a;
+    a = temp;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+// SHA-1 of a short message, which is all the handshake needs.
+static void sha1(const uint8_t* data, size_t size,
+                 uint8_t digest[SHA1_DIGEST_SIZE]) {
+  uint32_t state[5] = {
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+  };
+  uint8_t block[SHA1_BLOCK_SIZE];
+
+  size_t offset = 0;
+  for (; size - offset >= SHA1_BLOCK_SIZE; offset += SHA1_BLOCK_SIZE) {
+    sha1_block(state, data + offset);
+  }
+
+  // Pad the remainder with a one bit, zeros and the message size in bits.
+  size_t remaining = size - offset;
+  memset(block, 0, SHA1_BLOCK_SIZE);
+  memcpy(block, data + offset, remaining);
+  block[remaining] = 0x80;
+  if (remaining >= SHA1_BLOCK_SIZE - 8) {
+    sha1_block(state, block);
+    memset(block, 0, SHA1_BLOCK_SIZE);
+  }
+  uint64_t bits = (uint64_t) size * 8;
+  for (int i = 0; i < 8; i++) {
+    block[SHA1_BLOCK_SIZE - 1 - i] = bits >> (i * 8);
+  }
+  sha1_block(state, block);
+
+  for (int i = 0; i < SHA1_DIGEST_SIZE; i++) {
+    digest[i] = state[i / 4] >> (24 - (i % 4) * 8);
+  }
+}
+
+static void base64_encode(const uint8_t* data, size_t size, char* output) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t i;
+  for (i = 0; i + 2 < size; i += 3) {
+    uint32_t triple = data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+    *output++ = alphabet[(triple >> 18) & 0x3F];
+    *output++ = alphabet[(triple >> 12) & 0x3F];
+    *output++ = alphabet[(triple >> 6) & 0x3F];
+    *output++ = alphabet[triple & 0x3F];
+  }
+  if (i < size) {
+    uint32_t triple = data[i] << 16 | (i + 1 < size ? data[i + 1] << 8 : 0);
+    *output++ = alphabet[(triple >> 18) & 0x3F];
+    *output++ = alphabet[(triple >> 12) & 0x3F];
+    *output++ = i + 1 < size ? alphabet[(triple >> 6) & 0x3F] : '=';
+    *output++ = '=';
+  }
+  *output = '\0';
+}
+
+void websocket_accept_key(const char* key, char accept[WEBSOCKET_ACCEPT_SIZE]) {
+  char input[256];
+  uint8_t digest[SHA1_DIGEST_SIZE];
+
+  // Keys are 24 characters, so only an invalid key would ever be truncated.
+  size_t size = snprintf(input, sizeof(input), "%.200s" ACCEPT_GUID, key);
+  sha1((const uint8_t*) input, size, digest);
+  base64_encode(digest, SHA1_DIGEST_SIZE, accept);
+}
+
+size_t websocket_write_header(uint8_t header[WEBSOCKET_HEADER_SIZE_MAX],
+                              uint8_t opcode, uint64_t payload_size) {
+  header[0] = FIN_BIT | opcode;
+  if (payload_size < PAYLOAD_SIZE_16) {
+    header[1] = payload_size;
+    return 2;
+  }
+  if (payload_size <= UINT16_MAX) {
+    header[1] = PAYLOAD_SIZE_16;
+    header[2] = payload_size >> 8;
+    header[3] = payload_size;
+    return 4;
+  }
+  header[1] = PAYLOAD_SIZE_64;
+  for (int i = 0; i < 8; i++) {
+    header[2 + i] = payload_size >> ((7 - i) * 8);
+  }
+  return 10;
+}
+
+ssize_t websocket_parse_frame(uint8_t* buffer, size_t size, uint8_t* opcode,
+                              uint8_t** payload, size_t* payload_size) {
+  if (size < 2) {
+    return 0;
+  }
+
+  // Clients must mask their frames.
+  if (!(buffer[1] & MASK_BIT)) {
+    return -EPROTO;
+  }
+
+  size_t header_size = 2;
+  uint64_t frame_payload_size = buffer[1] & PAYLOAD_SIZE_MASK;
+  if (frame_payload_size == PAYLOAD_SIZE_16) {
+    header_size += 2;
+    if (size < header_size) {
+      return 0;
+    }
+    frame_payload_size = buffer[2] << 8 | buffer[3];
+  } else if (frame_payload_size == PAYLOAD_SIZE_64) {
+    header_size += 8;
+    if (size < header_size) {
+      return 0;
+    }
+    frame_payload_size = 0;
+    for (int i = 0; i < 8; i++) {
+      frame_payload_size = frame_payload_size << 8 | buffer[2 + i];
+    }
+  }
+
+  uint8_t* mask = buffer + header_size;
+  header_size += 4;
+  if (size < header_size || size - header_size < frame_payload_size) {
+    return 0;
+  }
+
+  *opcode = buffer[0] & OPCODE_MASK;
+  *payload = buffer + header_size;
+  *payload_size = frame_payload_size;
+  for (size_t i = 0; i < frame_payload_size; i++) {
+    (*payload)[i] ^= mask[i % 4];
+  }
+  return header_size + frame_payload_size;
+}
@@ -0,0 +1,38 @@
+// WebSocket protocol helpers
+//
+// The minimal parts of RFC 6455 needed to serve frames over a WebSocket: the
+// opening handshake's accept key, server-to-client frame headers and parsing
+// of (masked) client-to-server frames. Fragmented messages are not supported.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define WEBSOCKET_OPCODE_TEXT 0x1
+#define WEBSOCKET_OPCODE_BINARY 0x2
+#define WEBSOCKET_OPCODE_CLOSE 0x8
+#define WEBSOCKET_OPCODE_PING 0x9
+#define WEBSOCKET_OPCODE_PONG 0xA
+
+// Size of a Sec-WebSocket-Accept value, including the null terminator.
+#define WEBSOCKET_ACCEPT_SIZE 29
+
+// Maximum size of a server-to-client frame header.
+#define WEBSOCKET_HEADER_SIZE_MAX 10
+
+// Computes the Sec-WebSocket-Accept response header value for the client's
+// Sec-WebSocket-Key request header value.
+void websocket_accept_key(const char* key, char accept[WEBSOCKET_ACCEPT_SIZE]);
+
+// Writes the header of an unfragmented, unmasked frame with the given opcode
+// and payload size. Returns the header size in bytes.
+size_t websocket_write_header(uint8_t header[WEBSOCKET_HEADER_SIZE_MAX],
+                              uint8_t opcode, uint64_t payload_size);
+
+// Parses the client frame at the start of buffer, unmasking its payload in
+// place, and passes its opcode and payload in the given arguments.
+//
+// Returns the size of the whole frame in bytes, zero if the buffer doesn't
+// hold a complete frame yet, or a negative value if the frame is malformed.
+ssize_t websocket_parse_frame(uint8_t* buffer, size_t size, uint8_t* opcode,
+                              uint8_t** payload, size_t* payload_size);